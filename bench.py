@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+# Compiler throughput benchmark for eck
+#
+# Generates large Food programs from a seed, compiles each one with
+# bin/eck -ftime-report and writes the throughput of every phase to a CSV,
+# one row per program, so that the results of two versions can be diffed.
+#
+# Usage:
+#   ./bench.py [--seed N] [--size KB] [--repeat N] [--eck PATH] [--csv FILE]
+#   python3 build.py bench
+
+import argparse
+import csv
+import os
+import random
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+# The operators the code generator supports. The right operand of a division
+# or a modulo is always a literal other than zero.
+operators = ['+', '-', '*', '/', '%', '&', '|', '^', '==', '!=']
+divisions = ['/', '%']
+types = ['int', 'long', 'short', 'byte']
+
+# The phases of -ftime-report each column is made of: the code generation of
+# the statements is timed by "statement", the one of the expressions by "generate".
+phases = [
+	('lex', ['lex']),
+	('parse', ['parse']),
+	('fold', ['fold']),
+	('codegen', ['statement', 'generate']),
+	('emit', ['flush']),
+]
+
+# expression:
+# A random expression tree, at most depth levels deep.
+def expression(rng, depth):
+	if depth <= 0 or rng.random() < 0.15:
+		return str(rng.randint(1, 1000))
+	operator = rng.choice(operators)
+	if operator in divisions:
+		return '({} {} {})'.format(expression(rng, depth - 1), operator, rng.randint(1, 1000))
+	return '({} {} {})'.format(expression(rng, depth - 1), operator, expression(rng, depth - 1))
+
+# chain:
+# An expression nested length levels deep, as written by hand in long formulas.
+def chain(rng, length):
+	text = str(rng.randint(1, 1000))
+	for i in range(length):
+		operator = rng.choice(operators)
+		if operator in divisions or rng.random() < 0.5:
+			text = '({} {} {})'.format(text, operator, rng.randint(1, 1000))
+		else:
+			text = '({} {} {})'.format(rng.randint(1, 1000), operator, text)
+	return text
+
+# The shapes of programs: each one returns a top-level statement, as text.
+def deep_expressions(rng, counter):
+	if rng.random() < 0.5:
+		return expression(rng, 10) + ';\n'
+	return chain(rng, rng.randint(50, 200)) + ';\n'
+
+def long_lists(rng, counter):
+	return '{' + ''.join('\t{};\n'.format(expression(rng, 2)) for i in range(500)) + '}\n'
+
+def nested(rng, depth, indent, loops):
+	pad = '\t' * indent
+	if depth == 0:
+		return pad + expression(rng, 3) + ';\n'
+	inner = nested(rng, depth - 1, indent + 1, loops)
+	kind = rng.randint(0, 2)
+	if kind == 0:
+		return '{0}if ({1}) {{\n{2}{0}}} else {{\n{0}\t{3};\n{0}}}\n'.format(pad, expression(rng, 2), inner, expression(rng, 2))
+	# The condition of a do keeps its register until the end of the top-level statement.
+	if kind == 1 or loops[0] == 0:
+		return '{0}while (0) {{\n{1}{0}}}\n'.format(pad, inner)
+	loops[0] -= 1
+	return '{0}do {{\n{1}{0}}} while (0);\n'.format(pad, inner)
+
+def heavy_nesting(rng, counter):
+	return nested(rng, rng.randint(20, 60), 0, [4])
+
+def many_locals(rng, counter):
+	lines = ['\t{} local_{}_{};\n'.format(rng.choice(types), counter[0], i) for i in range(rng.randint(50, 300))]
+	counter[0] += 1
+	return '{\n' + ''.join(lines) + '\t' + expression(rng, 3) + ';\n}\n'
+
+def heavy_comments(rng, counter):
+	words = ['the', 'value', 'of', 'this', 'statement', 'is', 'folded', 'then', 'generated', 'register']
+	text = ''
+	for i in range(rng.randint(2, 6)):
+		sentence = ' '.join(rng.choice(words) for j in range(rng.randint(8, 30)))
+		text += '// {}\n'.format(sentence) if rng.random() < 0.5 else '/* {}\n   {} */\n'.format(sentence, sentence)
+	return text + expression(rng, 3) + ';\n'
+
+shapes = [
+	('deep_expressions', deep_expressions),
+	('long_lists', long_lists),
+	('heavy_nesting', heavy_nesting),
+	('many_locals', many_locals),
+	('heavy_comments', heavy_comments),
+]
+
+# generate:
+# Writes statements of a shape until the program has size bytes. The same seed
+# always gives the same program.
+def generate(shape, seed, size):
+	rng = random.Random('{}:{}'.format(seed, shape[0]))
+	counter = [0]
+	parts = []
+	length = 0
+	while length < size:
+		statement = shape[1](rng, counter)
+		parts.append(statement)
+		length += len(statement)
+	return ''.join(parts)
+
+comment = re.compile(r'//[^\n]*|/\*.*?\*/', re.S)
+token = re.compile(r'[A-Za-z_]\w*|\d+|<<|>>|==|!=|&&|\|\||\S')
+
+# count_tokens:
+# The tokens of a program, as the lexer sees them.
+def count_tokens(text):
+	return len(token.findall(comment.sub(' ', text)))
+
+report_line = re.compile(r'^\s+(\w+)\s+([\d.]+)\s+([\d.]+)\s+(\d+)\s*$')
+peak_line = re.compile(r'^\s+peak RSS (\d+) KB\s*$')
+
+# run:
+# Compiles a program with -ftime-report. Returns the wall time in seconds, the
+# self time of each phase in milliseconds and the peak RSS in kilobytes.
+def run(eck, source):
+	start = time.perf_counter()
+	process = subprocess.Popen([eck, '-ftime-report', source], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+	errors = process.stderr.read().decode(errors='replace')
+	process.stderr.close()
+	pid, status, usage = os.wait4(process.pid, 0)
+	wall = time.perf_counter() - start
+	if status != 0:
+		sys.exit('{} failed on {}:\n{}'.format(eck, source, errors))
+	times = {}
+	rss = usage.ru_maxrss
+	for line in errors.splitlines():
+		match = report_line.match(line)
+		if match:
+			times[match.group(1)] = float(match.group(3))
+		# On Linux, ru_maxrss counts the memory of this script, which eck was forked from.
+		match = peak_line.match(line)
+		if match:
+			rss = int(match.group(1))
+	return wall, times, rss
+
+# version:
+# The commit the results are for.
+def version():
+	try:
+		return subprocess.check_output(['git', 'describe', '--always', '--dirty'], stderr=subprocess.DEVNULL).decode().strip()
+	except (OSError, subprocess.CalledProcessError):
+		return 'unknown'
+
+def main(argv):
+	parser = argparse.ArgumentParser(description='Measures the throughput of eck on generated programs.')
+	parser.add_argument('--seed', type=int, default=1, help='the seed of the programs (1)')
+	parser.add_argument('--size', type=int, default=1024, help='the size of each program, in kilobytes (1024)')
+	parser.add_argument('--repeat', type=int, default=3, help='the runs of each program, the fastest is kept (3)')
+	parser.add_argument('--eck', default=os.path.join('bin', 'eck'), help='the compiler (bin/eck)')
+	parser.add_argument('--csv', default='bench.csv', help='where the results are written (bench.csv)')
+	args = parser.parse_args(argv)
+
+	header = ['version', 'shape', 'seed', 'bytes', 'tokens', 'wall_ms', 'peak_rss_kb']
+	for name, parts in phases:
+		header += [name + '_ms', name + '_mb_s', name + '_tokens_s']
+	rows = []
+	commit = version()
+	directory = tempfile.mkdtemp(prefix='eck-bench-')
+	print('{:<18} {:>9} {:>9} {:>10} {:>10}   {}'.format('shape', 'KB', 'tokens', 'wall ms', 'peak KB', '  '.join('{:>12}'.format(name + ' MB/s') for name, parts in phases)))
+	for shape in shapes:
+		text = generate(shape, args.seed, args.size * 1024)
+		source = os.path.join(directory, shape[0] + '.fd')
+		with open(source, 'w') as f:
+			f.write(text)
+		tokens = count_tokens(text)
+
+		# The fastest of the runs, the peak RSS being the most of them
+		best = None
+		rss = 0
+		for i in range(args.repeat):
+			wall, times, peak = run(args.eck, source)
+			rss = max(rss, peak)
+			if best is None or wall < best[0]:
+				best = (wall, times)
+		wall, times = best
+
+		row = [commit, shape[0], args.seed, len(text), tokens, '{:.3f}'.format(wall * 1e3), rss]
+		rates = []
+		for name, parts in phases:
+			seconds = sum(times.get(part, 0.0) for part in parts) / 1e3
+			mb = len(text) / 1e6 / seconds if seconds > 0 else 0.0
+			row += ['{:.3f}'.format(seconds * 1e3), '{:.2f}'.format(mb), '{:.0f}'.format(tokens / seconds if seconds > 0 else 0.0)]
+			rates.append(mb)
+		rows.append(row)
+		print('{:<18} {:>9} {:>9} {:>10.1f} {:>10}   {}'.format(shape[0], len(text) // 1024, tokens, wall * 1e3, rss, '  '.join('{:>12.1f}'.format(rate) for rate in rates)))
+		os.remove(source)
+		if os.path.exists(source + '.s'):
+			os.remove(source + '.s')
+	os.rmdir(directory)
+
+	with open(args.csv, 'w', newline='') as f:
+		writer = csv.writer(f)
+		writer.writerow(header)
+		writer.writerows(rows)
+	print('results written to ' + args.csv)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])
@@ -0,0 +1,123 @@
+/*
+	Runtime harness for the code of eck (runbench.py)
+
+	Calls food_kernel, the code of a kernel built by eck or by the C
+	compiler, a number of times and prints what it took:
+
+		iterations 1000000
+		cycles 12000000
+		instructions 31000000
+		branch-misses 12
+		ns 4100000
+
+	The counters are the ones of perf stat, counted in user space for
+	this process with perf_event_open. Where they are not available
+	(not Linux, no PMU in a virtual machine, perf_event_paranoid),
+	the counts are -1 and only the time of clock_gettime is given.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+#define COUNTER_COUNT 3
+
+uint64_t food_kernel(void);
+
+static const char *const s_names[COUNTER_COUNT] = { "cycles", "instructions", "branch-misses" };
+
+/* The counters, -1 if not opened. The first one leads the group. */
+static int s_counters[COUNTER_COUNT] = { -1, -1, -1 };
+
+static void s_open(void)
+{
+#ifdef __linux__
+	static const uint64_t configs[COUNTER_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES
+	};
+	struct perf_event_attr attr;
+	int i;
+
+	for (i = 0; i < COUNTER_COUNT; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.disabled = i == 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		s_counters[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, i ? s_counters[0] : -1, 0);
+		if (s_counters[i] < 0 && i == 0) {
+			fprintf(stderr, "perf_event_open is not available, only the time is measured\n");
+			return;
+		}
+	}
+#endif
+}
+
+static void s_enable(int on)
+{
+#ifdef __linux__
+	if (s_counters[0] < 0) return;
+	if (on) ioctl(s_counters[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(s_counters[0], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#else
+	(void)on;
+#endif
+}
+
+static long long s_read(int i)
+{
+	long long yield = -1;
+#ifdef __linux__
+	uint64_t value;
+	if (s_counters[i] >= 0 && read(s_counters[i], &value, sizeof(value)) == sizeof(value)) yield = (long long)value;
+#else
+	(void)i;
+#endif
+	return yield;
+}
+
+static uint64_t s_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	unsigned long i;
+	volatile uint64_t sink = 0;
+	uint64_t start, end;
+	int c;
+
+	/* A first pass warms up the caches and the predictors. */
+	for (i = 0; i < iterations / 10 + 1; i++) {
+		sink += food_kernel();
+	}
+	s_open();
+	start = s_now();
+	s_enable(1);
+	for (i = 0; i < iterations; i++) {
+		sink += food_kernel();
+	}
+	s_enable(0);
+	end = s_now();
+
+	printf("iterations %lu\n", iterations);
+	for (c = 0; c < COUNTER_COUNT; c++) {
+		printf("%s %lld\n", s_names[c], s_read(c));
+	}
+	printf("ns %lu\n", (unsigned long)(end - start));
+	return 0;
+}
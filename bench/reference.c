@@ -0,0 +1,14 @@
+/*
+	The C reference of a kernel (runbench.py)
+
+	The kernels are written in the part of Food that is also C, so
+	the reference is the same source, as the body of food_kernel,
+	built with cc -O2. KERNEL is the path of the kernel.
+*/
+#include <stdint.h>
+
+uint64_t food_kernel(void)
+{
+#include KERNEL
+	return 0;
+}
@@ -4,6 +4,12 @@
 import os
 import glob
 import platform
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
 from pathlib import Path
 
 # Insert the command/path to the compiler to use.
@@ -13,6 +19,9 @@ output = 'eck'
 if platform.system() == 'Windows':
 	output = 'eck.exe'
 	compiler = "tcc" # requires TCC on Windows
+else:
+	cflags += ' -pthread' # code generation threads
+	cflags += ' -ldl' # the hooks of -finstrument-hooks
 
 # compile_single_file:
 # This function takes in a filename and arguments (as one continous string)
@@ -49,12 +58,252 @@ def compile_all(directory):
 	return True
 
 # single_test
+# A test with an "// expect: N" line is also run natively and interpreted,
+# without and with the passes, and must print N each time.
 def single_test(source):
 	command = 'bin/eck ' + source
 	if os.system(command) == 0:
 		print('[TEST OK] ' + command)
 	else:
 		print('[TEST FAIL] ' + command)
+	with open(source) as f:
+		expected = re.search(r'^// expect: (-?\d+)$', f.read(), re.M)
+	if not expected:
+		return
+	for flags in ['-O0 --run', '-O0 --interpret', '-O1 --run', '-O1 --interpret']:
+		command = 'bin/eck {} {}'.format(flags, source)
+		result = subprocess.run(command.split(), stdout=subprocess.PIPE)
+		lines = result.stdout.decode(errors='replace').splitlines()
+		if result.returncode == 0 and lines and lines[0] == expected.group(1):
+			print('[TEST OK] ' + command)
+		else:
+			print('[TEST FAIL] {} (expected {}, got {})'.format(command, expected.group(1), lines[0] if lines else 'nothing'))
+
+# The tests of the driver compile copies of the sources in a directory of their
+# own, along with one that fails.
+eck = os.path.abspath(os.path.join('bin', output))
+failing = 'int a;\nint a;\n'
+
+# copy_sources:
+# Copies the sources to directory, adds the failing one and returns their names.
+def copy_sources(sources, directory):
+	names = []
+	for source in sources:
+		names.append(os.path.basename(source))
+		shutil.copy(source, os.path.join(directory, names[-1]))
+	names.append('failing.fd')
+	with open(os.path.join(directory, names[-1]), 'w') as f:
+		f.write(failing)
+	return names
+
+# compile_in:
+# Compiles name in directory. Returns the exit status, the diagnostics and the
+# output (None if there is none), which is removed unless kept.
+def compile_in(directory, name, arguments, extension = 's', keep = False):
+	result = subprocess.run([eck] + arguments + [name], cwd = directory, stdout = subprocess.DEVNULL, stderr = subprocess.PIPE)
+	path = os.path.join(directory, name + '.' + extension)
+	produced = None
+	if os.path.exists(path):
+		with open(path, 'rb') as f:
+			produced = f.read()
+		if not keep:
+			os.remove(path)
+	return (result.returncode, result.stderr, produced)
+
+def report(command, ok):
+	print(('[TEST OK] ' if ok else '[TEST FAIL] ') + command)
+
+# server_test:
+# A compilation through the server (--connect) must give the same output,
+# diagnostics and exit status as in-process, with the options of the client.
+def server_test(sources):
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		server = subprocess.Popen([eck, '--server', 'server.sock'], cwd = directory)
+		while not os.path.exists(os.path.join(directory, 'server.sock')) and server.poll() is None:
+			time.sleep(0.01)
+		for name in names:
+			for options in [[], ['-O0', '-fno-asm-comments']]:
+				expected = compile_in(directory, name, options)
+				got = compile_in(directory, name, ['--connect', 'server.sock'] + options)
+				report(' '.join(['bin/eck --connect server.sock'] + options + [name]), got == expected)
+		server.kill()
+		server.wait()
+
+# cache_counts:
+# The hits and the misses of the cache in directory.
+def cache_counts(directory):
+	result = subprocess.run([eck, '--cache-dir', 'cache', '--cache-stats'], cwd = directory, stdout = subprocess.PIPE)
+	text = result.stdout.decode(errors='replace')
+	return tuple(int(re.search(r'^' + name + r':\s+(\d+)$', text, re.M).group(1)) for name in ['hits', 'misses'])
+
+# cache_test:
+# A source compiled from the cache (--cache-dir) must give the same output,
+# diagnostics and exit status as without it, once missed and once hit. Other
+# options, and another name when the object names its source (-c), miss.
+def cache_test(sources):
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		for name in names:
+			expected = compile_in(directory, name, [])
+			for attempt in ['missed', 'hit']:
+				got = compile_in(directory, name, ['--cache-dir', 'cache'])
+				report('bin/eck --cache-dir cache {} ({})'.format(name, attempt), got == expected)
+			expected = compile_in(directory, name, ['-O0'])
+			got = compile_in(directory, name, ['--cache-dir', 'cache', '-O0'])
+			report('bin/eck --cache-dir cache -O0 {}'.format(name), got == expected)
+		report('bin/eck --cache-dir cache --cache-stats', cache_counts(directory) == (len(names), len(names) * 2))
+
+		shutil.copy(os.path.join(directory, names[0]), os.path.join(directory, 'renamed.fd'))
+		compile_in(directory, names[0], ['--cache-dir', 'cache', '-c'], 'o')
+		expected = compile_in(directory, 'renamed.fd', ['-c'], 'o')
+		got = compile_in(directory, 'renamed.fd', ['--cache-dir', 'cache', '-c'], 'o')
+		report('bin/eck --cache-dir cache -c renamed.fd', got == expected)
+
+# module_test:
+# A source declaring a namespace writes its interface (.fdi), whose symbols a
+# using clause imports: declaring one of them again is an error. The interface
+# is found next to the source, or in a directory given with -I.
+def module_test():
+	with tempfile.TemporaryDirectory() as directory:
+		sources = {
+			'shapes.fd': 'namespace shapes;\nint width;\nlong height;\n',
+			'clash.fd': 'using shapes;\nint width;\n',
+			'fine.fd': 'using shapes;\nint depth;\n1;\n',
+		}
+		for name in sources:
+			with open(os.path.join(directory, name), 'w') as f:
+				f.write(sources[name])
+		status = compile_in(directory, 'shapes.fd', [])[0]
+		report('bin/eck shapes.fd (interface written)', status == 0 and os.path.exists(os.path.join(directory, 'shapes.fdi')))
+		status, diags = compile_in(directory, 'clash.fd', [])[:2]
+		report('bin/eck clash.fd (symbol imported)', status == 1 and b'duplicate declaration' in diags)
+		report('bin/eck fine.fd', compile_in(directory, 'fine.fd', [])[0] == 0)
+
+		os.mkdir(os.path.join(directory, 'interfaces'))
+		os.rename(os.path.join(directory, 'shapes.fdi'), os.path.join(directory, 'interfaces', 'shapes.fdi'))
+		status, diags = compile_in(directory, 'fine.fd', [])[:2]
+		report('bin/eck fine.fd (no interface)', status == 1 and b'cannot find the interface' in diags)
+		status, diags = compile_in(directory, 'clash.fd', ['-I', 'interfaces'])[:2]
+		report('bin/eck -I interfaces clash.fd', status == 1 and b'duplicate declaration' in diags)
+		report('bin/eck -I interfaces fine.fd', compile_in(directory, 'fine.fd', ['-I', 'interfaces'])[0] == 0)
+
+# incremental_test:
+# A source compiled again with -fincremental after each edit must give the same
+# output, diagnostics and exit status as compiled from scratch. The statement
+# added has labels, which shift the ones of the statements after it.
+def incremental_test(sources):
+	edits = [
+		('unchanged', lambda text: text),
+		('statement added', lambda text: 'if (1) {\n\t2;\n} else {\n\t3;\n}\n' + text),
+		('statement changed', lambda text: text.replace('\t2;', '\t4;', 1)),
+		('statement appended', lambda text: text + '(5 + 6);\n'),
+		('statement removed', lambda text: text.replace('if (1) {\n\t4;\n} else {\n\t3;\n}\n', '', 1)),
+	]
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		for name in names:
+			path = os.path.join(directory, name)
+			compile_in(directory, name, ['-fincremental'])
+			for description, edit in edits:
+				with open(path) as f:
+					text = f.read()
+				with open(path, 'w') as f:
+					f.write(edit(text))
+				expected = compile_in(directory, name, [])
+				got = compile_in(directory, name, ['-fincremental'])
+				report('bin/eck -fincremental {} ({})'.format(name, description), got == expected)
+
+# compile_many_in:
+# Compiles the sources named in directory with a single command. Returns the
+# exit status, the diagnostics and the outputs, which are removed.
+def compile_many_in(directory, names, arguments):
+	result = subprocess.run([eck] + arguments + names, cwd = directory, stdout = subprocess.DEVNULL, stderr = subprocess.PIPE)
+	produced = []
+	for name in names:
+		path = os.path.join(directory, name + '.s')
+		produced.append(None)
+		if os.path.exists(path):
+			with open(path, 'rb') as f:
+				produced[-1] = f.read()
+			os.remove(path)
+	return (result.returncode, result.stderr, produced)
+
+# jobs_test:
+# Sources compiled by a pool of workers (-j N) must give the same outputs,
+# diagnostics in the same order and exit status as compiled one by one. A
+# source that crashes the compiler stops it at the same place either way.
+def jobs_test(sources):
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		expected = compile_many_in(directory, names, ['-j', '1'])
+		for jobs in ['2', '4']:
+			got = compile_many_in(directory, names, ['-j', jobs])
+			report('bin/eck -j {} {}'.format(jobs, ' '.join(names)), got == expected)
+
+		with open(os.path.join(directory, 'crashing.fd'), 'w') as f:
+			f.write('int a;\na = 2 5;\n')
+		names.insert(1, 'crashing.fd')
+		expected = compile_many_in(directory, names, ['-j', '1'])[:2]
+		got = compile_many_in(directory, names, ['-j', '4'])[:2]
+		report('bin/eck -j 4 {}'.format(' '.join(names)), got == expected and expected[0] != 0)
+
+# lto_test:
+# Units written with -flto and linked with --lto-link must give the output of
+# their sources put together, at -O2 unless another level is given. A source
+# that fails leaves no unit.
+def lto_test(sources):
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		failing_name = names.pop()
+		with open(os.path.join(directory, 'all.fd'), 'w') as all:
+			for name in names:
+				with open(os.path.join(directory, name)) as f:
+					all.write(f.read())
+		for name in names:
+			compile_in(directory, name, ['-flto'], 'lto', True)
+		units = [name + '.lto' for name in names]
+		for level in [[], ['-O1']]:
+			expected = compile_in(directory, 'all.fd', level or ['-O2'])
+			result = subprocess.run([eck] + level + ['--lto-link', 'all.fd.s'] + units, cwd = directory, stdout = subprocess.DEVNULL, stderr = subprocess.PIPE)
+			with open(os.path.join(directory, 'all.fd.s'), 'rb') as f:
+				got = (result.returncode, result.stderr, f.read())
+			report(' '.join(['bin/eck'] + level + ['--lto-link all.fd.s'] + units), got == expected)
+		status, diags, unit = compile_in(directory, failing_name, ['-flto'], 'lto')
+		report('bin/eck -flto ' + failing_name, status == 1 and unit is None)
+
+# sections:
+# The contents of the sections of an object that hold code and data.
+def sections(directory, path):
+	contents = []
+	for section in ['.text', '.data', '.rodata']:
+		subprocess.run(['objcopy', '-O', 'binary', '-j', section, path, 'section.bin'], cwd = directory, check = True)
+		with open(os.path.join(directory, 'section.bin'), 'rb') as f:
+			contents.append(f.read())
+	return contents
+
+# object_test:
+# The object written by eck (-c) must hold the code of its assembly put through
+# the system assembler, with the diagnostics and the exit status of -S.
+def object_test(sources):
+	with tempfile.TemporaryDirectory() as directory:
+		names = copy_sources(sources, directory)
+		for name in names:
+			status, diags, text = compile_in(directory, name, [])
+			got = compile_in(directory, name, ['-c'], 'o', True)
+			ok = got[:2] == (status, diags)
+			if ok and status == 0:
+				# The comments start with ';', which the GNU assembler does not take.
+				lines = ['.intel_syntax noprefix', '.text']
+				for line in text.decode().splitlines():
+					line = line.split(';')[0].replace('\r', '').rstrip()
+					if line:
+						lines.append(line)
+				with open(os.path.join(directory, 'assembly.s'), 'w') as f:
+					f.write('\n'.join(lines) + '\n')
+				subprocess.run(['as', 'assembly.s', '-o', 'assembly.o'], cwd = directory, check = True)
+				ok = sections(directory, name + '.o') == sections(directory, 'assembly.o')
+			report('bin/eck -c ' + name, ok)
 
 # The actual compilation process is here
 for file in os.scandir('./obj'):
@@ -71,4 +320,30 @@ else:
 
 print('Starting testing process (early)')
 for file in get_all_files_from_directory("tests/early/", 'fd'):
-	single_test(file)
\ No newline at end of file
+	single_test(file)
+if platform.system() != 'Windows':
+	server_test(get_all_files_from_directory("tests/early/", 'fd'))
+	cache_test(get_all_files_from_directory("tests/early/", 'fd'))
+module_test()
+incremental_test(get_all_files_from_directory("tests/early/", 'fd'))
+if platform.system() != 'Windows':
+	jobs_test(get_all_files_from_directory("tests/early/", 'fd'))
+lto_test(get_all_files_from_directory("tests/early/", 'fd'))
+if shutil.which('as') and shutil.which('objcopy'):
+	object_test(get_all_files_from_directory("tests/early/", 'fd'))
+
+# build.py bench: measures the throughput of the compiler on generated programs
+if 'bench' in sys.argv[1:]:
+	os.system('"{}" bench.py'.format(sys.executable))
+# build.py runbench: compares the speed of the code generated with cc -O2
+if 'runbench' in sys.argv[1:]:
+	if os.system('"{}" runbench.py'.format(sys.executable)) != 0:
+		exit(1)
+# build.py codesize: compares the instructions and the code size with bench/codesize.csv
+if 'codesize' in sys.argv[1:]:
+	if os.system('"{}" codesize.py'.format(sys.executable)) != 0:
+		exit(1)
+# build.py scaling: fails if a phase of the compiler grows faster than N log N with its input
+if 'scaling' in sys.argv[1:]:
+	if os.system('"{}" scaling.py'.format(sys.executable)) != 0:
+		exit(1)
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+# Instruction count and code size tracking for eck
+#
+# Compiles every test of tests/early and every kernel of bench/kernels, counts
+# the instructions of their assembly by category and reads the size of their
+# code from the object eck encodes (-c). The counts are compared with a
+# baseline, one row per source, and the run fails when a source grows more
+# than the threshold, so that a change of the code generator does not make
+# the code worse unnoticed.
+#
+# Usage:
+#   ./codesize.py [--baseline FILE] [--threshold PERCENT] [--update] [--eck PATH] [source ...]
+#   python3 build.py codesize
+
+import argparse
+import csv
+import glob
+import os
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# The instructions of each category, the others being counted as "other".
+categories = [
+	('moves', ['mov', 'movzx', 'movsx', 'movsxd', 'lea', 'xchg']),
+	('alu', ['add', 'sub', 'imul', 'and', 'or', 'xor', 'not', 'neg', 'shl', 'shr', 'sar', 'test', 'cmp', 'inc', 'dec',
+		'sete', 'setne', 'setl', 'setle', 'setg', 'setge', 'setb', 'setbe', 'seta', 'setae']),
+	('branches', ['jmp', 'je', 'jne', 'jl', 'jle', 'jg', 'jge', 'jb', 'jbe', 'ja', 'jae', 'jz', 'jnz', 'call', 'ret']),
+	('idiv', ['idiv', 'div', 'cqo', 'cdq', 'cwd']),
+	('spills', ['push', 'pop']),
+]
+# The counts of a source: its categories, the moves overwritten before being
+# read, all of its instructions and the bytes of its code.
+columns = [name for name, mnemonics in categories] + ['other', 'dead', 'instructions', 'bytes']
+
+# The general registers by their 64, 32, 16 and 8-bit names, to one name each.
+families = {}
+for names in [['rax', 'eax', 'ax', 'al', 'ah'], ['rbx', 'ebx', 'bx', 'bl', 'bh'], ['rcx', 'ecx', 'cx', 'cl', 'ch'],
+		['rdx', 'edx', 'dx', 'dl', 'dh'], ['rsi', 'esi', 'si', 'sil'], ['rdi', 'edi', 'di', 'dil'],
+		['rbp', 'ebp', 'bp', 'bpl'], ['rsp', 'esp', 'sp', 'spl']]:
+	for name in names:
+		families[name] = names[0]
+for n in range(8, 16):
+	for suffix in ['', 'd', 'w', 'b']:
+		families['r{}{}'.format(n, suffix)] = 'r{}'.format(n)
+register = re.compile(r'\b(' + '|'.join(sorted(families, key=len, reverse=True)) + r')\b')
+
+# instructions:
+# The instructions of an assembly file, as (mnemonic, operands) with the labels
+# as (None, name).
+def instructions(text):
+	for line in text.splitlines():
+		line = line.split(';')[0].strip()
+		if line.endswith(':'):
+			yield None, line[:-1]
+		if not line or line.endswith(':') or line.startswith('.'):
+			continue
+		parts = line.split(None, 1)
+		yield parts[0], [operand.strip() for operand in parts[1].split(',')] if len(parts) > 1 else []
+
+# registers:
+# The families of the registers an operand names.
+def registers(operand):
+	return set(families[name] for name in register.findall(operand))
+
+# count:
+# Counts the instructions of an assembly file by category. A move is dead if
+# its register is written again in the same block before being read.
+def count(text):
+	counts = dict((column, 0) for column in columns)
+	category = {}
+	for name, mnemonics in categories:
+		for mnemonic in mnemonics:
+			category[mnemonic] = name
+	pending = {}
+	for mnemonic, operands in instructions(text):
+		if mnemonic is None:
+			pending = {}
+			continue
+		counts['instructions'] += 1
+		counts[category.get(mnemonic, 'other')] += 1
+
+		# The registers read: all of the sources, and the destination unless
+		# it is only written, or cleared with a xor of itself.
+		written = set()
+		read = set()
+		for operand in operands[1:]:
+			read |= registers(operand)
+		if operands:
+			destination = operands[0]
+			memory = '[' in destination
+			if mnemonic in ('mov', 'movzx', 'movsx', 'movsxd', 'lea') and not memory:
+				written = registers(destination)
+			elif mnemonic == 'xor' and len(operands) == 2 and operands[0] == operands[1]:
+				written = registers(destination)
+				read = set()
+			else:
+				read |= registers(destination)
+		if mnemonic in ('idiv', 'div', 'cqo', 'cdq', 'push', 'pop', 'call', 'ret'):
+			read |= set(['rax', 'rdx', 'rsp'])
+
+		for family in read:
+			pending.pop(family, None)
+		for family in written:
+			if family in pending:
+				counts['dead'] += 1
+			if mnemonic in ('mov', 'movzx', 'movsx', 'movsxd', 'lea'):
+				pending[family] = True
+			else:
+				pending.pop(family, None)
+		if category.get(mnemonic) == 'branches':
+			pending = {}
+	return counts
+
+# text_size:
+# The size of the .text section of an ELF64 object.
+def text_size(path):
+	with open(path, 'rb') as f:
+		data = f.read()
+	shoff, = struct.unpack_from('<Q', data, 0x28)
+	shentsize, shnum, shstrndx = struct.unpack_from('<HHH', data, 0x3A)
+	names = struct.unpack_from('<Q', data, shoff + shstrndx * shentsize + 0x18)[0]
+	for i in range(shnum):
+		header = shoff + i * shentsize
+		name, = struct.unpack_from('<I', data, header)
+		end = data.index(b'\0', names + name)
+		if data[names + name:end] == b'.text':
+			return struct.unpack_from('<Q', data, header + 0x20)[0]
+	return 0
+
+def check(command):
+	result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	if result.returncode != 0:
+		sys.exit('failed: {}\n{}'.format(' '.join(command), result.stdout.decode(errors='replace')))
+
+# measure:
+# Compiles a source to assembly and to an object, in a directory of its own
+# so that the tree is left as it is.
+def measure(eck, source, directory):
+	copy = os.path.join(directory, os.path.basename(source))
+	shutil.copyfile(source, copy)
+	check([eck, copy])
+	with open(copy + '.s') as f:
+		counts = count(f.read())
+	check([eck, '-c', copy])
+	counts['bytes'] = text_size(copy + '.o')
+	return counts
+
+def read_baseline(path):
+	baseline = {}
+	if os.path.exists(path):
+		with open(path, newline='') as f:
+			for row in csv.DictReader(f):
+				baseline[row['source']] = dict((column, int(row[column])) for column in columns if row.get(column))
+	return baseline
+
+def main(argv):
+	parser = argparse.ArgumentParser(description='Tracks the instructions and the code size eck generates.')
+	parser.add_argument('--baseline', default=os.path.join(here, 'bench', 'codesize.csv'), help='the counts compared with (bench/codesize.csv)')
+	parser.add_argument('--threshold', type=float, default=0.0, help='the growth of the instructions or the bytes of a source that fails, in percent (0)')
+	parser.add_argument('--update', action='store_true', help='writes the counts as the new baseline')
+	parser.add_argument('--eck', default=os.path.join(here, 'bin', 'eck'), help='the compiler (bin/eck)')
+	parser.add_argument('sources', nargs='*', help='the sources to count (tests/early and bench/kernels)')
+	args = parser.parse_args(argv)
+
+	sources = args.sources or sorted(glob.glob(os.path.join(here, 'tests', 'early', '*.fd'))) + sorted(glob.glob(os.path.join(here, 'bench', 'kernels', '*.fd')))
+	baseline = read_baseline(args.baseline)
+	directory = tempfile.mkdtemp(prefix='eck-codesize-')
+	results = []
+	try:
+		for source in sources:
+			results.append((os.path.relpath(source, here), measure(os.path.abspath(args.eck), source, directory)))
+	finally:
+		shutil.rmtree(directory)
+
+	# Each count, followed by its change from the baseline
+	failed = []
+	print('{:<28}'.format('source') + ''.join('{:>16}'.format(column) for column in columns))
+	for name, counts in results:
+		before = baseline.get(name)
+		cells = []
+		for column in columns:
+			delta = '' if before is None or column not in before else ' ({:+d})'.format(counts[column] - before[column])
+			cells.append('{:>16}'.format('{}{}'.format(counts[column], delta)))
+		print('{:<28}'.format(name) + ''.join(cells))
+		if before is None or args.update:
+			continue
+		for column in ['instructions', 'bytes']:
+			if column in before and counts[column] > before[column] * (1 + args.threshold / 100):
+				failed.append('{}: {} {} -> {}'.format(name, column, before[column], counts[column]))
+
+	if args.update:
+		with open(args.baseline, 'w', newline='') as f:
+			writer = csv.writer(f)
+			writer.writerow(['source'] + columns)
+			for name, counts in results:
+				writer.writerow([name] + [counts[column] for column in columns])
+		print('baseline written to ' + os.path.relpath(args.baseline))
+	elif failed:
+		print('grew more than {}%:'.format(args.threshold))
+		for line in failed:
+			print('  ' + line)
+		sys.exit(1)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# Converts perf samples to a sample profile for eck -fprofile-sample-use
+#
+# Usage:
+#   perf record -o perf.data bin/eck --run -fperf-map source.fd
+#   perf script -i perf.data -F ip,sym | ./perf2eck.py > source.prof
+#   bin/eck -fprofile-sample-use=source.prof source.fd
+
+import re
+import sys
+
+# The symbols eck -fperf-map gives to the code of a statement: eck:source:line:column
+symbol = re.compile(r'eck:(.+):(\d+):(\d+)(\+0x[0-9a-fA-F]+)?\s*$')
+
+# read_samples:
+# Counts the samples of each statement, per source.
+def read_samples(lines):
+	sources = {}
+	for line in lines:
+		match = symbol.search(line)
+		if not match:
+			continue
+		sites = sources.setdefault(match.group(1), {})
+		site = (int(match.group(2)), int(match.group(3)))
+		sites[site] = sites.get(site, 0) + 1
+	return sources
+
+# write_profile:
+# Writes the samples in the text format of AutoFDO: each source is a function
+# starting at line 1, and the column of a statement is its discriminator.
+def write_profile(sources, out):
+	for source in sorted(sources):
+		sites = sources[source]
+		out.write('{}:{}:0\n'.format(source, sum(sites.values())))
+		for (line, column) in sorted(sites):
+			out.write(' {}.{}: {}\n'.format(line - 1, column, sites[(line, column)]))
+
+if len(sys.argv) > 1:
+	with open(sys.argv[1]) as f:
+		write_profile(read_samples(f), sys.stdout)
+else:
+	write_profile(read_samples(sys.stdin), sys.stdout)
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+# Runtime benchmark of the code eck generates
+#
+# Each kernel of bench/kernels is built twice and linked with bench/harness.c:
+#   - by eck, its assembly being wrapped into a function for the system assembler;
+#   - as C with cc -O2, the kernels being written in the part of Food that is
+#     also C (bench/reference.c), which is the reference.
+# The harness calls the kernel in a loop and reads the cycles, the instructions
+# and the branch misses with perf_event_open, or only the time where the
+# counters are not available.
+#
+# Usage:
+#   ./runbench.py [--iterations N] [--repeat N] [--eck PATH] [--cc CC] [--csv FILE] [kernel ...]
+#   python3 build.py runbench
+
+import argparse
+import csv
+import glob
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+here = os.path.dirname(os.path.abspath(__file__))
+bench = os.path.join(here, 'bench')
+
+# The registers eck allocates that the System V ABI has the callee save.
+saved = ['rbx', 'rbp', 'r12', 'r13', 'r14', 'r15']
+
+# assembly:
+# Turns the output of eck into a function for the GNU assembler: the comments
+# start with ';' and the labels with a carriage return.
+def assembly(text):
+	lines = ['.intel_syntax noprefix', '.text', '.globl food_kernel', '.type food_kernel, @function', 'food_kernel:']
+	lines += ['\tpush ' + register for register in saved]
+	for line in text.splitlines():
+		line = line.split(';')[0].replace('\r', '').rstrip()
+		if line:
+			lines.append(line)
+	lines += ['\tpop ' + register for register in reversed(saved)]
+	lines += ['\tret', '.size food_kernel, .-food_kernel', '.section .note.GNU-stack,"",@progbits', '']
+	return '\n'.join(lines)
+
+def check(command):
+	result = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	if result.returncode != 0:
+		sys.exit('failed: {}\n{}'.format(' '.join(command), result.stdout.decode(errors='replace')))
+
+# build:
+# Builds the two programs of a kernel. Returns their paths.
+def build(kernel, directory, eck, cc):
+	name = os.path.splitext(os.path.basename(kernel))[0]
+	source = os.path.join(directory, name + '.fd')
+	shutil.copyfile(kernel, source)
+	check([eck, source])
+	with open(source + '.s') as f:
+		text = assembly(f.read())
+	with open(os.path.join(directory, name + '.s'), 'w') as f:
+		f.write(text)
+
+	harness = os.path.join(bench, 'harness.c')
+	programs = (os.path.join(directory, name + '-eck'), os.path.join(directory, name + '-cc'))
+	check([cc, '-O2', harness, os.path.join(directory, name + '.s'), '-o', programs[0]])
+	check([cc, '-O2', '-Wno-unused-value', '-DKERNEL="{}"'.format(os.path.abspath(kernel)),
+		harness, os.path.join(bench, 'reference.c'), '-o', programs[1]])
+	return programs
+
+counter_line = re.compile(r'^([\w-]+) (-?\d+)$')
+
+# measure:
+# Runs a program. Returns its counts per call of the kernel, None where not counted.
+def measure(program, iterations):
+	result = subprocess.run([program, str(iterations)], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+	if result.returncode != 0:
+		sys.exit('{} failed:\n{}'.format(program, result.stderr.decode(errors='replace')))
+	counts = {}
+	for line in result.stdout.decode().splitlines():
+		match = counter_line.match(line)
+		if match:
+			counts[match.group(1)] = int(match.group(2))
+	calls = counts.pop('iterations')
+	return {name: (value / calls if value >= 0 else None) for name, value in counts.items()}
+
+columns = ['cycles', 'instructions', 'branch-misses', 'ns']
+
+# best:
+# The least of each count over several runs, the others being disturbed by
+# the rest of the machine.
+def best(runs):
+	least = {}
+	for column in columns:
+		values = [run[column] for run in runs if run.get(column) is not None]
+		least[column] = min(values) if values else None
+	return least
+
+def cell(value):
+	return '{:>20}'.format('n/a' if value is None else '{:.2f}'.format(value))
+
+def main(argv):
+	parser = argparse.ArgumentParser(description='Compares the code of eck with cc -O2 on small kernels.')
+	parser.add_argument('--iterations', type=int, default=1000000, help='the calls of each kernel (1000000)')
+	parser.add_argument('--repeat', type=int, default=3, help='the runs of each program, the least of each count is kept (3)')
+	parser.add_argument('--eck', default=os.path.join(here, 'bin', 'eck'), help='the compiler (bin/eck)')
+	parser.add_argument('--cc', default='cc', help='the C compiler of the harness and the reference (cc)')
+	parser.add_argument('--csv', help='where the results are also written')
+	parser.add_argument('kernels', nargs='*', help='the kernels to run (all of bench/kernels)')
+	args = parser.parse_args(argv)
+
+	kernels = args.kernels or sorted(glob.glob(os.path.join(bench, 'kernels', '*.fd')))
+	directory = tempfile.mkdtemp(prefix='eck-runbench-')
+	rows = []
+	print('{:<12} {:<10}'.format('kernel', 'build') + ''.join('{:>20}'.format(name + '/call') for name in columns))
+	try:
+		for kernel in kernels:
+			name = os.path.splitext(os.path.basename(kernel))[0]
+			programs = build(kernel, directory, os.path.abspath(args.eck), args.cc)
+			results = [best([measure(program, args.iterations) for i in range(args.repeat)]) for program in programs]
+			for label, result in zip(['eck', 'cc -O2'], results):
+				print('{:<12} {:<10}'.format(name, label) + ''.join(cell(result.get(column)) for column in columns))
+				rows.append([name, label] + [result.get(column) for column in columns])
+			# How many times slower eck is
+			ratios = []
+			for column in columns:
+				mine, reference = results[0].get(column), results[1].get(column)
+				ratios.append(mine / reference if mine is not None and reference else None)
+			print('{:<12} {:<10}'.format('', 'eck / cc') + ''.join(cell(ratio) for ratio in ratios))
+	finally:
+		shutil.rmtree(directory)
+
+	if args.csv:
+		with open(args.csv, 'w', newline='') as f:
+			writer = csv.writer(f)
+			writer.writerow(['kernel', 'build'] + [name + '_per_call' for name in columns])
+			writer.writerows(rows)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+# Compile time scaling test for eck
+#
+# Generates each pattern of input at the sizes N, 2N, 4N and 8N, compiles
+# them with bin/eck -ftime-report and fits the growth exponent of each phase
+# and of the peak memory: the slope of log(cost) over log(N). The run fails
+# when a phase grows faster than N log N, so that a path that is quietly
+# quadratic shows up before a large program makes it slow.
+#
+# Usage:
+#   ./scaling.py [--scale X] [--repeat N] [--tolerance E] [--floor MS] [--eck PATH] [pattern ...]
+#   python3 build.py scaling
+
+import argparse
+import math
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import bench
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+# The patterns: each one gives the source made of n elements, and its N.
+def long_chains(rng, n):
+	return bench.chain(rng, n) + ';\n'
+
+def deep_nesting(rng, n):
+	return 'while (0) {\n' * n + bench.expression(rng, 2) + ';\n' + '}\n' * n
+
+def many_locals(rng, n):
+	return '{\n' + ''.join('\t{} local_{};\n'.format(rng.choice(bench.types), i) for i in range(n)) + '\t1;\n}\n'
+
+def many_diagnostics(rng, n):
+	return ''.join('{{ int twice_{0}; int twice_{0}; }}\n'.format(i) for i in range(n))
+
+def many_statements(rng, n):
+	return ''.join(bench.expression(rng, 2) + ';\n' for i in range(n))
+
+patterns = [
+	('long_chains', long_chains, 200),
+	('deep_nesting', deep_nesting, 250),
+	('many_locals', many_locals, 1000),
+	('many_diagnostics', many_diagnostics, 500),
+	('many_statements', many_statements, 2000),
+]
+steps = [1, 2, 4, 8]
+
+# run:
+# Compiles a source. Returns the self time of each phase in milliseconds, with
+# the peak RSS in kilobytes as "memory".
+def run(eck, source):
+	result = subprocess.run([eck, '-ftime-report', '-ferror-limit=0', source], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+	errors = result.stderr.decode(errors='replace')
+	# The diagnostics of many_diagnostics are expected, a crash is not.
+	if result.returncode not in (0, 1):
+		sys.exit('{} failed on {} ({}):\n{}'.format(eck, source, result.returncode, errors[-2000:]))
+	costs = {}
+	for line in errors.splitlines():
+		match = bench.report_line.match(line)
+		if match:
+			costs[match.group(1)] = float(match.group(3))
+		match = bench.peak_line.match(line)
+		if match:
+			costs['memory'] = float(match.group(1))
+	return costs
+
+# measure:
+# The least of each cost over the runs, the others being disturbed by the rest
+# of the machine.
+def measure(eck, source, repeat):
+	least = {}
+	for i in range(repeat):
+		for name, value in run(eck, source).items():
+			least[name] = min(least.get(name, value), value)
+	return least
+
+# slope:
+# The least squares slope of log(y) over log(x).
+def slope(xs, ys):
+	lx = [math.log(x) for x in xs]
+	ly = [math.log(max(y, 1e-6)) for y in ys]
+	mx = sum(lx) / len(lx)
+	my = sum(ly) / len(ly)
+	return sum((a - mx) * (b - my) for a, b in zip(lx, ly)) / sum((a - mx) ** 2 for a in lx)
+
+def main(argv):
+	parser = argparse.ArgumentParser(description='Fits how the compile time and the memory of eck grow with its input.')
+	parser.add_argument('--scale', type=float, default=1.0, help='multiplies the N of every pattern (1)')
+	parser.add_argument('--repeat', type=int, default=3, help='the runs of each source, the least of each cost is kept (3)')
+	parser.add_argument('--tolerance', type=float, default=0.25, help='the exponent allowed above the one of N log N, for the noise (0.25)')
+	parser.add_argument('--floor', type=float, default=2.0, help='the milliseconds under which a phase is not fitted (2)')
+	parser.add_argument('--eck', default=os.path.join(here, 'bin', 'eck'), help='the compiler (bin/eck)')
+	parser.add_argument('patterns', nargs='*', help='the patterns to run (all)')
+	args = parser.parse_args(argv)
+
+	eck = os.path.abspath(args.eck)
+	chosen = [pattern for pattern in patterns if not args.patterns or pattern[0] in args.patterns]
+	directory = tempfile.mkdtemp(prefix='eck-scaling-')
+	failed = []
+	try:
+		# The memory of eck itself, which does not grow with the input
+		empty = os.path.join(directory, 'empty.fd')
+		with open(empty, 'w') as f:
+			f.write('1;\n')
+		resident = measure(eck, empty, args.repeat).get('memory', 0.0)
+
+		print('{:<18} {:<10} {:>10} {:>9}   {}'.format('pattern', 'phase', 'at 8N', 'exponent', 'limit'))
+		for name, make, base in chosen:
+			sizes = [max(1, int(base * args.scale)) * step for step in steps]
+			results = []
+			for n in sizes:
+				source = os.path.join(directory, '{}_{}.fd'.format(name, n))
+				with open(source, 'w') as f:
+					f.write(make(random.Random('{}:{}'.format(name, n)), n))
+				results.append(measure(eck, source, args.repeat))
+
+			limit = slope(sizes, [n * math.log(n) for n in sizes]) + args.tolerance
+			for phase in sorted(set().union(*results)):
+				values = [result.get(phase, 0.0) for result in results]
+				if phase == 'memory':
+					values = [max(value - resident, 1.0) for value in values]
+					if values[-1] < 1024:
+						continue
+					unit = 'KB'
+				else:
+					if values[-1] < args.floor:
+						continue
+					unit = 'ms'
+				exponent = slope(sizes, values)
+				verdict = '' if exponent <= limit else '  grows faster than N log N'
+				print('{:<18} {:<10} {:>10} {:>9.2f}   {:.2f}{}'.format(name, phase, '{:.0f} {}'.format(values[-1], unit), exponent, limit, verdict))
+				if verdict:
+					failed.append('{}: {} grows as N^{:.2f} from N = {} to {}'.format(name, phase, exponent, sizes[0], sizes[-1]))
+	finally:
+		shutil.rmtree(directory)
+
+	if failed:
+		print('super-linear:')
+		for line in failed:
+			print('  ' + line)
+		sys.exit(1)
+
+if __name__ == '__main__':
+	main(sys.argv[1:])
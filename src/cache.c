@@ -0,0 +1,350 @@
+/*
+	Output cache for ECK
+
+	Objects are cached by the SHA-256 of the compiler version,
+	the options that change the generated code and the source.
+	Each entry is made of two files in a fan-out directory:
+	  <dir>/ab/abcdef....s  the assembly
+	  <dir>/ab/abcdef....d  the status, then the diagnostics
+	The modification time of an entry is refreshed on each hit,
+	and the oldest entries are removed first once the cache
+	grows past its limit.
+
+	<dir>/stats holds the counters shared by every eck process
+	using the cache: hits, misses and the size of the entries.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const char *cache_dir = NULL;
+uint64_t cache_limit = 256 * 1024 * 1024;
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#ifdef __linux__
+	#include <sys/ioctl.h>
+	#include <linux/fs.h>
+#endif
+
+/* The counters of the stats file. */
+typedef struct cache_stats
+{
+	uint64_t hits;    /* Objects found in the cache. */
+	uint64_t misses;  /* Objects that had to be compiled. */
+	uint64_t size;    /* The size of all of the entries, in bytes. */
+	uint64_t evicted; /* Entries removed to stay under the limit. */
+} cache_stats;
+
+/* A file of the cache, used when evicting. */
+typedef struct cache_file
+{
+	char *path;
+	time_t mtime;
+	uint64_t size;
+} cache_file;
+
+/* Gets the path of an entry. ext is either 's' or 'd'. Must be freed. */
+static char *s_entry_path(const uint8_t key[32], char ext)
+{
+	char hex[65];
+	char *yield = malloc(strlen(cache_dir) + 72);
+	sha256_hex(key, hex);
+	sprintf(yield, "%s/%c%c/%s.%c", cache_dir, hex[0], hex[1], hex, ext);
+	return yield;
+}
+
+/* Copies a file, sharing its blocks when the file system allows it. */
+static bool_t s_copy(const char *from, const char *to)
+{
+	char buffer[65536];
+	int in, out;
+	ssize_t n;
+	bool_t yield = TRUE;
+
+	in = open(from, O_RDONLY);
+	if (in < 0) return FALSE;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		close(in);
+		return FALSE;
+	}
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		close(in);
+		close(out);
+		return TRUE;
+	}
+#endif
+	while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+		if (write(out, buffer, n) != n) {
+			yield = FALSE;
+			break;
+		}
+	}
+	if (n < 0) yield = FALSE;
+	close(in);
+	close(out);
+	return yield;
+}
+
+/*
+	Opens and locks the stats file, then reads it. The stats must
+	be written back with s_stats_close. Returns -1 on failure.
+*/
+static int s_stats_open(cache_stats *stats)
+{
+	char *path, text[256];
+	ssize_t n;
+	int fd;
+
+	memset(stats, 0, sizeof(*stats));
+	mkdir(cache_dir, 0755);
+	path = malloc(strlen(cache_dir) + 8);
+	sprintf(path, "%s/stats", cache_dir);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	free(path);
+	if (fd < 0) return -1;
+	flock(fd, LOCK_EX);
+
+	n = read(fd, text, sizeof(text) - 1);
+	if (n > 0) {
+		unsigned long hits = 0, misses = 0, size = 0, evicted = 0;
+		text[n] = 0;
+		DISCARD(sscanf(text, "%lu %lu %lu %lu", &hits, &misses, &size, &evicted));
+		stats->hits = hits;
+		stats->misses = misses;
+		stats->size = size;
+		stats->evicted = evicted;
+	}
+	return fd;
+}
+
+static void s_stats_close(int fd, cache_stats *stats, bool_t write_back)
+{
+	char text[256];
+	if (write_back) {
+		sprintf(text, "%lu %lu %lu %lu\n", (unsigned long)stats->hits, (unsigned long)stats->misses,
+			(unsigned long)stats->size, (unsigned long)stats->evicted);
+		if (ftruncate(fd, 0) == 0) {
+			DISCARD(pwrite(fd, text, strlen(text), 0));
+		}
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+static int s_oldest_first(const void *a, const void *b)
+{
+	const cache_file *l = a, *r = b;
+	if (l->mtime != r->mtime) return l->mtime < r->mtime ? -1 : 1;
+	return strcmp(l->path, r->path);
+}
+
+/* Removes the least recently used entries until the cache fits. Stats must be locked. */
+static void s_evict(cache_stats *stats)
+{
+	cache_file *files = NULL;
+	size_t count = 0, max = 0, i;
+	uint64_t size = 0;
+	DIR *top, *fan;
+	struct dirent *ent, *sub;
+	struct stat st;
+	char *dir, *path;
+
+	/* 1. Listing all of the entries */
+	top = opendir(cache_dir);
+	if (!top) return;
+	while ((ent = readdir(top)) != NULL) {
+		if (strlen(ent->d_name) != 2 || ent->d_name[0] == '.') continue;
+		dir = malloc(strlen(cache_dir) + 4);
+		sprintf(dir, "%s/%s", cache_dir, ent->d_name);
+		fan = opendir(dir);
+		while (fan && (sub = readdir(fan)) != NULL) {
+			if (sub->d_name[0] == '.') continue;
+			path = malloc(strlen(dir) + strlen(sub->d_name) + 2);
+			sprintf(path, "%s/%s", dir, sub->d_name);
+			if (stat(path, &st) != 0) {
+				free(path);
+				continue;
+			}
+			if (count == max) {
+				max = max ? max * 2 : 64;
+				files = realloc(files, sizeof(cache_file) * max);
+			}
+			files[count].path = path;
+			files[count].mtime = st.st_mtime;
+			files[count].size = st.st_size;
+			size += st.st_size;
+			count++;
+		}
+		if (fan) closedir(fan);
+		free(dir);
+	}
+	closedir(top);
+
+	/* 2. Removing the oldest ones, leaving some room for the next entries */
+	qsort(files, count, sizeof(cache_file), s_oldest_first);
+	for (i = 0; i < count; i++) {
+		if (size > cache_limit / 4 * 3 && unlink(files[i].path) == 0) {
+			size -= files[i].size;
+			stats->evicted++;
+		}
+		free(files[i].path);
+	}
+	free(files);
+	stats->size = size;
+}
+
+bool_t cache_fetch(const uint8_t key[32], const char *output, bool_t *status)
+{
+	char *spath, *dpath, buffer[4096];
+	FILE *diags;
+	cache_stats stats;
+	size_t n;
+	int fd, state = 1;
+	bool_t hit = FALSE;
+
+	spath = s_entry_path(key, 's');
+	dpath = s_entry_path(key, 'd');
+	diags = fopen(dpath, "r");
+	if (diags && fscanf(diags, "%d\n", &state) == 1 && s_copy(spath, output)) {
+		hit = TRUE;
+		*status = state == 0;
+		while ((n = fread(buffer, 1, sizeof(buffer), diags)) != 0) {
+			DISCARD(fwrite(buffer, 1, n, diag_target ? diag_target : stderr));
+		}
+		/* Most recently used */
+		utime(spath, NULL);
+		utime(dpath, NULL);
+	}
+	if (diags) fclose(diags);
+	free(spath);
+	free(dpath);
+
+	fd = s_stats_open(&stats);
+	if (fd >= 0) {
+		if (hit) stats.hits++;
+		else stats.misses++;
+		s_stats_close(fd, &stats, TRUE);
+	}
+	return hit;
+}
+
+void cache_store(const uint8_t key[32], const char *output, FILE *diags, bool_t status)
+{
+	char *spath, *dpath, *tmp, buffer[4096];
+	FILE *entry;
+	cache_stats stats;
+	struct stat st;
+	size_t n;
+	uint64_t added = 0;
+	int fd;
+
+	spath = s_entry_path(key, 's');
+	dpath = s_entry_path(key, 'd');
+	tmp = malloc(strlen(spath) + 32);
+
+	/* 1. Creating the directories */
+	strcpy(tmp, spath);
+	*strrchr(tmp, '/') = 0;
+	mkdir(cache_dir, 0755);
+	mkdir(tmp, 0755);
+
+	/*
+		2. Writing the entry. Other processes might be reading the cache,
+		   so the files are written under a temporary name first.
+	*/
+	sprintf(tmp, "%s.%ld", spath, (long)getpid());
+	if (s_copy(output, tmp) && rename(tmp, spath) == 0) {
+		sprintf(tmp, "%s.%ld", dpath, (long)getpid());
+		entry = fopen(tmp, "w");
+		if (entry) {
+			fprintf(entry, "%d\n", status ? 0 : 1);
+			rewind(diags);
+			while ((n = fread(buffer, 1, sizeof(buffer), diags)) != 0) {
+				DISCARD(fwrite(buffer, 1, n, entry));
+			}
+			fclose(entry);
+			if (rename(tmp, dpath) != 0) unlink(tmp);
+		}
+	} else {
+		unlink(tmp);
+	}
+	if (stat(spath, &st) == 0) added += st.st_size;
+	if (stat(dpath, &st) == 0) added += st.st_size;
+	free(tmp);
+	free(spath);
+	free(dpath);
+
+	/* 3. Staying under the limit */
+	fd = s_stats_open(&stats);
+	if (fd >= 0) {
+		stats.size += added;
+		if (stats.size > cache_limit) {
+			s_evict(&stats);
+		}
+		s_stats_close(fd, &stats, TRUE);
+	}
+}
+
+void cache_report(void)
+{
+	cache_stats stats;
+	uint64_t total;
+	int fd;
+
+	if (!cache_dir) {
+		printf("cache: disabled (use --cache-dir or ECK_CACHE_DIR)\n");
+		return;
+	}
+	fd = s_stats_open(&stats);
+	if (fd < 0) {
+		printf("cache: cannot open '%s'\n", cache_dir);
+		return;
+	}
+	s_stats_close(fd, &stats, FALSE);
+
+	total = stats.hits + stats.misses;
+	printf("cache directory: %s\n", cache_dir);
+	printf("hits:            %lu\n", (unsigned long)stats.hits);
+	printf("misses:          %lu\n", (unsigned long)stats.misses);
+	printf("hit rate:        %.1f%%\n", total ? 100.0 * stats.hits / total : 0.0);
+	printf("size:            %lu bytes\n", (unsigned long)stats.size);
+	printf("limit:           %lu bytes\n", (unsigned long)cache_limit);
+	printf("evicted:         %lu\n", (unsigned long)stats.evicted);
+}
+
+#else
+
+bool_t cache_fetch(const uint8_t key[32], const char *output, bool_t *status)
+{
+	(void)key;
+	(void)output;
+	(void)status;
+	return FALSE;
+}
+
+void cache_store(const uint8_t key[32], const char *output, FILE *diags, bool_t status)
+{
+	(void)key;
+	(void)output;
+	(void)diags;
+	(void)status;
+}
+
+void cache_report(void)
+{
+	printf("cache: not supported on this platform\n");
+}
+
+#endif
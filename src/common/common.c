@@ -1,12 +1,20 @@
 #include "def.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
 
 static void s_realloc(string_builder *builder)
 {
 	const size_t previous = builder->max;
 	builder->max += builder->blklen + 1;
-	builder->storage = realloc(builder->storage, builder->max);
+	builder->storage = MEM_REALLOC(MEM_STRINGS, builder->storage, builder->max);
 	memset((builder->storage + previous), 0, builder->blklen + 1);
 }
 
@@ -15,7 +23,7 @@ void strbuilder_alloc(string_builder *builder, size_t block_size)
 	builder->length = 0;          /* None of the string builder is used */
 	builder->blklen = block_size; /* Block size */
 	builder->max = block_size;    /* By default, it can contain only 16 characters (can scale up) */
-	builder->storage = malloc(block_size + 1);   /* Allocates the storage */
+	builder->storage = MEM_MALLOC(MEM_STRINGS, block_size + 1); /* Allocates the storage */
 	memset(builder->storage, 0, block_size + 1); /* Sets the storage to zero */
 }
 
@@ -31,7 +39,7 @@ void strbuilder_append_string(string_builder *builder, char *string)
 {
 	const size_t stringLength = strlen(string);
 
-	if (builder->length + stringLength > builder->max)
+	while (builder->length + stringLength > builder->max)
 		s_realloc(builder);
 	
 	memcpy((builder->storage + builder->length), string, stringLength);
@@ -43,13 +51,13 @@ void strbuilder_free(string_builder *builder)
 	builder->blklen = 0;
 	builder->length = 0;
 	builder->max = 0;
-	free(builder->storage);
+	MEM_FREE(MEM_STRINGS, builder->storage);
 	builder->storage = 0;
 }
 
 void *memorize_raw(void *item, size_t size)
 {
-	void *yield = malloc(size);
+	void *yield = MEM_MALLOC(MEM_TYPES, size);
 	memcpy(yield, item, size);
 	return yield;
 }
@@ -59,7 +67,7 @@ void delete_tree(expression *expr)
 	if (expr->left) delete_tree(expr->left);
 	if (expr->right) delete_tree(expr->right);
 	if (expr->extra) delete_tree(expr->extra);
-	free(expr);
+	MEM_FREE(MEM_PARSER, expr);
 }
 
 uint8_t min_u8(uint8_t a, uint8_t b)
@@ -70,4 +78,59 @@ uint8_t min_u8(uint8_t a, uint8_t b)
 uint8_t max_u8(uint8_t a, uint8_t b)
 {
 	return a - ((a - b) & (a - b) >> 7);
-}
\ No newline at end of file
+}
+double clock_seconds(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void *map_file(const char *path, size_t *size)
+{
+#ifndef _WIN32
+	struct stat st;
+	void *yield;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	yield = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (yield == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return yield;
+#else
+	void *yield;
+	long length;
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	rewind(f);
+	yield = length > 0 ? malloc(length) : NULL;
+	if (yield && fread(yield, 1, length, f) != (size_t)length) {
+		free(yield);
+		yield = NULL;
+	}
+	fclose(f);
+	*size = length;
+	return yield;
+#endif
+}
+
+void unmap_file(void *map, size_t size)
+{
+#ifndef _WIN32
+	munmap(map, size);
+#else
+	(void)size;
+	free(map);
+#endif
+}
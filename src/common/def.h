@@ -10,6 +10,9 @@
 #include <stddef.h>
 #include <stdio.h>
 
+/* The version of the compiler, not the one of the language. */
+#define ECK_VERSION "0.1.0"
+
 /*
 	A string builder is used to build
 	strings that need a lot of write
@@ -38,6 +41,35 @@ void strbuilder_free(string_builder *builder);
 /* Copies an object to the heap. */
 void *memorize_raw(void *item, size_t size);
 
+/* A monotonic clock, in seconds. */
+double clock_seconds(void);
+
+/* Maps a whole file, read-only. Returns NULL if it cannot be opened or is empty. */
+void *map_file(const char *path, size_t *size);
+
+/* Unmaps a file mapped with map_file. */
+void unmap_file(void *map, size_t size);
+
+/* The state of a SHA-256 computation. */
+typedef struct sha256_ctx
+{
+	uint32_t state[8]; /* The intermediate hash value. */
+	uint64_t length;   /* The number of bytes hashed so far. */
+	uint8_t block[64]; /* The block being filled. */
+} sha256_ctx;
+
+/* Starts a SHA-256 computation. */
+void sha256_init(sha256_ctx *ctx);
+
+/* Hashes more data. */
+void sha256_update(sha256_ctx *ctx, const void *data, size_t length);
+
+/* Finishes a SHA-256 computation. */
+void sha256_final(sha256_ctx *ctx, uint8_t digest[32]);
+
+/* Writes a digest as lowercase hexadecimal. */
+void sha256_hex(const uint8_t digest[32], char hex[65]);
+
 /* Templated memorize. */
 #define MEMORIZE(T, P) (T *)memorize_raw((void *)P, sizeof(T))
 
@@ -57,8 +89,52 @@ typedef signed char bool_t;
 	#define FALSE 0
 #endif
 
+/* The subsystems whose allocations -fmem-report counts. */
+typedef enum mem_subsystem
+{
+	MEM_LEXER,
+	MEM_PARSER,  /* The expression and statement trees. */
+	MEM_TYPES,   /* The types, fields and members (memorize). */
+	MEM_SYMBOLS,
+	MEM_STRINGS, /* The string builders. */
+	MEM_COUNT
+} mem_subsystem;
+
+/* Whether the allocations are counted (-fmem-report). */
+extern bool_t mem_report;
+
+/* Counting versions of malloc, calloc, realloc and free. */
+void *mem_malloc(mem_subsystem s, size_t size);
+void *mem_calloc(mem_subsystem s, size_t count, size_t size);
+void *mem_realloc(mem_subsystem s, void *p, size_t size);
+void mem_free(mem_subsystem s, void *p);
+
+/* Prints the allocation statistics to stderr. */
+void mem_print(void);
+
+/* The allocations of a subsystem. They are not counted at all with NDEBUG. */
+#ifdef NDEBUG
+	#define MEM_MALLOC(S, SIZE) malloc(SIZE)
+	#define MEM_CALLOC(S, COUNT, SIZE) calloc(COUNT, SIZE)
+	#define MEM_REALLOC(S, P, SIZE) realloc(P, SIZE)
+	#define MEM_FREE(S, P) free(P)
+#else
+	#define MEM_MALLOC(S, SIZE) mem_malloc(S, SIZE)
+	#define MEM_CALLOC(S, COUNT, SIZE) mem_calloc(S, COUNT, SIZE)
+	#define MEM_REALLOC(S, P, SIZE) mem_realloc(S, P, SIZE)
+	#define MEM_FREE(S, P) mem_free(S, P)
+#endif
+
 #define DISCARD(x) ((void)((x) + 1))
 
+/* Thread-local storage, where threads are supported. */
+#if defined(__GNUC__) && !defined(_WIN32)
+	#define ECK_THREADS
+	#define ECK_TLS __thread
+#else
+	#define ECK_TLS
+#endif
+
 /*
 	This simple *template* macro is used to
 	represent a key/value pair.
@@ -215,6 +291,24 @@ size_t lex_pos(void);
 void lex_move(size_t pos);
 bool_t lex_peek(lex_token *token_buffer);
 
+/* Reads the next token from the stream, even if the lexer is redirected. */
+bool_t lex_scan(lex_token *tokenBuffer);
+
+/* Where the parser takes its tokens from, instead of the stream. */
+typedef struct lex_hooks
+{
+	bool_t (*fetch)(lex_token *token);
+	size_t (*pos)(void);
+	void (*move)(size_t pos);
+} lex_hooks;
+
+/*
+	Makes lex_fetch, lex_pos and lex_move use hooks in the calling
+	thread, for example when the stream is read by another thread.
+	NULL to restore.
+*/
+void lex_redirect(const lex_hooks *hooks);
+
 /*  ===== PARSER DECL ===== */
 
 /*
@@ -373,12 +467,47 @@ size_t eweight(expression *tree);
 /* Simplifies an expression. */
 void esimple(expression **tree);
 
+/* Computes the value of a constant expression. failed is set if it is not constant. */
+uint64_t eval(expression *tree, bool_t *failed);
+
 /* True if the expression is binary. Casts do not count. */
 bool_t is_binary(expression *e);
 
+typedef enum statement_kind
+{
+	STATEMENT_EXPRESSION,
+	STATEMENT_BLOCK,
+	STATEMENT_IF,
+	STATEMENT_WHILE,
+	STATEMENT_DO
+} statement_kind;
+
+/*
+	A statement, as parsed before its code is generated. Empty
+	statements, declarations and clauses have no tree.
+*/
+typedef struct statement_tree
+{
+	statement_kind kind;                /* The kind of the statement. */
+	lex_token token;                    /* The main token of the statement. */
+	expression *condition;              /* The condition, or the expression of an expression statement. */
+	struct statement_tree *body;        /* The body of a loop, or what is done if the condition holds. */
+	struct statement_tree *otherwise;   /* The else branch of an if statement. */
+	struct statement_tree **children;   /* The statements of a block. */
+	size_t childcount;                  /* The number of statements in the block. */
+	size_t frame;                       /* The stack space needed by the locals of a block. */
+	bool_t has_else;                    /* Whether the if statement has an else branch. */
+} statement_tree;
+
 /* Parses either an expression, a statement or a declaration. */
 void statement(void);
 
+/* Parses a statement without generating it. Returns NULL if there is nothing to generate. */
+statement_tree *parse_statement(void);
+
+/* Deletes a statement tree. */
+void delete_statement(statement_tree *tree);
+
 /* Parses a declaration. */
 void declaration(void);
 
@@ -393,16 +522,47 @@ void dwarn(lex_token *site, const char *fmt, ...);
 /* Errors are diagnostics that indicate a syntax error or something that prevents the compilation. */
 void derror(lex_token *site, const char *fmt, ...);
 
+/*
+	Where the diagnostics are written. NULL for stderr. It must be
+	opened for reading too, as a fatal error replays it to stderr.
+*/
+extern FILE *diag_target;
+
 /* Fatals are errors that come from the compiler itself. These crash the compiler. */
 void dfatal(const char *fmt, ...);
 
 /* Gets 2D coordinates for a token. */
 void lex_site(lex_token *site, size_t *line, size_t *col);
 
+/* Gets 2D coordinates for sorted token positions, reading the source once. */
+void lex_sites(const uint64_t *positions, size_t count, size_t *lines, size_t *cols);
+
+/* The number of errors after which the compilation stops (-ferror-limit=N). 0 for no limit. */
+extern size_t error_limit;
+
+/* Whether the diagnostics are written as JSON, one object per line (-fdiagnostics-format=json). */
+extern bool_t diag_json;
+
+/* The name of the source being compiled, for the JSON diagnostics. NULL if unknown. */
+extern const char *diag_source;
+
+/* Whether the error limit was reached. The lexer stops reading then. */
+bool_t diag_stopped(void);
+
+/*
+	Writes the diagnostics that were recorded since the last flush,
+	in the order they were reported. Must be done before the source
+	is closed, as their lines and columns are only computed then.
+*/
+void diag_flush(void);
+
+/* Gets the number of diagnostics (of any kind) triggered so far. */
+size_t diag_count(void);
+
 /* Returns true if the build has successed. */
 bool_t is_clean(void);
 
-/* Sets the build "clean" again. */
+/* Sets the build "clean" again and drops the diagnostics not flushed yet. */
 void reset_diags(void);
 
 /* ===== GENERATION ===== */
@@ -416,20 +576,148 @@ regname rget(int reg, size_t size);
 /* Gets the name of the accumulator according to a specific size. */
 regname racc(size_t size);
 
+/* The instructions the code generator emits. */
+typedef enum insn
+{
+	INSN_MOV, INSN_XOR, INSN_ADD, INSN_SUB, INSN_IMUL, INSN_IDIV, INSN_CQO, INSN_CDQ, INSN_CWD,
+	INSN_PUSH, INSN_POP, INSN_AND, INSN_OR, INSN_TEST, INSN_CMP,
+	INSN_SETE, INSN_SETNE, INSN_SETL, INSN_SETLE, INSN_SETG, INSN_SETGE,
+	INSN_SAL, INSN_SHR, INSN_SAR, INSN_NEG, INSN_NOT, INSN_JMP, INSN_JE, INSN_JNE,
+	INSN_MOVSX, INSN_MOVZX, INSN_RET, INSN_CALL, INSN_RDTSC,
+	INSN_COUNT
+} insn;
+
+#define OPERAND_NONE      0
+#define OPERAND_REGISTER  1
+#define OPERAND_IMMEDIATE 2
+#define OPERAND_LABEL     3
+#define OPERAND_MEMORY    4
+
+/* An operand of an instruction. */
+typedef struct operand
+{
+	uint8_t kind;   /* OPERAND_* */
+	uint8_t size;   /* The size of a register or of the memory accessed, in bytes. */
+	uint8_t reg;    /* The hardware number of a register or of a base (rax = 0 ... r15 = 15). */
+	uint64_t value; /* The value of an immediate, the number of a label or a displacement. */
+} operand;
+
+/* Hardware numbers of the registers used outside of allocation. */
+#define REG_RAX 0
+#define REG_RCX 1 /* The count of the shifts. */
+#define REG_RDX 2
+#define REG_RSP 4
+#define REG_RBP 5
+#define REG_RSI 6 /* The records of -finstrument-functions. */
+#define REG_RDI 7 /* The counters of -fprofile-generate. */
+
+/* Machine code being encoded (-c). */
+typedef struct machine_code machine_code;
+
+/* A growable buffer of assembly. */
+typedef struct emit_buffer
+{
+	char *data;
+	size_t length;
+	size_t max;
+	machine_code *mc; /* If not NULL, the instructions are encoded here instead. */
+} emit_buffer;
+
+/* Whether objects are written as ELF relocatable objects instead of assembly (-c). */
+extern bool_t emit_object;
+
+machine_code *mc_new(void);
+void mc_delete(machine_code *mc);
+
+/* Encodes an instruction. */
+void mc_emit(machine_code *mc, insn op, operand *a, operand *b);
+
+/* Places a label. */
+void mc_label(machine_code *mc, size_t l);
+
+/* Marks where the code of a statement starts, for the line table. */
+void mc_mark(machine_code *mc, uint64_t pos);
+
+/* An entry of the line table: the code from address on is the one of the statement at pos. */
+typedef struct mc_line
+{
+	size_t address;
+	uint64_t pos;
+} mc_line;
+
+/* Gets the line table of linked machine code, in the order of the code. It must be freed. */
+size_t mc_lines(machine_code *mc, mc_line **lines);
+
+/* Appends the code of another buffer. Labels are shared, as they are numbered per source. */
+void mc_append(machine_code *to, machine_code *from);
+
+/* Resolves the jumps, choosing the shortest encoding. Returns the size of the code, which must be freed. */
+size_t mc_link(machine_code *mc, uint8_t **code);
+
+/* Writes machine code as an ELF64 relocatable object. */
+void object_write(FILE *out, const uint8_t *text, size_t length, const char *source);
+
+/* Whether comments are written along with the assembly (-fno-asm-comments). */
+extern bool_t asm_comments;
+
+operand oreg(int reg, size_t size);
+operand oimm(uint64_t value);
+operand olabel(size_t l);
+operand onone(void);
+
+/* The memory at a base register plus a displacement. */
+operand omem(int reg, uint64_t displacement, size_t size);
+
+/* Gets the mnemonic of an instruction. */
+const char *insn_name(insn op);
+
+/* Gets the name of a register from its hardware number and its size. */
+const char *register_name(int reg, size_t size);
+
+/* Emits an instruction. Unused operands are onone(), comment can be NULL. */
+void emit(insn op, operand a, operand b, const char *comment);
+
+/* Emits a label. */
+void emit_label(size_t l);
+
+/* Marks where the code of a statement starts. Only encoded code keeps the marks. */
+void emit_mark(uint64_t pos);
+
+/* Emits a comment on its own line. */
+void emit_comment(const char *comment);
+
+/* Appends assembly that was already formatted. */
+void emit_text(emit_buffer *b, const char *text, size_t length);
+
+/* Writes a buffer at once, then empties it. */
+void emit_flush(emit_buffer *b, FILE *out);
+
+/* Frees the memory of a buffer. */
+void emit_free(emit_buffer *b);
+
 /* Jumps to a label. */
-void goto_label(const char *jmp, size_t l);
+void goto_label(insn jmp, size_t l);
 
 /* Declares a label here. */
 void here_label(size_t l);
 
-/* Output a line of code. */
+/* Generates a statement. */
+void g_statement(statement_tree *tree);
+
+/* Gets the number of labels generating an expression takes. */
+size_t elabels(expression *tree);
+
+/* Gets the number of labels generating a statement takes. */
+size_t statement_labels(statement_tree *tree);
+
+/* Output a line of code, formatted like printf. Slower than emit. */
 void code(const char *fmt, ...);
 
 /* Gets the size of a type. */
 size_t rsizeof(foodtype *t);
 
-/* The file where the assembly will be outputted. */
-extern FILE *asm_target;
+/* The buffer where the assembly will be outputted. Each thread has its own. */
+extern ECK_TLS emit_buffer *asm_target;
 
 /* Generates an expression. */
 int g_expression(expression *tree);
@@ -440,13 +728,35 @@ void rfree(int reg);
 /* Generates a new label. */
 size_t label(void);
 
+/* Gets the number of the next label, without generating it. */
+size_t label_mark(void);
+
+/* Makes the next label generated have a specific number. */
+void label_restart(size_t next);
+
+/* Frees all of the registers. Nothing is kept in registers between top-level statements. */
+void rreset(void);
+
+/* Frees all of the registers and restarts label numbering. */
+void gen_reset(void);
+
+/* Whether expression statements leave their value in rax, extended to 64 bits (--run). */
+extern bool_t gen_result;
+
+/* Whether the code of each statement is marked with its position (the line table of -fperf-map). */
+extern bool_t gen_line_table;
+
 /* ===== SYMBOL RELATED ===== */
 
+/* The symbol comes from a module interface (using). */
+#define SYMBOL_IMPORTED 1
+
 /* Represents a symbol. */
 typedef struct symbol
 {
 	const char *name; /* The name of the symbol. */
 	foodtype    t;    /* The type of the symbol. */
+	uint8_t     flags; /* SYMBOL_* bits. */
 
 } symbol;
 
@@ -470,15 +780,24 @@ void scope_enter(void);
 */
 void scope_leave(void);
 
-/* Destroys a specific scope. Leave the argument to null to destroy all. */
+/*
+	Destroys the contents of a specific scope. Leave the argument to
+	null to destroy all, which also makes the base scope current again.
+*/
 void destroy_scopes(scope *s);
 
+/* Gets the base (file) scope. */
+scope *scope_base(void);
+
 /* Checks whether a symbol is declared. */
 bool_t declared(const char *name);
 
 /* Declares a symbol. Fails if already existing. */
 bool_t decl(const char *name, foodtype *t);
 
+/* Finds a symbol in the current scope or its parents. NULL if not found. */
+symbol *lookup(const char *name);
+
 /* Gets the type of a declaration. Fails if not found. */
 bool_t decltype(foodtype *dest, const char *name);
 
@@ -488,9 +807,383 @@ void dump_all(void);
 /* Gets the required stack for the current scope. */
 size_t required_size_for_scope(void);
 
+/* ===== MODULES ===== */
+
+/* Adds a directory where the interfaces of the modules are searched. */
+void module_add_path(const char *dir);
+
+/*
+	Prepares the modules for the compilation of a source. The interfaces
+	are first searched in the directory of the source, and written in
+	the directory of the output.
+*/
+void module_begin(const char *source, const char *output);
+
+/* Writes the interface of the module, if the source declared a namespace. */
+void module_end(bool_t ok);
+
+/* Names the module being compiled (namespace). */
+void module_name(const char *name, lex_token *site);
+
+/* Imports the interface of a module into the current scope (using). */
+bool_t module_import(const char *name, lex_token *site);
+
+/* Parses a namespace declaration. Only allowed at file scope. */
+void namespace_declaration(void);
+
+/* Parses a using clause. */
+void using_declaration(void);
+
+/* Parses anything that can be found at file scope. */
+void toplevel(void);
+
+/* Parses anything that can be found at file scope, without generating it. */
+statement_tree *parse_toplevel(void);
+
 /* === DRIVER === */
 
 /* Compiles a single object. */
 bool_t compile_object(const char *source, const char *output);
 
+/* Compiles an already opened source to an already opened output. */
+bool_t compile_stream(FILE *sfile, FILE *sout);
+
+/* Resets the state of the compiler before compiling a source. */
+void compile_begin(FILE *sfile, FILE *sout);
+
+/* Writes the diagnostics of a source. Returns true if it compiled. */
+bool_t compile_end(void);
+
+/* The number of threads generating the code of an object (-fcodegen-threads=N). */
+extern int codegen_threads;
+
+/*
+	Parses a whole source, then generates its top-level statements
+	on codegen_threads threads. The output is the same as with a
+	single thread.
+*/
+bool_t compile_threaded(FILE *sfile, FILE *sout);
+
+/* Whether the lexer, the parser and the code generator run on their own threads (-fpipeline). */
+extern bool_t pipeline;
+
+/* Whether the occupancy of the queues of the pipeline is printed (-fpipeline-stats). */
+extern bool_t pipeline_stats;
+
+/*
+	Compiles a source with the lexer, the parser and the code
+	generator running at once, each on its own thread.
+*/
+bool_t compile_pipelined(FILE *sfile, FILE *sout);
+
+/* Whether objects are recompiled incrementally (-fincremental). */
+extern bool_t incremental;
+
+/*
+	Compiles a source, reusing the code generated for the top-level
+	statements that did not change since the last compilation. The
+	state of the previous compilation is kept in the manifest file.
+*/
+bool_t compile_incremental(FILE *sfile, FILE *sout, const char *manifest);
+
+/* The outcome of running a source in-process. */
+typedef struct run_timing
+{
+	uint64_t result; /* The value of the last expression statement executed. */
+	size_t size;     /* The size of the code: bytes, or instructions for the interpreter. */
+	double compile;  /* The time spent compiling, in seconds. */
+	double run;      /* The time spent running, in seconds. */
+} run_timing;
+
+/* Compiles a source to machine code in memory and runs it. Returns false if it did not compile. */
+bool_t run_native(const char *source, run_timing *timing);
+
+/* Compiles a source to bytecode and interprets it. Returns false if it did not compile. */
+bool_t run_interpreted(const char *source, run_timing *timing);
+
+/*
+	Runs a source in-process (--run, or --interpret with interpreted
+	set). Prints the result, and the time spent compiling and running.
+*/
+bool_t compile_run(const char *source, bool_t interpreted);
+
+/* Compares the time to the first result of both ways of running a source (--run-bench). */
+bool_t run_bench(const char *source, int repeats);
+
+/* Whether sources are written as units for link-time optimization (-flto). */
+extern bool_t lto;
+
+/* Writes the statement trees of a source as a unit, instead of generating them (-flto). */
+bool_t compile_lto(FILE *sfile, FILE *sout);
+
+/*
+	Loads the units written with -flto, optimizes them as a whole
+	program and generates them into a single output (--lto-link).
+*/
+bool_t lto_link(char **units, size_t count, const char *output);
+
+/* Gets the name of the assembly file for a source file. Must be freed. */
+char *object_name(const char *source);
+
+/*
+	Compiles multiple objects using up to jobs worker processes.
+	Diagnostics are printed grouped per source, in the order of
+	the sources. Returns false if any of the objects failed.
+*/
+bool_t compile_objects(char **sources, size_t count, int jobs);
+
+/* Appends the options that change the generated code. Used to key the cache. */
+void options_signature(sha256_ctx *ctx);
+
+/* ===== TIMING ===== */
+
+/* The phases timed by -ftime-report and -ftime-trace. */
+typedef enum time_phase
+{
+	PHASE_COMPILE,   /* compile_object */
+	PHASE_LEX,       /* lex_fetch */
+	PHASE_PARSE,     /* parse_expression */
+	PHASE_FOLD,      /* esimple */
+	PHASE_STATEMENT, /* toplevel */
+	PHASE_GENERATE,  /* g_expression */
+	PHASE_FLUSH,     /* Writing the output and the diagnostics. */
+	PHASE_COUNT
+} time_phase;
+
+/* Whether the phases are timed. Timed functions test it before anything else. */
+extern bool_t time_enabled;
+
+/* Whether the phases of each source are printed (-ftime-report). */
+extern bool_t time_report;
+
+/* Where the trace events are written at exit (-ftime-trace=FILE). NULL if not traced. */
+extern const char *time_trace;
+
+/* Enters a phase. pos is the offset of a top-level statement, 0 otherwise. */
+void time_enter(time_phase phase, uint64_t pos);
+
+/* Leaves the phase entered last. */
+void time_leave(time_phase phase);
+
+/* Computes the lines and columns of the statements of the source being compiled. */
+void time_locate(void);
+
+/* Prints the report of a source, then starts over for the next one. */
+void time_source_done(const char *source);
+
+/* Writes the trace events as Chrome trace JSON. */
+bool_t time_trace_write(const char *path);
+
+/* ===== PROFILE ===== */
+
+/* Whether the branches count their edges (-fprofile-generate). Only with --run. */
+extern bool_t profile_generate;
+
+/* Whether the layout of the branches follows a profile (-fprofile-use, -fprofile-sample-use). */
+extern bool_t profile_use;
+
+/* The sample profile used instead of source.profile (-fprofile-sample-use=FILE). NULL if none. */
+extern const char *profile_sample;
+
+/* Whether --run writes /tmp/perf-PID.map, naming the code of each statement after its line (-fperf-map). */
+extern bool_t perf_map;
+
+/*
+	Allocates the two counters of a branching statement. For an if,
+	they count the then edge and the executions of the statement,
+	for a loop, the iterations and the exits. Returns the first one.
+*/
+size_t profile_counter(statement_tree *tree);
+
+/* Gets the number of counters allocated. */
+size_t profile_counters(void);
+
+/* Writes the counters of a run to the profile of a source, adding up to the counts already there. */
+bool_t profile_write(const char *source, const uint64_t *counters);
+
+/* Forgets the counters allocated. */
+void profile_reset(void);
+
+/* Loads the profile of a source (source.profile or the sample profile) for -fprofile-use. */
+void profile_load(const char *source);
+
+/* Gets the name of the profile -fprofile-use reads for a source. It must be freed. */
+char *profile_input(const char *source);
+
+/*
+	Looks up the counts of a branching statement in the profile
+	loaded: the then edge and the else edge of an if, the iterations
+	and the exits of a loop. Returns false if it was not profiled.
+*/
+bool_t profile_lookup(statement_tree *tree, uint64_t *first, uint64_t *second);
+
+/* Gets the name of the profile of a source. It must be freed. */
+char *profile_name(const char *source);
+
+/* ===== INSTRUMENTATION ===== */
+
+#define INSTRUMENT_NONE  0
+#define INSTRUMENT_HOOKS 1 /* Calls __food_enter and __food_exit. */
+#define INSTRUMENT_RDTSC 2 /* Counts the cycles inline. */
+
+/* How the top-level statements are timed (-finstrument-functions[=hooks|rdtsc]). Only with --run. */
+extern int instrument_mode;
+
+/* Only one call in this many is timed (-finstrument-sample=N). */
+extern uint64_t instrument_sample;
+
+/* The library the hooks are loaded from (-finstrument-hooks=LIB). NULL for the ones of eck. */
+extern const char *instrument_hooks;
+
+/* The record of a timed statement. The code receives them in rsi. */
+typedef struct instrument_record
+{
+	uint64_t countdown; /* The calls left until the next one timed. */
+	uint64_t start;     /* The time stamp of the call being timed (rdtsc). */
+	uint64_t cycles;    /* The cycles of the calls timed (rdtsc). */
+	uint64_t calls;     /* The calls timed (rdtsc). */
+} instrument_record;
+
+/* Allocates the record of a top-level statement, by the offset of its first token. */
+size_t instrument_site(uint64_t pos);
+
+/* Gets the address of the enter or exit hook, loading the library of the hooks if needed. */
+uint64_t instrument_hook(bool_t exit);
+
+/* Forgets the records allocated. */
+void instrument_reset(void);
+
+/* Computes the lines and columns of the statements timed, while the source is open. */
+void instrument_locate(void);
+
+/* Allocates the records for a run. */
+instrument_record *instrument_records(void);
+
+/* Prints the latencies of the statements timed, then frees the records. */
+void instrument_report(const char *source, instrument_record *records);
+
+/* The hooks of eck, which make a latency histogram of each statement. fn is its record, site its offset. */
+void __food_enter(uint64_t fn, uint64_t site);
+void __food_exit(uint64_t fn, uint64_t site);
+
+/* ===== COST ===== */
+
+/* Whether the cost of the code generated is estimated and printed for each source (-fcost-report). */
+extern bool_t cost_report;
+
+/* Chooses the processor the costs are the ones of (-mtune=NAME). Returns false if it is unknown. */
+bool_t cost_tune(const char *name);
+
+/* Records an instruction emitted, when in a top-level statement. */
+void cost_insn(insn op, const operand *a, const operand *b);
+
+/* Records a label placed, when in a top-level statement. */
+void cost_label(size_t l);
+
+/* Starts recording the code of a top-level statement. */
+void cost_begin(uint64_t pos);
+
+/* Estimates the cost of the code recorded since cost_begin. */
+void cost_end(void);
+
+/* Prints the statements estimated, the most expensive first, then starts over. The source must still be open. */
+void cost_print(const char *source);
+
+/* ===== STACK USAGE ===== */
+
+/* Whether the stack usage of each top-level statement is written to source.su (-fstack-usage). */
+extern bool_t stack_usage;
+
+/* Starts measuring the stack used by a top-level statement. */
+void stack_begin(statement_tree *tree);
+
+/* Follows the instructions that move the stack pointer, when in a top-level statement. */
+void stack_track(insn op, const operand *a, const operand *b);
+
+/* Ends the statement started by stack_begin. */
+void stack_end(void);
+
+/* Writes the statements measured to source.su, then starts over. The source must still be open. */
+bool_t stack_write(const char *source);
+
+/* ===== PASSES ===== */
+
+#define OPT_DEFAULT -1 /* No -O given: -O1, or -O2 for the units linked by --lto-link. */
+#define OPT_O0 0 /* No pass. */
+#define OPT_O1 1 /* Folds the constants. */
+#define OPT_O2 2 /* Also removes the code that never runs or whose value is not used. */
+
+/* The passes run on the statements, by -O level (-O0, -O1, -O2, -Os being -O2), OPT_DEFAULT if none is given. */
+extern int opt_level;
+
+/* Whether the runs, the changes and the time of each pass are printed for each source (-fpass-report). */
+extern bool_t pass_report;
+
+/* The pass after which the statements are printed to stderr (-print-after=PASS). NULL if none. */
+extern const char *print_after;
+
+/* Turns a pass on (-fPASS) or off (-fno-PASS) whatever the level. Returns false if there is no such pass. */
+bool_t pass_option(const char *name, bool_t enabled);
+
+/* Whether a pass has this name. */
+bool_t pass_exists(const char *name);
+
+/* Runs the passes on a top-level statement. Returns what replaces it, NULL if nothing does. */
+statement_tree *passes_run(statement_tree *tree);
+
+/* Appends the passes that run. Used to key the cache. */
+void passes_signature(sha256_ctx *ctx);
+
+/* Prints the statistics of the passes (-fpass-report), then starts over. */
+void pass_print(const char *source);
+
+/* Prints the statements kept by -print-after, located in the source, then starts over. */
+void pass_flush(const char *source);
+
+/* ===== CACHE ===== */
+
+/* The directory of the output cache. NULL if disabled. */
+extern const char *cache_dir;
+
+/* The maximum size of the cache, in bytes. */
+extern uint64_t cache_limit;
+
+/*
+	Looks up an object in the cache. On a hit, the cached assembly
+	is copied to output, the cached diagnostics are replayed and
+	true is returned.
+*/
+bool_t cache_fetch(const uint8_t key[32], const char *output, bool_t *status);
+
+/* Stores an object and its diagnostics in the cache. Evicts old entries if full. */
+void cache_store(const uint8_t key[32], const char *output, FILE *diags, bool_t status);
+
+/* Prints the statistics of the cache. */
+void cache_report(void);
+
+/* ===== SERVER ===== */
+
+/* The socket of the compile server to use. NULL to compile in-process. */
+extern const char *server_path;
+
+/* The options of the command line, sources left out, sent along with each request. */
+extern char **server_options;
+extern size_t server_option_count;
+
+/* Applies the options of a command line, as the workers of the server do with those of a request. */
+void options_apply(int argc, char *argv[]);
+
+/*
+	Runs a compile server listening on a local socket. Each request
+	is compiled in a worker forked from the server, so a crashing
+	compilation never takes the server down. Never returns.
+*/
+void server_run(const char *path);
+
+/*
+	Asks the compile server to compile an object. The diagnostics
+	are printed as if the object was compiled in-process.
+*/
+bool_t compile_remote(const char *source, const char *output);
+
 #endif
\ No newline at end of file
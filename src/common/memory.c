@@ -0,0 +1,242 @@
+/*
+	Allocation statistics for ECK (-fmem-report)
+
+	The allocations of the lexer, the parser, the types, the symbols
+	and the string builders go through MEM_MALLOC and friends, which
+	count them per subsystem. The blocks are ordinary malloc blocks,
+	so they can still be freed with free: the live bytes are only
+	lowered by MEM_FREE and MEM_REALLOC.
+
+	All of the columns are in requested bytes. The size of each block
+	is kept in a table by address while -fmem-report is on, so that
+	it is known again when the block is freed or reallocated.
+
+	With NDEBUG, the macros are the functions of the C library.
+*/
+#include "def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ECK_THREADS
+	#include <pthread.h>
+#endif
+
+bool_t mem_report = FALSE;
+
+#ifndef NDEBUG
+
+static const char *const s_names[MEM_COUNT] = { "lexer", "parser", "types", "symbols", "strings" };
+
+/* The statistics of a subsystem. */
+typedef struct mem_stats
+{
+	uint64_t allocations; /* The number of blocks allocated. */
+	uint64_t bytes;       /* The bytes requested, reallocations included. */
+	uint64_t reallocations;
+	uint64_t frees;
+	int64_t live;         /* The bytes allocated and not freed yet. */
+	int64_t peak;         /* The most live bytes at once. */
+} mem_stats;
+
+static mem_stats s_stats[MEM_COUNT];
+static int64_t s_live = 0, s_peak = 0;
+
+/* A block allocated, in the table of the blocks. */
+typedef struct mem_block
+{
+	void *p;     /* NULL if the slot is free. */
+	size_t size; /* The size requested. */
+} mem_block;
+
+/* Hash table of the blocks, by address, kept at most half full. */
+static mem_block *s_blocks = NULL;
+static size_t s_block_count = 0, s_block_max = 0;
+
+#ifdef ECK_THREADS
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The slot a block would be in, were there no collision. */
+static size_t s_home(void *p)
+{
+	return ((size_t)p >> 4) * 2654435761u & (s_block_max - 1);
+}
+
+/* The slot of a block, or the free slot it would take. */
+static size_t s_slot(void *p)
+{
+	size_t i = s_home(p);
+	while (s_blocks[i].p && s_blocks[i].p != p) i = (i + 1) & (s_block_max - 1);
+	return i;
+}
+
+/* Keeps the size of a block. A block freed with free leaves its address to the next one. */
+static void s_track(void *p, size_t size)
+{
+	mem_block *old;
+	size_t i, old_max;
+#ifdef ECK_THREADS
+	pthread_mutex_lock(&s_lock);
+#endif
+	if ((s_block_count + 1) * 2 > s_block_max) {
+		old = s_blocks;
+		old_max = s_block_max;
+		s_block_max = s_block_max ? s_block_max * 2 : 1024;
+		s_blocks = calloc(s_block_max, sizeof(mem_block));
+		for (i = 0; i < old_max; i++) {
+			if (old[i].p) s_blocks[s_slot(old[i].p)] = old[i];
+		}
+		free(old);
+	}
+	i = s_slot(p);
+	if (!s_blocks[i].p) s_block_count++;
+	s_blocks[i].p = p;
+	s_blocks[i].size = size;
+#ifdef ECK_THREADS
+	pthread_mutex_unlock(&s_lock);
+#endif
+}
+
+/* Forgets a block. Returns its size, 0 if it is not known. */
+static size_t s_untrack(void *p)
+{
+	size_t i, j, k, yield = 0;
+#ifdef ECK_THREADS
+	pthread_mutex_lock(&s_lock);
+#endif
+	if (s_block_max && s_blocks[i = s_slot(p)].p) {
+		yield = s_blocks[i].size;
+		s_blocks[i].p = NULL;
+		s_block_count--;
+		/* The blocks after it in the run move back, so that they can still be found. */
+		for (j = (i + 1) & (s_block_max - 1); s_blocks[j].p; j = (j + 1) & (s_block_max - 1)) {
+			k = s_home(s_blocks[j].p);
+			if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+				s_blocks[i] = s_blocks[j];
+				s_blocks[j].p = NULL;
+				i = j;
+			}
+		}
+	}
+#ifdef ECK_THREADS
+	pthread_mutex_unlock(&s_lock);
+#endif
+	return yield;
+}
+
+/* Changes the live bytes of a subsystem. */
+static void s_live_add(mem_subsystem s, int64_t delta)
+{
+	int64_t live, total;
+#ifdef ECK_THREADS
+	live = __atomic_add_fetch(&s_stats[s].live, delta, __ATOMIC_RELAXED);
+	total = __atomic_add_fetch(&s_live, delta, __ATOMIC_RELAXED);
+#else
+	live = s_stats[s].live += delta;
+	total = s_live += delta;
+#endif
+	/* The peaks can be a bit off when several threads allocate at once. */
+	if (live > s_stats[s].peak) s_stats[s].peak = live;
+	if (total > s_peak) s_peak = total;
+}
+
+static void s_count(uint64_t *counter, uint64_t value)
+{
+#ifdef ECK_THREADS
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+#else
+	*counter += value;
+#endif
+}
+
+void *mem_malloc(mem_subsystem s, size_t size)
+{
+	void *yield = malloc(size);
+	if (mem_report) {
+		s_count(&s_stats[s].allocations, 1);
+		s_count(&s_stats[s].bytes, size);
+		if (yield) {
+			s_track(yield, size);
+			s_live_add(s, (int64_t)size);
+		}
+	}
+	return yield;
+}
+
+void *mem_calloc(mem_subsystem s, size_t count, size_t size)
+{
+	void *yield = calloc(count, size);
+	if (mem_report) {
+		s_count(&s_stats[s].allocations, 1);
+		s_count(&s_stats[s].bytes, count * size);
+		if (yield) {
+			s_track(yield, count * size);
+			s_live_add(s, (int64_t)(count * size));
+		}
+	}
+	return yield;
+}
+
+void *mem_realloc(mem_subsystem s, void *p, size_t size)
+{
+	size_t before;
+	void *yield;
+	if (!mem_report) return realloc(p, size);
+
+	before = p ? s_untrack(p) : 0;
+	yield = realloc(p, size);
+	s_count(p ? &s_stats[s].reallocations : &s_stats[s].allocations, 1);
+	s_count(&s_stats[s].bytes, size);
+	if (!yield) {
+		/* The block is left as it was. */
+		if (p && size) s_track(p, before);
+		else s_live_add(s, -(int64_t)before);
+		return yield;
+	}
+	s_track(yield, size);
+	s_live_add(s, (int64_t)size - (int64_t)before);
+	return yield;
+}
+
+void mem_free(mem_subsystem s, void *p)
+{
+	if (mem_report && p) {
+		s_count(&s_stats[s].frees, 1);
+		s_live_add(s, -(int64_t)s_untrack(p));
+	}
+	free(p);
+}
+
+void mem_print(void)
+{
+	mem_stats total;
+	int s;
+
+	memset(&total, 0, sizeof(total));
+	fprintf(stderr, "%-10s %12s %14s %12s %12s %14s %14s\n",
+		"subsystem", "allocations", "bytes", "reallocs", "frees", "live bytes", "peak bytes");
+	for (s = 0; s < MEM_COUNT; s++) {
+		fprintf(stderr, "%-10s %12lu %14lu %12lu %12lu %14ld %14ld\n", s_names[s],
+			(unsigned long)s_stats[s].allocations, (unsigned long)s_stats[s].bytes,
+			(unsigned long)s_stats[s].reallocations, (unsigned long)s_stats[s].frees,
+			(long)s_stats[s].live, (long)s_stats[s].peak);
+		total.allocations += s_stats[s].allocations;
+		total.bytes += s_stats[s].bytes;
+		total.reallocations += s_stats[s].reallocations;
+		total.frees += s_stats[s].frees;
+	}
+	fprintf(stderr, "%-10s %12lu %14lu %12lu %12lu %14ld %14ld\n", "total",
+		(unsigned long)total.allocations, (unsigned long)total.bytes,
+		(unsigned long)total.reallocations, (unsigned long)total.frees,
+		(long)s_live, (long)s_peak);
+}
+
+#else
+
+void mem_print(void)
+{
+	fprintf(stderr, "-fmem-report: eck was built with NDEBUG, allocations are not counted\n");
+}
+
+#endif
@@ -0,0 +1,608 @@
+/*
+	Static cost estimates for ECK (-fcost-report, -mtune=NAME)
+
+	The instructions and the labels emitted for each top-level
+	statement are recorded as they are generated, then cut into
+	basic blocks at the labels and after the jumps. A jump back to
+	a label of the same statement closes a loop.
+
+	The cycles of a run of instructions are the most of:
+	  - the uops, divided by the issue width of the processor;
+	  - the busiest port, each instruction adding its reciprocal
+	    throughput to every port it can issue on;
+	  - the longest chain of dependencies through the registers, the
+	    flags and memory, from the latencies of the instructions.
+	This is the resource-bound estimate of llvm-mca and IACA, without
+	any simulation: a block is estimated as if run once, a loop as
+	one iteration of its blocks in order.
+
+	The timings are the ones of the register forms, from the tables
+	of Agner Fog and uops.info. A memory operand adds a load or a
+	store. Writes to 8 and 16 bits registers merge with the rest of
+	the register, so they also depend on its previous value.
+
+	The statements are printed the most expensive first, along with
+	their blocks, their loops and their costliest instructions.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The dependencies of an instruction: registers 0 to 15, then these. */
+#define COST_FLAGS  16
+#define COST_MEMORY 17
+#define COST_KEYS   18
+
+#define COST_PORTS 8
+
+/* An instruction at least this slow is listed (latency or reciprocal throughput, in cycles). */
+#define COST_SLOW_LATENCY    10.0
+#define COST_SLOW_THROUGHPUT 5.0
+
+/* The timing of an instruction on a processor. */
+typedef struct cost_timing
+{
+	double latency;    /* The cycles until its result can be used. */
+	double throughput; /* The cycles between two independent ones. */
+	uint8_t uops;
+	uint8_t ports;     /* Bit i: it can issue on port i. */
+} cost_timing;
+
+/* A processor (-mtune). */
+typedef struct cost_model
+{
+	const char *name;
+	double width;                   /* The uops issued per cycle. */
+	cost_timing load, store;        /* A memory operand. The latency of a store is the one of forwarding it. */
+	cost_timing idiv64, shift_cl;   /* The forms that differ from the table. */
+	cost_timing insns[INSN_COUNT];  /* The 32 bits register forms, in the order of insn. */
+} cost_model;
+
+static const cost_model s_models[] =
+{
+	{
+		"generic", 4.0,
+		{ 5, 0.5, 1, 0x0C }, { 5, 1, 1, 0x10 },
+		{ 45, 30, 60, 0x01 }, { 2, 2, 3, 0x21 },
+		{
+			{ 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, /* mov xor add sub */
+			{ 3, 1, 1, 0x02 }, { 26, 8, 10, 0x01 },                                              /* imul idiv */
+			{ 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 }, { 2, 1, 2, 0x21 },                         /* cqo cdq cwd */
+			{ 0, 0, 0, 0x00 }, { 0, 0, 0, 0x00 },                                                /* push pop */
+			{ 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 }, /* and or test cmp */
+			{ 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 },                       /* sete setne setl */
+			{ 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 },                       /* setle setg setge */
+			{ 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 }, { 1, 0.5, 1, 0x21 },                       /* sal shr sar */
+			{ 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 },                                          /* neg not */
+			{ 0, 1, 1, 0x20 }, { 0, 0.5, 1, 0x21 }, { 0, 0.5, 1, 0x21 },                         /* jmp je jne */
+			{ 1, 0.33, 1, 0x23 }, { 1, 0.33, 1, 0x23 },                                          /* movsx movzx */
+			{ 0, 2, 1, 0x20 }, { 0, 2, 2, 0x20 }, { 30, 30, 20, 0x23 }                           /* ret call rdtsc */
+		}
+	},
+	{
+		/* Skylake: ALUs on ports 0, 1, 5 and 6, loads on 2 and 3, stores on 4. */
+		"skylake", 4.0,
+		{ 5, 0.5, 1, 0x0C }, { 4.5, 1, 1, 0x10 },
+		{ 42, 24, 57, 0x01 }, { 2, 2, 3, 0x41 },
+		{
+			{ 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 },
+			{ 3, 1, 1, 0x02 }, { 26, 6, 10, 0x01 },
+			{ 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 }, { 2, 1, 2, 0x41 },
+			{ 0, 0, 0, 0x00 }, { 0, 0, 0, 0x00 },
+			{ 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 },
+			{ 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 },
+			{ 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 },
+			{ 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 }, { 1, 0.5, 1, 0x41 },
+			{ 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 },
+			{ 0, 1, 1, 0x40 }, { 0, 0.5, 1, 0x41 }, { 0, 0.5, 1, 0x41 },
+			{ 1, 0.25, 1, 0x63 }, { 1, 0.25, 1, 0x63 },
+			{ 0, 1, 1, 0x40 }, { 0, 1, 2, 0x40 }, { 25, 25, 20, 0x63 }
+		}
+	},
+	{
+		/* Zen 3: ALUs on ports 0 to 3, the multiplier and the shifter on 1 and 2, loads on 4 and 5, stores on 6. */
+		"znver3", 6.0,
+		{ 4, 0.33, 1, 0x30 }, { 4, 0.5, 1, 0x40 },
+		{ 14, 10, 2, 0x02 }, { 1, 0.5, 1, 0x06 },
+		{
+			{ 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F },
+			{ 3, 1, 1, 0x02 }, { 10, 6, 2, 0x02 },
+			{ 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F }, { 1, 0.5, 2, 0x0F },
+			{ 0, 0, 0, 0x00 }, { 0, 0, 0, 0x00 },
+			{ 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F },
+			{ 1, 0.5, 1, 0x09 }, { 1, 0.5, 1, 0x09 }, { 1, 0.5, 1, 0x09 },
+			{ 1, 0.5, 1, 0x09 }, { 1, 0.5, 1, 0x09 }, { 1, 0.5, 1, 0x09 },
+			{ 1, 0.5, 1, 0x06 }, { 1, 0.5, 1, 0x06 }, { 1, 0.5, 1, 0x06 },
+			{ 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F },
+			{ 0, 0.5, 1, 0x09 }, { 0, 0.5, 1, 0x09 }, { 0, 0.5, 1, 0x09 },
+			{ 1, 0.25, 1, 0x0F }, { 1, 0.25, 1, 0x0F },
+			{ 0, 2, 1, 0x09 }, { 0, 2, 2, 0x09 }, { 38, 38, 37, 0x0F }
+		}
+	}
+};
+
+bool_t cost_report = FALSE;
+
+static const cost_model *s_model = &s_models[0];
+
+/* An instruction or a label recorded. */
+typedef struct cost_item
+{
+	uint8_t op; /* INSN_COUNT for a label, numbered by a.value. */
+	operand a, b;
+} cost_item;
+
+/* A top-level statement estimated. */
+typedef struct cost_function
+{
+	uint64_t pos;
+	size_t line, col;
+	size_t instructions, blocks, loops;
+	double cycles;
+	char *details; /* Its blocks, loops and slow instructions, a line each. */
+} cost_function;
+
+/* The estimate of a run of instructions. */
+typedef struct cost_estimate
+{
+	size_t instructions;
+	double uops;
+	double issue, port, latency; /* The three bounds. */
+	int busiest;
+	double cycles;
+} cost_estimate;
+
+/* The statement being recorded, by the thread generating it. */
+static ECK_TLS cost_item *s_items = NULL;
+static ECK_TLS size_t s_item_count = 0, s_item_max = 0;
+static ECK_TLS bool_t s_open = FALSE;
+static ECK_TLS uint64_t s_pos = 0;
+
+/* The statements of the source, estimated. */
+static cost_function *s_functions = NULL;
+static size_t s_function_count = 0, s_function_max = 0;
+
+bool_t cost_tune(const char *name)
+{
+	size_t i;
+	for (i = 0; i < sizeof(s_models) / sizeof(s_models[0]); i++) {
+		if (!strcmp(s_models[i].name, name)) {
+			s_model = &s_models[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void s_record(uint8_t op, const operand *a, const operand *b)
+{
+	if (s_item_count == s_item_max) {
+		s_item_max = s_item_max ? s_item_max * 2 : 256;
+		s_items = realloc(s_items, sizeof(cost_item) * s_item_max);
+	}
+	s_items[s_item_count].op = op;
+	s_items[s_item_count].a = *a;
+	s_items[s_item_count].b = *b;
+	s_item_count++;
+}
+
+void cost_insn(insn op, const operand *a, const operand *b)
+{
+	if (s_open) s_record((uint8_t)op, a, b);
+}
+
+void cost_label(size_t l)
+{
+	operand a = olabel(l), b = onone();
+	if (s_open) s_record(INSN_COUNT, &a, &b);
+}
+
+void cost_begin(uint64_t pos)
+{
+	s_item_count = 0;
+	s_pos = pos;
+	s_open = TRUE;
+}
+
+static bool_t s_jump(uint8_t op)
+{
+	return op == INSN_JMP || op == INSN_JE || op == INSN_JNE || op == INSN_RET;
+}
+
+/* Gets the dependency of the register or the base of an operand, 0 if none. */
+static uint32_t s_uses(const operand *o)
+{
+	if (o->kind == OPERAND_REGISTER || o->kind == OPERAND_MEMORY) return (uint32_t)1 << o->reg;
+	return 0;
+}
+
+/* Whether an instruction writes 8 or 16 bits of a register, keeping the rest. */
+static bool_t s_partial(const cost_item *item)
+{
+	switch (item->op) {
+		case INSN_MOVSX: case INSN_MOVZX: case INSN_CMP: case INSN_TEST: case INSN_PUSH:
+		case INSN_IDIV: case INSN_CALL: case INSN_JMP: case INSN_JE: case INSN_JNE:
+			return FALSE;
+	}
+	return item->a.kind == OPERAND_REGISTER && item->a.size < 4;
+}
+
+/* Whether an instruction does not depend on its operands, like xor eax, eax. */
+static bool_t s_idiom(const cost_item *item)
+{
+	return (item->op == INSN_XOR || item->op == INSN_SUB) && item->a.kind == OPERAND_REGISTER
+		&& item->b.kind == OPERAND_REGISTER && item->a.reg == item->b.reg && item->a.size >= 4;
+}
+
+/* Gets the timing of an instruction, and what it reads and writes. */
+static cost_timing s_effects(const cost_item *item, uint32_t *reads, uint32_t *writes, bool_t *load, bool_t *store)
+{
+	const uint32_t rax = 1 << REG_RAX, rdx = 1 << REG_RDX, rsp = 1 << REG_RSP, flags = 1 << COST_FLAGS;
+	cost_timing yield = s_model->insns[item->op];
+
+	*reads = s_uses(&item->b);
+	*writes = 0;
+	*load = item->b.kind == OPERAND_MEMORY;
+	*store = FALSE;
+	switch (item->op) {
+		case INSN_MOV: case INSN_MOVSX: case INSN_MOVZX:
+			if (item->a.kind == OPERAND_MEMORY) {
+				*reads |= s_uses(&item->a);
+				*store = TRUE;
+			} else {
+				*writes = s_uses(&item->a);
+			}
+			break;
+		case INSN_XOR: case INSN_ADD: case INSN_SUB: case INSN_IMUL: case INSN_AND: case INSN_OR:
+		case INSN_SAL: case INSN_SHR: case INSN_SAR: case INSN_NEG: case INSN_NOT:
+			if ((item->op == INSN_SAL || item->op == INSN_SHR || item->op == INSN_SAR) && item->b.kind == OPERAND_REGISTER) yield = s_model->shift_cl;
+			*reads |= s_uses(&item->a);
+			*writes = item->op == INSN_NOT ? 0 : flags;
+			if (item->a.kind == OPERAND_MEMORY) {
+				*load = *store = TRUE;
+			} else {
+				*writes |= s_uses(&item->a);
+			}
+			if (s_idiom(item)) {
+				*reads = 0;
+				yield.latency = 0;
+			}
+			break;
+		case INSN_CMP: case INSN_TEST:
+			*reads |= s_uses(&item->a);
+			*load |= item->a.kind == OPERAND_MEMORY;
+			*writes = flags;
+			break;
+		case INSN_IDIV:
+			if (item->a.size == 8) yield = s_model->idiv64;
+			*reads = s_uses(&item->a) | rax | rdx;
+			*writes = rax | rdx | flags;
+			*load = item->a.kind == OPERAND_MEMORY;
+			break;
+		case INSN_CQO: case INSN_CDQ: case INSN_CWD:
+			*reads = rax;
+			*writes = rdx;
+			break;
+		case INSN_PUSH:
+			*reads = s_uses(&item->a) | rsp;
+			*writes = rsp;
+			*store = TRUE;
+			break;
+		case INSN_POP:
+			*reads = rsp;
+			*writes = s_uses(&item->a) | rsp;
+			*load = TRUE;
+			break;
+		case INSN_SETE: case INSN_SETNE: case INSN_SETL: case INSN_SETLE: case INSN_SETG: case INSN_SETGE:
+			*reads = flags;
+			*writes = s_uses(&item->a);
+			break;
+		case INSN_JE: case INSN_JNE:
+			*reads = flags;
+			break;
+		case INSN_RET:
+			*reads = rsp;
+			*load = TRUE;
+			break;
+		case INSN_CALL:
+			/* The callee is not known: only its result is a dependency. */
+			*reads = s_uses(&item->a) | rsp;
+			*writes = rax;
+			*store = TRUE;
+			break;
+		case INSN_RDTSC:
+			*reads = 0;
+			*writes = rax | rdx;
+			break;
+	}
+	if (s_partial(item)) *reads |= s_uses(&item->a);
+	return yield;
+}
+
+/* Adds the reciprocal throughput of some uops to their ports. */
+static void s_ports(double pressure[COST_PORTS], const cost_timing *t)
+{
+	int p;
+	for (p = 0; p < COST_PORTS; p++) {
+		if (t->ports & (1 << p)) pressure[p] += t->throughput;
+	}
+}
+
+/* Estimates the instructions of items [from, to), labels excluded. */
+static cost_estimate s_estimate(size_t from, size_t to)
+{
+	double ready[COST_KEYS], pressure[COST_PORTS], start, end;
+	cost_estimate yield;
+	cost_timing t;
+	uint32_t reads, writes;
+	bool_t load, store;
+	size_t i;
+	int k;
+
+	memset(&yield, 0, sizeof(yield));
+	memset(ready, 0, sizeof(ready));
+	memset(pressure, 0, sizeof(pressure));
+	for (i = from; i < to; i++) {
+		if (s_items[i].op == INSN_COUNT) continue;
+		t = s_effects(&s_items[i], &reads, &writes, &load, &store);
+		yield.instructions++;
+		yield.uops += t.uops + load + store;
+		s_ports(pressure, &t);
+		if (load) s_ports(pressure, &s_model->load);
+		if (store) s_ports(pressure, &s_model->store);
+
+		/* The chain of dependencies */
+		start = 0;
+		for (k = 0; k < COST_KEYS; k++) {
+			if ((reads & ((uint32_t)1 << k)) && ready[k] > start) start = ready[k];
+		}
+		if (load) {
+			if (ready[COST_MEMORY] > start) start = ready[COST_MEMORY];
+			start += s_model->load.latency;
+		}
+		end = start + t.latency;
+		for (k = 0; k < COST_KEYS; k++) {
+			if (writes & ((uint32_t)1 << k)) ready[k] = end;
+		}
+		if (store) ready[COST_MEMORY] = end + s_model->store.latency;
+		if (end > yield.latency) yield.latency = end;
+	}
+	yield.issue = yield.uops / s_model->width;
+	for (k = 0; k < COST_PORTS; k++) {
+		if (pressure[k] > yield.port) {
+			yield.port = pressure[k];
+			yield.busiest = k;
+		}
+	}
+	yield.cycles = yield.issue;
+	if (yield.port > yield.cycles) yield.cycles = yield.port;
+	if (yield.latency > yield.cycles) yield.cycles = yield.latency;
+	return yield;
+}
+
+static void s_append(string_builder *out, const char *fmt, double a, double b, double c, double d)
+{
+	char buffer[256];
+	sprintf(buffer, fmt, a, b, c, d);
+	strbuilder_append_string(out, buffer);
+}
+
+/* Names a label as in the assembly. */
+static void s_label_name(char name[32], uint64_t l)
+{
+	sprintf(name, ".L%04lX", (unsigned long)l);
+}
+
+/* Appends an estimate, and what bounds it. */
+static void s_bound(string_builder *out, const cost_estimate *e, const char *per)
+{
+	char buffer[64];
+	s_append(out, "%4.0f instructions %6.2f uops %8.2f cycles", (double)e->instructions, e->uops, e->cycles, 0);
+	strbuilder_append_string(out, (char *)per);
+	if (e->cycles == e->latency && e->latency > 0) {
+		strbuilder_append_string(out, "(latency bound)\n");
+	} else if (e->cycles == e->port && e->port > e->issue) {
+		sprintf(buffer, "(port %d bound)\n", e->busiest);
+		strbuilder_append_string(out, buffer);
+	} else {
+		strbuilder_append_string(out, "(issue bound)\n");
+	}
+}
+
+/* Formats an instruction like the assembly. */
+static void s_format(char *out, const cost_item *item)
+{
+	const operand *o[2];
+	int i;
+	o[0] = &item->a;
+	o[1] = &item->b;
+	out += sprintf(out, "%s", insn_name((insn)item->op));
+	for (i = 0; i < 2 && o[i]->kind != OPERAND_NONE; i++) {
+		out += sprintf(out, i ? ", " : " ");
+		switch (o[i]->kind) {
+			case OPERAND_REGISTER:
+				out += sprintf(out, "%s", register_name(o[i]->reg, o[i]->size));
+				break;
+			case OPERAND_MEMORY:
+				out += sprintf(out, "[%s + %lu]", register_name(o[i]->reg, 8), (unsigned long)o[i]->value);
+				break;
+			case OPERAND_LABEL:
+				s_label_name(out, o[i]->value);
+				out += strlen(out);
+				break;
+			default:
+				out += sprintf(out, "%lu", (unsigned long)o[i]->value);
+				break;
+		}
+	}
+}
+
+/*
+	Whether the code from the label at item from can get to the jump
+	at item to without leaving them. The bodies of an if are placed
+	before its condition, which jumps back to them without a loop.
+*/
+static bool_t s_reaches(size_t from, size_t to)
+{
+	size_t *pending, count = 0, k, target;
+	bool_t *seen, yield = FALSE;
+
+	pending = malloc(sizeof(size_t) * (to - from + 1) * 2);
+	seen = calloc(to - from + 1, sizeof(bool_t));
+	pending[count++] = from;
+	seen[0] = TRUE;
+	while (count && !yield) {
+		k = pending[--count];
+		if (k == to) {
+			yield = TRUE;
+			break;
+		}
+		/* The next instruction, and the label jumped to if it is in the range */
+		if (s_items[k].op != INSN_JMP && s_items[k].op != INSN_RET && !seen[k + 1 - from]) {
+			seen[k + 1 - from] = TRUE;
+			pending[count++] = k + 1;
+		}
+		if (s_items[k].op != INSN_JMP && s_items[k].op != INSN_JE && s_items[k].op != INSN_JNE) continue;
+		for (target = from; target <= to; target++) {
+			if (s_items[target].op == INSN_COUNT && s_items[target].a.value == s_items[k].a.value) break;
+		}
+		if (target <= to && !seen[target - from]) {
+			seen[target - from] = TRUE;
+			pending[count++] = target;
+		}
+	}
+	free(pending);
+	free(seen);
+	return yield;
+}
+
+void cost_end(void)
+{
+	cost_function *f;
+	cost_estimate e;
+	cost_timing t;
+	string_builder out;
+	char name[32], text[128];
+	uint32_t reads, writes;
+	bool_t load, store;
+	size_t i, j, start = 0, block = 0;
+
+	s_open = FALSE;
+	if (s_function_count == s_function_max) {
+		s_function_max = s_function_max ? s_function_max * 2 : 64;
+		s_functions = realloc(s_functions, sizeof(cost_function) * s_function_max);
+	}
+	f = &s_functions[s_function_count++];
+	memset(f, 0, sizeof(*f));
+	f->pos = s_pos;
+	strbuilder_alloc(&out, 1024);
+
+	/* 1. The blocks: a label starts one, a jump ends one */
+	for (i = 1; i <= s_item_count; i++) {
+		if (i < s_item_count && s_items[i].op != INSN_COUNT && !s_jump(s_items[i - 1].op)) continue;
+		e = s_estimate(start, i);
+		if (e.instructions) {
+			if (s_items[start].op == INSN_COUNT) s_label_name(name, s_items[start].a.value);
+			else strcpy(name, "");
+			sprintf(text, "    block %-3lu %-8s", (unsigned long)block++, name);
+			strbuilder_append_string(&out, text);
+			s_bound(&out, &e, " ");
+		}
+		start = i;
+	}
+	f->blocks = block;
+
+	/* 2. The loops: a jump back to a label of the statement, which the label leads to */
+	for (i = 0; i < s_item_count; i++) {
+		if (s_items[i].op != INSN_JMP && s_items[i].op != INSN_JE && s_items[i].op != INSN_JNE) continue;
+		for (j = 0; j < i; j++) {
+			if (s_items[j].op == INSN_COUNT && s_items[j].a.value == s_items[i].a.value) break;
+		}
+		if (j == i || !s_reaches(j, i)) continue;
+		e = s_estimate(j, i + 1);
+		s_label_name(name, s_items[j].a.value);
+		sprintf(text, "    loop      %-8s", name);
+		strbuilder_append_string(&out, text);
+		s_bound(&out, &e, " per iteration ");
+		f->loops++;
+	}
+
+	/* 3. The instructions to look at */
+	for (i = 0; i < s_item_count; i++) {
+		if (s_items[i].op == INSN_COUNT) continue;
+		t = s_effects(&s_items[i], &reads, &writes, &load, &store);
+		s_format(text, &s_items[i]);
+		if (t.latency >= COST_SLOW_LATENCY || t.throughput >= COST_SLOW_THROUGHPUT) {
+			strbuilder_append_string(&out, "    ! ");
+			strbuilder_append_string(&out, text);
+			s_append(&out, ": latency %.0f, one every %.0f cycles\n", t.latency, t.throughput, 0, 0);
+		}
+		if (s_partial(&s_items[i])) {
+			strbuilder_append_string(&out, "    ! ");
+			strbuilder_append_string(&out, text);
+			strbuilder_append_string(&out, ": partial register write, depends on ");
+			strbuilder_append_string(&out, (char *)register_name(s_items[i].a.reg, 8));
+			strbuilder_append_string(&out, "\n");
+		}
+	}
+	strbuilder_append_char(&out, 0);
+
+	e = s_estimate(0, s_item_count);
+	f->instructions = e.instructions;
+	f->cycles = e.cycles;
+	f->details = out.storage;
+}
+
+static int s_by_pos(const void *a, const void *b)
+{
+	const cost_function *l = a, *r = b;
+	return l->pos < r->pos ? -1 : (l->pos > r->pos);
+}
+
+static int s_by_cycles(const void *a, const void *b)
+{
+	const cost_function *l = a, *r = b;
+	if (l->cycles != r->cycles) return l->cycles > r->cycles ? -1 : 1;
+	return s_by_pos(a, b);
+}
+
+void cost_print(const char *source)
+{
+	uint64_t *positions;
+	size_t *lines, *cols, i;
+	double total = 0;
+	char name[256];
+
+	if (!s_function_count) return;
+
+	/* 1. Locating the statements, in the order of the source */
+	qsort(s_functions, s_function_count, sizeof(cost_function), s_by_pos);
+	positions = malloc(sizeof(uint64_t) * s_function_count);
+	lines = malloc(sizeof(size_t) * s_function_count);
+	cols = malloc(sizeof(size_t) * s_function_count);
+	for (i = 0; i < s_function_count; i++) {
+		positions[i] = s_functions[i].pos;
+		total += s_functions[i].cycles;
+	}
+	lex_sites(positions, s_function_count, lines, cols);
+	for (i = 0; i < s_function_count; i++) {
+		s_functions[i].line = lines[i];
+		s_functions[i].col = cols[i];
+	}
+	free(positions);
+	free(lines);
+	free(cols);
+
+	/* 2. Printing them, the most expensive first */
+	qsort(s_functions, s_function_count, sizeof(cost_function), s_by_cycles);
+	fprintf(stderr, "estimated cost of %s for %s, %.2f cycles if each block runs once:\n", source, s_model->name, total);
+	for (i = 0; i < s_function_count; i++) {
+		sprintf(name, "%.200s:%lu:%lu", source, (unsigned long)s_functions[i].line, (unsigned long)s_functions[i].col);
+		fprintf(stderr, "  %-32s %8.2f cycles %6lu instructions %4lu blocks %3lu loops\n", name, s_functions[i].cycles,
+			(unsigned long)s_functions[i].instructions, (unsigned long)s_functions[i].blocks, (unsigned long)s_functions[i].loops);
+		fputs(s_functions[i].details, stderr);
+		MEM_FREE(MEM_STRINGS, s_functions[i].details);
+	}
+	s_function_count = 0;
+}
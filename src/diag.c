@@ -1,58 +1,321 @@
+/*
+	Diagnostics for ECK
+
+	Diagnostics are not printed right away. Each one is recorded
+	with the offset of its token and its formatted message, and
+	they are all written at once by diag_flush, when the source is
+	done. Lines and columns are only computed then, in a single
+	pass over the source with the records sorted by offset.
+
+	The same message at the same place is only reported once, and
+	after error_limit errors the lexer is stopped so the parser
+	unwinds quickly.
+
+	The parser and the code generator can run on their own threads,
+	so the records are taken under a lock.
+*/
 #include "common/def.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdarg.h>
 
+#ifdef ECK_THREADS
+	#include <pthread.h>
+#endif
+
+#define DIAG_INFO  0
+#define DIAG_WARN  1
+#define DIAG_ERROR 2
+
 static bool_t sclean = TRUE;
+static size_t scount = 0;
+FILE *diag_target = NULL;
+size_t error_limit = 0;
+bool_t diag_json = FALSE;
+const char *diag_source = NULL;
+
+#define DOUT (diag_target ? diag_target : stderr)
+
+/* A diagnostic waiting to be written. */
+typedef struct diag_record
+{
+	uint8_t kind;    /* DIAG_INFO, DIAG_WARN or DIAG_ERROR */
+	uint64_t pos;    /* The offset of the token. */
+	const char *fmt; /* The format of the message, which identifies it. */
+	size_t text;     /* The offset of the formatted message in the text buffer. */
+	size_t line;     /* Computed when flushed. */
+	size_t col;      /* Computed when flushed. */
+} diag_record;
+
+static diag_record *s_records = NULL;
+static size_t s_count = 0, s_max = 0;
+static string_builder s_text = { NULL, 0, 0, 0 }; /* The formatted messages, separated by zeros. */
+static size_t *s_seen = NULL; /* Hash set of the records, to find duplicates. Stores index + 1. */
+static size_t s_seen_max = 0;
+static size_t s_errors = 0;
+static bool_t s_stopped = FALSE;
+
+#ifdef ECK_THREADS
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+	#define DIAG_LOCK() pthread_mutex_lock(&s_lock)
+	#define DIAG_UNLOCK() pthread_mutex_unlock(&s_lock)
+#else
+	#define DIAG_LOCK()
+	#define DIAG_UNLOCK()
+#endif
+
+static size_t s_hash(uint8_t kind, uint64_t pos, const char *text)
+{
+	size_t h = 2166136261u ^ kind;
+	h = (h ^ (size_t)pos) * 16777619u;
+	while (*text) {
+		h = (h ^ (unsigned char)*text++) * 16777619u;
+	}
+	return h;
+}
+
+/* Adds a record to the duplicate set. */
+static void s_seen_add(size_t index)
+{
+	size_t i, h;
+	h = s_hash(s_records[index].kind, s_records[index].pos, s_text.storage + s_records[index].text);
+	for (i = h & (s_seen_max - 1); s_seen[i]; i = (i + 1) & (s_seen_max - 1));
+	s_seen[i] = index + 1;
+}
+
+/* Whether the same message was already reported at the same place. */
+static bool_t s_duplicate(uint8_t kind, uint64_t pos, const char *fmt, const char *text)
+{
+	diag_record *r;
+	size_t i;
+	if (!s_seen_max) return FALSE;
+	for (i = s_hash(kind, pos, text) & (s_seen_max - 1); s_seen[i]; i = (i + 1) & (s_seen_max - 1)) {
+		r = &s_records[s_seen[i] - 1];
+		if (r->kind == kind && r->pos == pos && r->fmt == fmt && !strcmp(s_text.storage + r->text, text))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void s_record(uint8_t kind, lex_token *site, const char *fmt, va_list v)
+{
+	char buffer[1024];
+	diag_record *r;
+
+	vsnprintf(buffer, sizeof(buffer), fmt, v);
+	scount++;
+	if (s_duplicate(kind, site->pos, fmt, buffer))
+		return;
+
+	if (!s_text.storage) strbuilder_alloc(&s_text, 65536);
+	if (s_count == s_max) {
+		s_max = s_max ? s_max * 2 : 64;
+		s_records = realloc(s_records, sizeof(diag_record) * s_max);
+	}
+	r = &s_records[s_count];
+	r->kind = kind;
+	r->pos = site->pos;
+	r->fmt = fmt;
+	r->text = s_text.length;
+	strbuilder_append_string(&s_text, buffer);
+	strbuilder_append_char(&s_text, 0);
+	s_count++;
+
+	/* The set is kept at most half full. */
+	if (s_count * 2 > s_seen_max) {
+		size_t i;
+		free(s_seen);
+		s_seen_max = s_seen_max ? s_seen_max * 2 : 256;
+		s_seen = calloc(s_seen_max, sizeof(size_t));
+		for (i = 0; i < s_count; i++) {
+			s_seen_add(i);
+		}
+	} else {
+		s_seen_add(s_count - 1);
+	}
+}
 
 void dinfo(lex_token *site, const char *fmt, ...)
 {
-	size_t r, c;
 	va_list v;
 	assert(site);
-	lex_site(site, &r, &c);
+	if (s_stopped) return;
 
 	va_start(v, fmt);
-	fprintf(stderr, "(%ld, %ld)\x1B[36m info: ", r, c);
-	vfprintf(stderr, fmt, v);
+	DIAG_LOCK();
+	s_record(DIAG_INFO, site, fmt, v);
+	DIAG_UNLOCK();
 	va_end(v);
-	fprintf(stderr, "\x1B[0m\n");
 }
 
 void dwarn(lex_token *site, const char *fmt, ...)
 {
-	size_t r, c;
 	va_list v;
 	assert(site);
-	lex_site(site, &r, &c);
+	if (s_stopped) return;
 
 	va_start(v, fmt);
-	fprintf(stderr, "(%ld, %ld)\x1B[33m warn: ", r, c);
-	vfprintf(stderr, fmt, v);
+	DIAG_LOCK();
+	s_record(DIAG_WARN, site, fmt, v);
+	DIAG_UNLOCK();
 	va_end(v);
-	fprintf(stderr, "\x1B[0m\n");
 }
 
 void derror(lex_token *site, const char *fmt, ...)
 {
-	size_t r, c;
 	va_list v;
 	assert(site);
-	lex_site(site, &r, &c);
+	sclean = FALSE;
+	if (s_stopped) return;
 
 	va_start(v, fmt);
-	fprintf(stderr, "(%ld, %ld)\x1B[31m err: ", r, c);
-	vfprintf(stderr, fmt, v);
+	DIAG_LOCK();
+	s_record(DIAG_ERROR, site, fmt, v);
+	if (error_limit && ++s_errors >= error_limit) {
+		s_stopped = TRUE;
+	}
+	DIAG_UNLOCK();
 	va_end(v);
-	fprintf(stderr, "\x1B[0m\n");
-	sclean = FALSE;
+}
+
+bool_t diag_stopped(void)
+{
+	return s_stopped;
+}
+
+static int s_by_position(const void *a, const void *b)
+{
+	const diag_record *l = *(diag_record * const *)a, *r = *(diag_record * const *)b;
+	if (l->pos != r->pos) return l->pos < r->pos ? -1 : 1;
+	return l < r ? -1 : (l > r);
+}
+
+/* Appends a string to a JSON document, escaping it. */
+static void s_json_string(string_builder *out, const char *s)
+{
+	char buffer[8];
+	strbuilder_append_char(out, '"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') {
+			strbuilder_append_char(out, '\\');
+			strbuilder_append_char(out, *s);
+		} else if ((unsigned char)*s < 0x20) {
+			sprintf(buffer, "\\u%04x", (unsigned char)*s);
+			strbuilder_append_string(out, buffer);
+		} else {
+			strbuilder_append_char(out, *s);
+		}
+	}
+	strbuilder_append_char(out, '"');
+}
+
+void diag_flush(void)
+{
+	static const char *const names[] = { "info", "warn", "err" };
+	static const char *const json_names[] = { "info", "warning", "error" };
+	static const char *const colors[] = { "\x1B[36m", "\x1B[33m", "\x1B[31m" };
+	diag_record **sorted;
+	uint64_t *positions;
+	size_t *lines, *cols, i, length;
+	string_builder out;
+	char buffer[256], *text;
+
+	if (!s_count && !s_stopped) return;
+
+	/* 1. Computing the lines and columns in one pass */
+	sorted = malloc(sizeof(diag_record *) * (s_count + 1));
+	positions = malloc(sizeof(uint64_t) * (s_count + 1));
+	lines = malloc(sizeof(size_t) * (s_count + 1));
+	cols = malloc(sizeof(size_t) * (s_count + 1));
+	for (i = 0; i < s_count; i++) {
+		sorted[i] = &s_records[i];
+	}
+	qsort(sorted, s_count, sizeof(diag_record *), s_by_position);
+	for (i = 0; i < s_count; i++) {
+		positions[i] = sorted[i]->pos;
+	}
+	lex_sites(positions, s_count, lines, cols);
+	for (i = 0; i < s_count; i++) {
+		sorted[i]->line = lines[i];
+		sorted[i]->col = cols[i];
+	}
+	free(sorted);
+	free(positions);
+	free(lines);
+	free(cols);
+
+	/* 2. Formatting everything, in the order they were reported */
+	strbuilder_alloc(&out, 65536);
+	for (i = 0; i < s_count; i++) {
+		text = s_text.storage + s_records[i].text;
+		if (diag_json) {
+			strbuilder_append_string(&out, "{\"file\":");
+			if (diag_source) s_json_string(&out, diag_source);
+			else strbuilder_append_string(&out, "null");
+			sprintf(buffer, ",\"line\":%lu,\"column\":%lu,\"offset\":%lu,\"kind\":\"%s\",\"message\":",
+				(unsigned long)s_records[i].line, (unsigned long)s_records[i].col,
+				(unsigned long)s_records[i].pos, json_names[s_records[i].kind]);
+			strbuilder_append_string(&out, buffer);
+			/* The messages end with a new line, which is not part of the message. */
+			length = strlen(text);
+			if (length && text[length - 1] == '\n') text[length - 1] = 0;
+			s_json_string(&out, text);
+			strbuilder_append_string(&out, "}\n");
+		} else {
+			sprintf(buffer, "(%ld, %ld)%s %s: ", (long)s_records[i].line, (long)s_records[i].col,
+				colors[s_records[i].kind], names[s_records[i].kind]);
+			strbuilder_append_string(&out, buffer);
+			strbuilder_append_string(&out, text);
+			strbuilder_append_string(&out, "\x1B[0m\n");
+		}
+	}
+	if (s_stopped) {
+		sprintf(buffer, "stopped after %lu errors (-ferror-limit)", (unsigned long)error_limit);
+		if (diag_json) {
+			strbuilder_append_string(&out, "{\"file\":");
+			if (diag_source) s_json_string(&out, diag_source);
+			else strbuilder_append_string(&out, "null");
+			strbuilder_append_string(&out, ",\"kind\":\"note\",\"message\":");
+			s_json_string(&out, buffer);
+			strbuilder_append_string(&out, "}\n");
+		} else {
+			strbuilder_append_string(&out, "\x1B[31m");
+			strbuilder_append_string(&out, buffer);
+			strbuilder_append_string(&out, "\x1B[0m\n");
+		}
+	}
+
+	/* 3. Writing it all at once */
+	DISCARD(fwrite(out.storage, 1, out.length, DOUT));
+	fflush(DOUT);
+	strbuilder_free(&out);
+
+	s_count = 0;
+	s_text.length = 0;
+	s_stopped = FALSE;
+	s_errors = 0;
+	if (s_seen) memset(s_seen, 0, sizeof(size_t) * s_seen_max);
 }
 
 void dfatal(const char *fmt, ...)
 {
 	va_list v;
+	char buffer[4096];
+	size_t n;
+
+	/* The diagnostics that were captured must not get lost. */
+	diag_flush();
+	if (diag_target) {
+		rewind(diag_target);
+		while ((n = fread(buffer, 1, sizeof(buffer), diag_target)) != 0) {
+			DISCARD(fwrite(buffer, 1, n, stderr));
+		}
+		diag_target = NULL;
+	}
+
 	va_start(v, fmt);
 	fprintf(stderr, "(internal)\x1B[31m fatal: ");
 	vfprintf(stderr, fmt, v);
@@ -61,6 +324,11 @@ void dfatal(const char *fmt, ...)
 	abort();
 }
 
+size_t diag_count(void)
+{
+	return scount;
+}
+
 bool_t is_clean(void)
 {
 	return sclean;
@@ -68,5 +336,10 @@ bool_t is_clean(void)
 
 void reset_diags(void)
 {
-	sclean = FALSE;
+	sclean = TRUE;
+	s_count = 0;
+	s_errors = 0;
+	s_stopped = FALSE;
+	if (s_text.storage) s_text.length = 0;
+	if (s_seen) memset(s_seen, 0, sizeof(size_t) * s_seen_max);
 }
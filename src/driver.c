@@ -1,35 +1,227 @@
 #include "common/def.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
-bool_t compile_object(const char *source, const char *output)
+/* The assembly of the source being compiled, written by compile_end. */
+static emit_buffer s_assembly;
+static FILE *s_output;
+
+void compile_begin(FILE *sfile, FILE *sout)
+{
+	/* Every object starts from a clean state. */
+	reset_diags();
+	gen_reset();
+	destroy_scopes(NULL);
+
+	s_assembly.length = 0;
+	if (emit_object && !lto && !s_assembly.mc) s_assembly.mc = mc_new();
+	s_output = sout;
+	asm_target = &s_assembly;
+	lex_setup(sfile);
+}
+
+bool_t compile_end(void)
+{
+	bool_t yield;
+	if (time_enabled) {
+		time_locate();
+		time_enter(PHASE_FLUSH, 0);
+	}
+	if (cost_report) cost_print(diag_source);
+	if (stack_usage) stack_write(diag_source);
+	if (pass_report) pass_print(diag_source);
+	if (print_after) pass_flush(diag_source);
+	if (s_assembly.mc) {
+		uint8_t *code;
+		size_t length = mc_link(s_assembly.mc, &code);
+		object_write(s_output, code, length, diag_source);
+		free(code);
+		mc_delete(s_assembly.mc);
+		s_assembly.mc = NULL;
+	}
+	emit_flush(&s_assembly, s_output);
+	diag_flush();
+	yield = is_clean();
+	if (time_enabled) time_leave(PHASE_FLUSH);
+	return yield;
+}
+
+bool_t compile_stream(FILE *sfile, FILE *sout)
 {
-	size_t pos, source_length;
-	FILE *sfile, *sout;
 	lex_token token;
 	memset(&token, 0, sizeof(lex_token));
 
-	sfile = fopen(source, "r");
-	sout = fopen(output, "w");
+	if (lto) {
+		return compile_lto(sfile, sout);
+	}
+	if (codegen_threads > 1) {
+		return compile_threaded(sfile, sout);
+	}
+	/* Diagnostics are located by reading the file again, which needs a descriptor. */
+	if (pipeline && fileno(sfile) >= 0) {
+		return compile_pipelined(sfile, sout);
+	}
+	compile_begin(sfile, sout);
 
-	assert(sfile);
-	assert(sout);
+	/* Trailing spaces and comments are not statements. */
+	while (lex_peek(&token)) {
+		rreset();
+		toplevel();
+	}
+
+	return compile_end();
+}
+
+void options_signature(sha256_ctx *ctx)
+{
+	/* The diagnostics are cached too. */
+	uint64_t limit = error_limit;
+	sha256_update(ctx, &limit, sizeof(limit));
+	sha256_update(ctx, &diag_json, sizeof(diag_json));
+	sha256_update(ctx, &asm_comments, sizeof(asm_comments));
+	sha256_update(ctx, &emit_object, sizeof(emit_object));
+	sha256_update(ctx, &lto, sizeof(lto));
+	sha256_update(ctx, &profile_use, sizeof(profile_use));
+	passes_signature(ctx);
+}
+
+/* Checks whether a word appears anywhere in a buffer. */
+static bool_t s_mentions(const char *buffer, size_t length, const char *word)
+{
+	size_t i, wlen = strlen(word);
+	for (i = 0; i + wlen <= length; i++) {
+		if (buffer[i] == word[0] && !memcmp(buffer + i, word, wlen))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+	Computes the cache key of an opened source. Returns false if the
+	source cannot be cached: the output of a module depends on other
+	files, so sources that might use one are always compiled.
+*/
+static bool_t s_cache_key(const char *source, FILE *sfile, uint8_t key[32])
+{
+	static const char build[] = ECK_VERSION " " __DATE__ " " __TIME__;
+	char *contents;
+	size_t length;
+	sha256_ctx ctx;
+	bool_t yield;
 
-	pos = 0; /* should be at start of file. */
 	fseek(sfile, 0, SEEK_END);
-	source_length = ftell(sfile);
-	fseek(sfile, 0, SEEK_SET);
+	length = ftell(sfile);
+	rewind(sfile);
+	contents = malloc(length + 1);
+	length = fread(contents, 1, length, sfile);
+	rewind(sfile);
 
-	asm_target = sout;
-	lex_setup(sfile);
+	sha256_init(&ctx);
+	sha256_update(&ctx, build, sizeof(build));
+	options_signature(&ctx);
+	sha256_update(&ctx, contents, length);
+	/* The JSON diagnostics and the FILE symbol of an object name the source. */
+	if (diag_json || emit_object) sha256_update(&ctx, source, strlen(source) + 1);
+	/* The layout depends on the profile. */
+	if (profile_use) {
+		char *profile = profile_input(source);
+		size_t size;
+		void *map = map_file(profile, &size);
+		if (map) {
+			sha256_update(&ctx, map, size);
+			unmap_file(map, size);
+		}
+		free(profile);
+	}
+	sha256_final(&ctx, key);
+
+	yield = !s_mentions(contents, length, "using") && !s_mentions(contents, length, "namespace");
+	free(contents);
+	return yield;
+}
+
+static bool_t s_compile_object(const char *source, const char *output);
+
+bool_t compile_object(const char *source, const char *output)
+{
+	bool_t yield;
+	if (!time_enabled) return s_compile_object(source, output);
+	time_enter(PHASE_COMPILE, 0);
+	yield = s_compile_object(source, output);
+	time_leave(PHASE_COMPILE);
+	time_source_done(source);
+	return yield;
+}
 
-	while (pos < source_length) {
-		statement(); /* TODO: Change to declaration when functions */
-		pos = lex_pos();
+static bool_t s_compile_object(const char *source, const char *output)
+{
+	FILE *sfile, *sout, *diags = NULL, *previous = diag_target;
+	uint8_t key[32];
+	bool_t yield;
+
+	sfile = fopen(source, "r");
+	assert(sfile);
+
+	/* 1. Looking up the cache */
+	/* A cached object would not be estimated, measured nor optimized again (-fcost-report, -fstack-usage, -fpass-report). */
+	if (cache_dir && !cost_report && !stack_usage && !pass_report && !print_after && s_cache_key(source, sfile, key)) {
+		if (cache_fetch(key, output, &yield)) {
+			fclose(sfile);
+			if (!yield && lto) remove(output);
+			return yield;
+		}
+		/* The diagnostics are captured to be stored along with the object. */
+		diags = tmpfile();
+		if (diags) diag_target = diags;
 	}
 
-	if (!is_clean()) {
-		return FALSE;
+	/* 2. Compiling */
+	sout = fopen(output, "w");
+	assert(sout);
+	module_begin(source, output);
+	diag_source = source;
+	if (profile_use) profile_load(source);
+	/*
+		Units are spliced as text, which objects are not, a profile can
+		change the layout of any of them, and the units not generated
+		again would not be estimated, measured nor optimized again.
+	*/
+	if (incremental && !emit_object && !lto && !profile_use && !cost_report && !stack_usage && !pass_report && !print_after) {
+		char *manifest = malloc(strlen(output) + 5);
+		sprintf(manifest, "%s.inc", output);
+		yield = compile_incremental(sfile, sout, manifest);
+		free(manifest);
+	} else {
+		yield = compile_stream(sfile, sout);
 	}
-	return TRUE;
+	module_end(yield);
+	fclose(sout);
+	fclose(sfile);
+
+	/* 3. Storing the object in the cache */
+	if (diags) {
+		char buffer[4096];
+		size_t n;
+		diag_target = previous;
+		rewind(diags);
+		while ((n = fread(buffer, 1, sizeof(buffer), diags)) != 0) {
+			DISCARD(fwrite(buffer, 1, n, previous ? previous : stderr));
+		}
+		cache_store(key, output, diags, yield);
+		fclose(diags);
+	}
+	/* A unit that failed, empty or truncated, would only fail at link time (--lto-link). */
+	if (!yield && lto) remove(output);
+	return yield;
+}
+
+char *object_name(const char *source)
+{
+	const char *extension = lto ? "lto" : emit_object ? "o" : "s";
+	char *output;
+
+	output = malloc(strlen(source) + strlen(extension) + 2);
+	sprintf(output, "%s.%s", source, extension);
+	return output;
 }
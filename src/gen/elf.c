@@ -0,0 +1,198 @@
+/*
+	ELF64 relocatable object writer for ECK
+
+	Writes the machine code of a source as an x86-64 ELF object
+	(ET_REL) that the system linker accepts. The layout is fixed:
+	  0 null
+	  1 .text
+	  2 .data
+	  3 .rodata
+	  4 .rela.text
+	  5 .symtab
+	  6 .strtab
+	  7 .shstrtab
+	The symbol table has a file symbol and a symbol per section.
+	The generated code does not reference any symbol yet, so
+	.rela.text is empty.
+*/
+#include "../common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTION_TEXT     1
+#define SECTION_DATA     2
+#define SECTION_RODATA   3
+#define SECTION_RELA     4
+#define SECTION_SYMTAB   5
+#define SECTION_STRTAB   6
+#define SECTION_SHSTRTAB 7
+#define SECTION_COUNT    8
+
+typedef struct elf_header
+{
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint64_t entry;
+	uint64_t phoff;
+	uint64_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} elf_header;
+
+typedef struct elf_section
+{
+	uint32_t name;
+	uint32_t type;
+	uint64_t flags;
+	uint64_t addr;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t link;
+	uint32_t info;
+	uint64_t addralign;
+	uint64_t entsize;
+} elf_section;
+
+typedef struct elf_symbol
+{
+	uint32_t name;
+	uint8_t info;
+	uint8_t other;
+	uint16_t shndx;
+	uint64_t value;
+	uint64_t size;
+} elf_symbol;
+
+#define SHT_PROGBITS 1
+#define SHT_SYMTAB   2
+#define SHT_STRTAB   3
+#define SHT_RELA     4
+#define SHF_WRITE     1
+#define SHF_ALLOC     2
+#define SHF_EXECINSTR 4
+#define SHF_INFO_LINK 0x40
+#define STT_SECTION 3
+#define STT_FILE    4
+#define SHN_ABS 0xFFF1
+
+static const char s_shstrtab[] = "\0.text\0.data\0.rodata\0.rela.text\0.symtab\0.strtab\0.shstrtab";
+
+/* Offset of a name in s_shstrtab. */
+static uint32_t s_name(const char *name)
+{
+	const char *at = s_shstrtab + 1;
+	while (strcmp(at, name)) at += strlen(at) + 1;
+	return (uint32_t)(at - s_shstrtab);
+}
+
+static void s_pad(FILE *out, size_t *offset, size_t align)
+{
+	while (*offset % align) {
+		fputc(0, out);
+		(*offset)++;
+	}
+}
+
+static void s_section(elf_section *s, const char *name, uint32_t type, uint64_t flags, uint64_t align)
+{
+	memset(s, 0, sizeof(*s));
+	s->name = s_name(name);
+	s->type = type;
+	s->flags = flags;
+	s->addralign = align;
+}
+
+void object_write(FILE *out, const uint8_t *text, size_t length, const char *source)
+{
+	elf_header header;
+	elf_section sections[SECTION_COUNT];
+	elf_symbol symbols[5];
+	const char *base;
+	char *strtab;
+	size_t offset, strtab_size, i;
+
+	/* 1. Symbols: the file, then the sections */
+	base = source ? strrchr(source, '/') : NULL;
+	base = base ? base + 1 : source ? source : "";
+	strtab_size = strlen(base) + 2;
+	strtab = calloc(1, strtab_size);
+	strcpy(strtab + 1, base);
+	memset(symbols, 0, sizeof(symbols));
+	symbols[1].name = 1;
+	symbols[1].info = STT_FILE;
+	symbols[1].shndx = SHN_ABS;
+	for (i = 0; i < 3; i++) {
+		symbols[2 + i].info = STT_SECTION;
+		symbols[2 + i].shndx = (uint16_t)(SECTION_TEXT + i);
+	}
+
+	/* 2. Sections, laid out after the header */
+	memset(sections, 0, sizeof(sections));
+	s_section(&sections[SECTION_TEXT], ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 1);
+	s_section(&sections[SECTION_DATA], ".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 1);
+	s_section(&sections[SECTION_RODATA], ".rodata", SHT_PROGBITS, SHF_ALLOC, 1);
+	s_section(&sections[SECTION_RELA], ".rela.text", SHT_RELA, SHF_INFO_LINK, 8);
+	sections[SECTION_RELA].entsize = 24;
+	sections[SECTION_RELA].link = SECTION_SYMTAB;
+	sections[SECTION_RELA].info = SECTION_TEXT;
+	s_section(&sections[SECTION_SYMTAB], ".symtab", SHT_SYMTAB, 0, 8);
+	sections[SECTION_SYMTAB].entsize = sizeof(elf_symbol);
+	sections[SECTION_SYMTAB].link = SECTION_STRTAB;
+	sections[SECTION_SYMTAB].info = 5; /* All of the symbols are local. */
+	s_section(&sections[SECTION_STRTAB], ".strtab", SHT_STRTAB, 0, 1);
+	s_section(&sections[SECTION_SHSTRTAB], ".shstrtab", SHT_STRTAB, 0, 1);
+
+	offset = sizeof(elf_header);
+	sections[SECTION_TEXT].offset = offset;
+	sections[SECTION_TEXT].size = length;
+	offset += length;
+	sections[SECTION_DATA].offset = offset;
+	sections[SECTION_RODATA].offset = offset;
+	offset = (offset + 7) & ~(size_t)7;
+	sections[SECTION_RELA].offset = offset;
+	sections[SECTION_SYMTAB].offset = offset;
+	sections[SECTION_SYMTAB].size = sizeof(symbols);
+	offset += sizeof(symbols);
+	sections[SECTION_STRTAB].offset = offset;
+	sections[SECTION_STRTAB].size = strtab_size;
+	offset += strtab_size;
+	sections[SECTION_SHSTRTAB].offset = offset;
+	sections[SECTION_SHSTRTAB].size = sizeof(s_shstrtab);
+	offset += sizeof(s_shstrtab);
+
+	/* 3. The header */
+	memset(&header, 0, sizeof(header));
+	memcpy(header.ident, "\x7F" "ELF", 4);
+	header.ident[4] = 2; /* 64 bits */
+	header.ident[5] = 1; /* little endian */
+	header.ident[6] = 1; /* version */
+	header.type = 1;     /* ET_REL */
+	header.machine = 62; /* EM_X86_64 */
+	header.version = 1;
+	header.shoff = (offset + 7) & ~(size_t)7;
+	header.ehsize = sizeof(elf_header);
+	header.shentsize = sizeof(elf_section);
+	header.shnum = SECTION_COUNT;
+	header.shstrndx = SECTION_SHSTRTAB;
+
+	/* 4. Writing it all, in the order of the offsets */
+	fwrite(&header, sizeof(header), 1, out);
+	fwrite(text, 1, length, out);
+	offset = sizeof(elf_header) + length;
+	s_pad(out, &offset, 8);
+	fwrite(symbols, sizeof(symbols), 1, out);
+	fwrite(strtab, 1, strtab_size, out);
+	fwrite(s_shstrtab, 1, sizeof(s_shstrtab), out);
+	offset = sections[SECTION_SHSTRTAB].offset + sizeof(s_shstrtab);
+	s_pad(out, &offset, 8);
+	fwrite(sections, sizeof(sections), 1, out);
+	free(strtab);
+}
@@ -0,0 +1,266 @@
+/*
+	Assembly emission for ECK
+
+	The code generator describes instructions with a mnemonic and
+	structured operands, which are formatted by hand into a growable
+	buffer. The buffer of a source is written with a single fwrite
+	once the source is done, so stdio is out of the way while the
+	code is generated.
+
+	With -c, the instructions are encoded (encode.c) instead of
+	being formatted.
+
+	Registers are identified by their hardware number (rax = 0,
+	rcx = 1, ..., r15 = 15) and a size in bytes. Memory operands are
+	a base register plus a displacement, written as
+	"qword ptr [rdi + 8]".
+*/
+#include "../common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+ECK_TLS emit_buffer *asm_target;
+bool_t asm_comments = TRUE;
+bool_t emit_object = FALSE;
+
+static const char *const s_mnemonics[INSN_COUNT] =
+{
+	"mov", "xor", "add", "sub", "imul", "idiv", "cqo", "cdq", "cwd",
+	"push", "pop", "and", "or", "test", "cmp",
+	"sete", "setne", "setl", "setle", "setg", "setge",
+	"sal", "shr", "sar", "neg", "not", "jmp", "je", "jne",
+	"movsx", "movzx", "ret", "call", "rdtsc"
+};
+
+static const char *const s_r64[16] = { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15" };
+static const char *const s_r32[16] = { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d" };
+static const char *const s_r16[16] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
+static const char *const s_r8[16]  = { "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
+static const char *const s_ptr[9] = { NULL, "byte ptr [", "word ptr [", NULL, "dword ptr [", NULL, NULL, NULL, "qword ptr [" };
+
+const char *insn_name(insn op)
+{
+	return s_mnemonics[op];
+}
+
+const char *register_name(int reg, size_t size)
+{
+	const char *const *names = (size == 8) ? s_r64 : (size == 4) ? s_r32 : (size == 2) ? s_r16 : s_r8;
+	return names[reg];
+}
+
+operand oreg(int reg, size_t size)
+{
+	operand yield;
+	yield.kind = OPERAND_REGISTER;
+	yield.size = (uint8_t)size;
+	yield.reg = (uint8_t)reg;
+	yield.value = 0;
+	return yield;
+}
+
+operand oimm(uint64_t value)
+{
+	operand yield;
+	yield.kind = OPERAND_IMMEDIATE;
+	yield.size = 0;
+	yield.reg = 0;
+	yield.value = value;
+	return yield;
+}
+
+operand olabel(size_t l)
+{
+	operand yield = oimm(l);
+	yield.kind = OPERAND_LABEL;
+	return yield;
+}
+
+operand omem(int reg, uint64_t displacement, size_t size)
+{
+	operand yield = oreg(reg, size);
+	yield.kind = OPERAND_MEMORY;
+	yield.value = displacement;
+	return yield;
+}
+
+operand onone(void)
+{
+	operand yield = oimm(0);
+	yield.kind = OPERAND_NONE;
+	return yield;
+}
+
+/* Makes room for at least n more bytes. */
+static char *s_reserve(emit_buffer *b, size_t n)
+{
+	if (b->length + n > b->max) {
+		b->max = b->max ? b->max * 2 : 65536;
+		while (b->length + n > b->max) b->max *= 2;
+		b->data = realloc(b->data, b->max);
+	}
+	return b->data + b->length;
+}
+
+static void s_string(emit_buffer *b, const char *s)
+{
+	size_t n = strlen(s);
+	memcpy(s_reserve(b, n), s, n);
+	b->length += n;
+}
+
+static void s_decimal(emit_buffer *b, uint64_t value)
+{
+	char digits[20];
+	char *at;
+	size_t n = 0;
+	do {
+		digits[n++] = '0' + (char)(value % 10);
+		value /= 10;
+	} while (value);
+	at = s_reserve(b, n);
+	b->length += n;
+	while (n) *at++ = digits[--n];
+}
+
+/* Labels have at least four uppercase hexadecimal digits, as .L%04X. */
+static void s_label(emit_buffer *b, uint64_t l)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char digits[16];
+	char *at;
+	size_t n = 0;
+	do {
+		digits[n++] = hex[l & 15];
+		l >>= 4;
+	} while (l || n < 4);
+	at = s_reserve(b, n + 2);
+	*at++ = '.';
+	*at++ = 'L';
+	b->length += n + 2;
+	while (n) *at++ = digits[--n];
+}
+
+static void s_operand(emit_buffer *b, operand *o)
+{
+	switch (o->kind) {
+		case OPERAND_REGISTER:
+			s_string(b, register_name(o->reg, o->size));
+			break;
+		case OPERAND_IMMEDIATE:
+			s_decimal(b, o->value);
+			break;
+		case OPERAND_LABEL:
+			s_label(b, o->value);
+			break;
+		case OPERAND_MEMORY:
+			s_string(b, s_ptr[o->size]);
+			s_string(b, register_name(o->reg, 8));
+			if (o->value) {
+				s_string(b, " + ");
+				s_decimal(b, o->value);
+			}
+			*s_reserve(b, 1) = ']';
+			b->length++;
+			break;
+	}
+}
+
+void emit(insn op, operand a, operand b, const char *comment)
+{
+	emit_buffer *out = asm_target;
+	if (cost_report) cost_insn(op, &a, &b);
+	if (stack_usage) stack_track(op, &a, &b);
+	if (out->mc) {
+		mc_emit(out->mc, op, &a, &b);
+		return;
+	}
+	*s_reserve(out, 1) = '\t';
+	out->length++;
+	s_string(out, s_mnemonics[op]);
+	if (a.kind != OPERAND_NONE) {
+		*s_reserve(out, 1) = ' ';
+		out->length++;
+		s_operand(out, &a);
+	}
+	if (b.kind != OPERAND_NONE) {
+		memcpy(s_reserve(out, 2), ", ", 2);
+		out->length += 2;
+		s_operand(out, &b);
+	}
+	if (comment && asm_comments) {
+		s_string(out, " ; ");
+		s_string(out, comment);
+	}
+	*s_reserve(out, 1) = '\n';
+	out->length++;
+}
+
+void emit_label(size_t l)
+{
+	emit_buffer *out = asm_target;
+	if (cost_report) cost_label(l);
+	if (out->mc) {
+		mc_label(out->mc, l);
+		return;
+	}
+	memcpy(s_reserve(out, 2), "\t\r", 2);
+	out->length += 2;
+	s_label(out, l);
+	memcpy(s_reserve(out, 2), ":\n", 2);
+	out->length += 2;
+}
+
+void emit_mark(uint64_t pos)
+{
+	if (asm_target->mc) mc_mark(asm_target->mc, pos);
+}
+
+void emit_comment(const char *comment)
+{
+	if (!asm_comments || asm_target->mc) return;
+	s_string(asm_target, "\t; ");
+	s_string(asm_target, comment);
+	*s_reserve(asm_target, 1) = '\n';
+	asm_target->length++;
+}
+
+void emit_text(emit_buffer *b, const char *text, size_t length)
+{
+	memcpy(s_reserve(b, length), text, length);
+	b->length += length;
+}
+
+void code(const char *fmt, ...)
+{
+	char buffer[1024];
+	va_list v;
+	if (asm_target->mc) {
+		dfatal("cannot encode '%s'", fmt);
+	}
+	va_start(v, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, v);
+	va_end(v);
+	*s_reserve(asm_target, 1) = '\t';
+	asm_target->length++;
+	s_string(asm_target, buffer);
+	*s_reserve(asm_target, 1) = '\n';
+	asm_target->length++;
+}
+
+void emit_flush(emit_buffer *b, FILE *out)
+{
+	if (b->length) {
+		DISCARD(fwrite(b->data, 1, b->length, out));
+	}
+	b->length = 0;
+}
+
+void emit_free(emit_buffer *b)
+{
+	free(b->data);
+	mc_delete(b->mc);
+	memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,519 @@
+/*
+	x86-64 encoder for ECK
+
+	Encodes the instructions of the code generator into machine
+	code, the way GNU as encodes the same assembly:
+	  - register to register operations use the "r/m, reg" form
+	  - mov of an immediate uses B8+r (C7 /0 or B8+r io for 64 bits)
+	  - sub rsp, imm uses 83 /5 ib when the immediate fits in a byte
+	  - memory operands use the shortest displacement (none, 8 or 32 bits)
+
+	The code is kept as a list of items: bytes, labels and jumps.
+	Jumps are encoded once every label is known, starting short
+	(rel8) and growing to near (rel32) until every displacement
+	fits, as growing a jump can only push other labels further.
+*/
+#include "../common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ITEM_BYTES 0
+#define ITEM_LABEL 1
+#define ITEM_JUMP  2
+#define ITEM_MARK  3
+
+/* A piece of machine code. */
+typedef struct mc_item
+{
+	uint8_t kind;   /* ITEM_* */
+	uint8_t op;     /* The jump instruction. */
+	bool_t near;    /* Whether the jump needs a 32 bits displacement. */
+	size_t value;   /* The offset of the bytes in the pool, the label, or the position of a mark. */
+	size_t length;  /* The number of bytes. */
+	size_t address; /* The address of the item in the section. */
+} mc_item;
+
+struct machine_code
+{
+	uint8_t *pool;   /* The bytes of the ITEM_BYTES items. */
+	size_t length;
+	size_t max;
+	mc_item *items;
+	size_t count;
+	size_t items_max;
+};
+
+machine_code *mc_new(void)
+{
+	return calloc(1, sizeof(machine_code));
+}
+
+void mc_delete(machine_code *mc)
+{
+	if (!mc) return;
+	free(mc->pool);
+	free(mc->items);
+	free(mc);
+}
+
+static mc_item *s_item(machine_code *mc, uint8_t kind)
+{
+	mc_item *yield;
+	if (mc->count == mc->items_max) {
+		mc->items_max = mc->items_max ? mc->items_max * 2 : 256;
+		mc->items = realloc(mc->items, sizeof(mc_item) * mc->items_max);
+	}
+	yield = &mc->items[mc->count++];
+	memset(yield, 0, sizeof(*yield));
+	yield->kind = kind;
+	return yield;
+}
+
+static void s_bytes(machine_code *mc, const uint8_t *bytes, size_t n)
+{
+	mc_item *last = mc->count ? &mc->items[mc->count - 1] : NULL;
+	if (mc->length + n > mc->max) {
+		mc->max = mc->max ? mc->max * 2 : 4096;
+		while (mc->length + n > mc->max) mc->max *= 2;
+		mc->pool = realloc(mc->pool, mc->max);
+	}
+	memcpy(mc->pool + mc->length, bytes, n);
+
+	/* Consecutive bytes are merged into one item. */
+	if (last && last->kind == ITEM_BYTES && last->value + last->length == mc->length) {
+		last->length += n;
+	} else {
+		last = s_item(mc, ITEM_BYTES);
+		last->value = mc->length;
+		last->length = n;
+	}
+	mc->length += n;
+}
+
+void mc_append(machine_code *to, machine_code *from)
+{
+	size_t i;
+	mc_item *item;
+	for (i = 0; i < from->count; i++) {
+		if (from->items[i].kind == ITEM_BYTES) {
+			s_bytes(to, from->pool + from->items[i].value, from->items[i].length);
+		} else {
+			item = s_item(to, from->items[i].kind);
+			*item = from->items[i];
+		}
+	}
+}
+
+void mc_label(machine_code *mc, size_t l)
+{
+	s_item(mc, ITEM_LABEL)->value = l;
+}
+
+void mc_mark(machine_code *mc, uint64_t pos)
+{
+	s_item(mc, ITEM_MARK)->value = (size_t)pos;
+}
+
+size_t mc_lines(machine_code *mc, mc_line **lines)
+{
+	size_t count = 0, i;
+	*lines = malloc(sizeof(mc_line) * (mc->count + 1));
+	for (i = 0; i < mc->count; i++) {
+		if (mc->items[i].kind != ITEM_MARK) continue;
+		/* Only the last of the marks at the same address has code. */
+		if (count && (*lines)[count - 1].address == mc->items[i].address) count--;
+		(*lines)[count].address = mc->items[i].address;
+		(*lines)[count++].pos = mc->items[i].value;
+	}
+	return count;
+}
+
+/* An instruction being encoded. */
+typedef struct mc_encoding
+{
+	uint8_t bytes[16];
+	size_t length;
+} mc_encoding;
+
+static void s_byte(mc_encoding *e, uint8_t b)
+{
+	e->bytes[e->length++] = b;
+}
+
+static void s_imm(mc_encoding *e, uint64_t value, size_t size)
+{
+	size_t i;
+	for (i = 0; i < size; i++) {
+		s_byte(e, (uint8_t)(value >> (i * 8)));
+	}
+}
+
+/* The operand size of a register, in bytes. Unknown sizes are bytes, like the register names. */
+static size_t s_size(operand *o)
+{
+	return (o->size == 8 || o->size == 4 || o->size == 2) ? o->size : 1;
+}
+
+/*
+	Writes the prefixes of an instruction: the operand size, then REX.
+	reg goes in ModRM.reg, rm in ModRM.rm (or the opcode).
+*/
+static void s_prefixes(mc_encoding *e, size_t size, int reg, int rm)
+{
+	uint8_t rex = 0;
+	if (size == 2) s_byte(e, 0x66);
+	if (size == 8) rex |= 0x48;
+	if (reg >= 8) rex |= 0x44;
+	if (rm >= 8) rex |= 0x41;
+	/* spl, bpl, sil and dil only exist with a REX prefix */
+	if (size == 1 && ((reg >= 4 && reg < 8) || (rm >= 4 && rm < 8))) rex |= 0x40;
+	if (rex) s_byte(e, rex);
+}
+
+static uint8_t s_modrm(int reg, int rm)
+{
+	return (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* Writes the ModRM byte of a register or memory operand, with its SIB byte and its displacement. */
+static void s_modrm_operand(mc_encoding *e, int reg, operand *rm)
+{
+	int64_t displacement = (int64_t)rm->value;
+	uint8_t mod;
+	if (rm->kind != OPERAND_MEMORY) {
+		s_byte(e, s_modrm(reg, rm->reg));
+		return;
+	}
+	/* rbp and r13 have no form without a displacement. */
+	if (displacement == 0 && (rm->reg & 7) != 5) mod = 0x00;
+	else if (displacement >= -128 && displacement <= 127) mod = 0x40;
+	else mod = 0x80;
+	s_byte(e, (uint8_t)(mod | ((reg & 7) << 3) | (rm->reg & 7)));
+	/* rsp and r12 need a SIB byte. */
+	if ((rm->reg & 7) == 4) s_byte(e, 0x24);
+	if (mod == 0x40) s_imm(e, (uint64_t)displacement, 1);
+	if (mod == 0x80) s_imm(e, (uint64_t)displacement, 4);
+}
+
+/* op r/m, reg with the opcode of the 8 bits form, the others being opcode + 1. */
+static void s_rm_reg(mc_encoding *e, uint8_t opcode, operand *rm, operand *reg)
+{
+	size_t size = s_size(rm);
+	s_prefixes(e, size, reg->reg, rm->reg);
+	s_byte(e, size == 1 ? opcode : opcode + 1);
+	s_byte(e, s_modrm(reg->reg, rm->reg));
+}
+
+/* Group instructions (F6/F7, D2/D3...) with an extension in ModRM.reg. */
+static void s_group(mc_encoding *e, uint8_t opcode, int extension, operand *rm)
+{
+	size_t size = s_size(rm);
+	s_prefixes(e, size, 0, rm->reg);
+	s_byte(e, size == 1 ? opcode : opcode + 1);
+	s_byte(e, s_modrm(extension, rm->reg));
+}
+
+static bool_t s_is_register(operand *o)
+{
+	return o->kind == OPERAND_REGISTER;
+}
+
+static void s_mov_imm(mc_encoding *e, operand *to, uint64_t value)
+{
+	size_t size = s_size(to);
+	if (size == 8 && (int64_t)value == (int64_t)(int32_t)(uint32_t)value) {
+		s_prefixes(e, 8, 0, to->reg);
+		s_byte(e, 0xC7);
+		s_byte(e, s_modrm(0, to->reg));
+		s_imm(e, value, 4);
+		return;
+	}
+	s_prefixes(e, size, 0, to->reg);
+	s_byte(e, (uint8_t)((size == 1 ? 0xB0 : 0xB8) + (to->reg & 7)));
+	s_imm(e, value, size);
+}
+
+/* The opcodes of the arithmetic instructions, in their r/m, reg form (8 bits). */
+static int s_arithmetic(insn op)
+{
+	switch (op) {
+		case INSN_ADD: return 0x00;
+		case INSN_OR:  return 0x08;
+		case INSN_AND: return 0x20;
+		case INSN_SUB: return 0x28;
+		case INSN_XOR: return 0x30;
+		case INSN_CMP: return 0x38;
+		case INSN_TEST: return 0x84;
+		case INSN_MOV: return 0x88;
+		default: return -1;
+	}
+}
+
+/* The ModRM.reg extension of the arithmetic instructions with an immediate (80/81/83). */
+static int s_extension(insn op)
+{
+	switch (op) {
+		case INSN_ADD: return 0;
+		case INSN_OR:  return 1;
+		case INSN_AND: return 4;
+		case INSN_SUB: return 5;
+		case INSN_XOR: return 6;
+		case INSN_CMP: return 7;
+		default: return -1;
+	}
+}
+
+static uint8_t s_condition(insn op)
+{
+	switch (op) {
+		case INSN_SETE:  case INSN_JE: return 0x4;
+		case INSN_SETNE: case INSN_JNE: return 0x5;
+		case INSN_SETL:  return 0xC;
+		case INSN_SETGE: return 0xD;
+		case INSN_SETLE: return 0xE;
+		case INSN_SETG:  return 0xF;
+		default: return 0;
+	}
+}
+
+static void s_cannot(insn op)
+{
+	dfatal("cannot encode '%s' with these operands", insn_name(op));
+}
+
+void mc_emit(machine_code *mc, insn op, operand *a, operand *b)
+{
+	mc_encoding e;
+	int opcode;
+	e.length = 0;
+
+	switch (op) {
+		case INSN_JMP:
+		case INSN_JE:
+		case INSN_JNE: {
+			mc_item *item;
+			if (a->kind != OPERAND_LABEL) s_cannot(op);
+			item = s_item(mc, ITEM_JUMP);
+			item->op = (uint8_t)op;
+			item->value = a->value;
+			return;
+		}
+
+		case INSN_CQO: s_byte(&e, 0x48); s_byte(&e, 0x99); break;
+		case INSN_CDQ: s_byte(&e, 0x99); break;
+		case INSN_CWD: s_byte(&e, 0x66); s_byte(&e, 0x99); break;
+		case INSN_RET: s_byte(&e, 0xC3); break;
+		case INSN_RDTSC: s_byte(&e, 0x0F); s_byte(&e, 0x31); break;
+
+		case INSN_CALL:
+			/* call r/m64 needs no REX.W. */
+			if (!s_is_register(a)) s_cannot(op);
+			s_prefixes(&e, 4, 0, a->reg);
+			s_byte(&e, 0xFF);
+			s_byte(&e, s_modrm(2, a->reg));
+			break;
+
+		case INSN_MOVSX:
+		case INSN_MOVZX: {
+			/* The source has its own size, so the prefixes are not the ones of s_prefixes. */
+			uint8_t rex = 0;
+			if (!s_is_register(a) || !s_is_register(b) || s_size(a) <= s_size(b)) s_cannot(op);
+			if (s_size(b) == 4 && op == INSN_MOVZX) s_cannot(op);
+			if (s_size(a) == 2) s_byte(&e, 0x66);
+			if (s_size(a) == 8) rex |= 0x48;
+			if (a->reg >= 8) rex |= 0x44;
+			if (b->reg >= 8) rex |= 0x41;
+			if (s_size(b) == 1 && b->reg >= 4) rex |= 0x40;
+			if (rex) s_byte(&e, rex);
+			if (s_size(b) == 4) {
+				s_byte(&e, 0x63); /* movsxd */
+			} else {
+				s_byte(&e, 0x0F);
+				s_byte(&e, (uint8_t)((op == INSN_MOVZX ? 0xB6 : 0xBE) + (s_size(b) == 2)));
+			}
+			s_byte(&e, s_modrm(a->reg, b->reg));
+			break;
+		}
+
+		case INSN_PUSH:
+		case INSN_POP:
+			if (!s_is_register(a)) s_cannot(op);
+			if (a->reg >= 8) s_byte(&e, 0x41);
+			s_byte(&e, (uint8_t)((op == INSN_PUSH ? 0x50 : 0x58) + (a->reg & 7)));
+			break;
+
+		case INSN_IDIV:
+			if (!s_is_register(a)) s_cannot(op);
+			s_group(&e, 0xF6, 7, a);
+			break;
+
+		case INSN_NEG:
+		case INSN_NOT:
+			if (!s_is_register(a)) s_cannot(op);
+			s_group(&e, 0xF6, op == INSN_NEG ? 3 : 2, a);
+			break;
+
+		case INSN_IMUL:
+			if (!s_is_register(a) || !s_is_register(b) || s_size(a) == 1) s_cannot(op);
+			s_prefixes(&e, s_size(a), a->reg, b->reg);
+			s_byte(&e, 0x0F);
+			s_byte(&e, 0xAF);
+			s_byte(&e, s_modrm(a->reg, b->reg));
+			break;
+
+		case INSN_SAL:
+		case INSN_SHR:
+		case INSN_SAR: {
+			int extension = op == INSN_SAL ? 4 : op == INSN_SHR ? 5 : 7;
+			if (!s_is_register(a)) s_cannot(op);
+			if (b->kind == OPERAND_IMMEDIATE) {
+				/* Shifting by one has its own opcode. */
+				s_group(&e, b->value == 1 ? 0xD0 : 0xC0, extension, a);
+				if (b->value != 1) s_imm(&e, b->value, 1);
+				break;
+			}
+			/* Shifting by a register is only possible by cl. */
+			if (!s_is_register(b) || b->reg != 1) s_cannot(op);
+			s_group(&e, 0xD2, extension, a);
+			break;
+		}
+
+		case INSN_SETE:
+		case INSN_SETNE:
+		case INSN_SETL:
+		case INSN_SETLE:
+		case INSN_SETG:
+		case INSN_SETGE:
+			if (!s_is_register(a)) s_cannot(op);
+			s_prefixes(&e, 1, 0, a->reg);
+			s_byte(&e, 0x0F);
+			s_byte(&e, (uint8_t)(0x90 | s_condition(op)));
+			s_byte(&e, s_modrm(0, a->reg));
+			break;
+
+		default:
+			/* The first operand is a register or memory, never both operands are memory. */
+			if (!s_is_register(a) && a->kind != OPERAND_MEMORY) s_cannot(op);
+			if (s_is_register(a) && s_is_register(b)) {
+				opcode = s_arithmetic(op);
+				if (opcode < 0) s_cannot(op);
+				s_rm_reg(&e, (uint8_t)opcode, a, b);
+			} else if (s_is_register(b) || b->kind == OPERAND_MEMORY) {
+				/* Memory and a register: "r/m, reg" when writing to memory, "reg, r/m" (+ 2) when reading it. */
+				operand *rm = s_is_register(b) ? a : b, *reg = s_is_register(b) ? b : a;
+				size_t size = s_size(reg);
+				opcode = s_arithmetic(op);
+				if (opcode < 0 || !s_is_register(reg) || (rm == b && op == INSN_TEST)) s_cannot(op);
+				if (rm == b) opcode += 2;
+				s_prefixes(&e, size, reg->reg, rm->reg);
+				s_byte(&e, (uint8_t)(size == 1 ? opcode : opcode + 1));
+				s_modrm_operand(&e, reg->reg, rm);
+			} else if (s_is_register(a) && b->kind == OPERAND_IMMEDIATE && op == INSN_MOV) {
+				s_mov_imm(&e, a, b->value);
+			} else if (b->kind == OPERAND_IMMEDIATE && op == INSN_MOV) {
+				/* A memory operand is only written with a sign-extended 32 bits immediate. */
+				size_t size = s_size(a);
+				s_prefixes(&e, size, 0, a->reg);
+				s_byte(&e, size == 1 ? 0xC6 : 0xC7);
+				s_modrm_operand(&e, 0, a);
+				s_imm(&e, b->value, size == 8 ? 4 : size);
+			} else if (b->kind == OPERAND_IMMEDIATE && s_extension(op) >= 0 && s_size(a) != 1) {
+				size_t size = s_size(a);
+				s_prefixes(&e, size, 0, a->reg);
+				if ((int64_t)b->value >= -128 && (int64_t)b->value <= 127) {
+					s_byte(&e, 0x83);
+					s_modrm_operand(&e, s_extension(op), a);
+					s_imm(&e, b->value, 1);
+				} else {
+					s_byte(&e, 0x81);
+					s_modrm_operand(&e, s_extension(op), a);
+					s_imm(&e, b->value, size == 2 ? 2 : 4);
+				}
+			} else {
+				s_cannot(op);
+			}
+			break;
+	}
+	s_bytes(mc, e.bytes, e.length);
+}
+
+/* The size of a jump. */
+static size_t s_jump_size(mc_item *item)
+{
+	if (!item->near) return 2;
+	return item->op == INSN_JMP ? 5 : 6;
+}
+
+size_t mc_link(machine_code *mc, uint8_t **code)
+{
+	size_t *labels = NULL, label_max = 0, address = 0, i, n;
+	int64_t displacement;
+	bool_t changed = TRUE;
+	uint8_t *at;
+	mc_item *item;
+
+	/* 1. Finding the size of every jump */
+	while (changed) {
+		changed = FALSE;
+		address = 0;
+		for (i = 0; i < mc->count; i++) {
+			item = &mc->items[i];
+			item->address = address;
+			if (item->kind == ITEM_BYTES) {
+				address += item->length;
+			} else if (item->kind == ITEM_JUMP) {
+				address += s_jump_size(item);
+			} else if (item->kind == ITEM_LABEL) {
+				if (item->value >= label_max) {
+					n = label_max;
+					label_max = (item->value + 1) * 2;
+					labels = realloc(labels, sizeof(size_t) * label_max);
+					while (n < label_max) labels[n++] = (size_t)-1;
+				}
+				labels[item->value] = address;
+			}
+		}
+		for (i = 0; i < mc->count; i++) {
+			item = &mc->items[i];
+			if (item->kind != ITEM_JUMP || item->near) continue;
+			if (item->value >= label_max || labels[item->value] == (size_t)-1) {
+				dfatal("jump to the undefined label .L%04lX", (unsigned long)item->value);
+			}
+			displacement = (int64_t)labels[item->value] - (int64_t)(item->address + 2);
+			if (displacement < -128 || displacement > 127) {
+				item->near = TRUE;
+				changed = TRUE;
+			}
+		}
+	}
+
+	/* 2. Writing the code */
+	*code = malloc(address + 1);
+	at = *code;
+	for (i = 0; i < mc->count; i++) {
+		item = &mc->items[i];
+		if (item->kind == ITEM_BYTES) {
+			memcpy(at, mc->pool + item->value, item->length);
+			at += item->length;
+		} else if (item->kind == ITEM_JUMP) {
+			displacement = (int64_t)labels[item->value] - (int64_t)(item->address + s_jump_size(item));
+			if (!item->near) {
+				*at++ = item->op == INSN_JMP ? 0xEB : (uint8_t)(0x70 | s_condition((insn)item->op));
+				*at++ = (uint8_t)(int8_t)displacement;
+			} else {
+				if (item->op == INSN_JMP) {
+					*at++ = 0xE9;
+				} else {
+					*at++ = 0x0F;
+					*at++ = (uint8_t)(0x80 | s_condition((insn)item->op));
+				}
+				for (n = 0; n < 4; n++) {
+					*at++ = (uint8_t)((uint64_t)displacement >> (n * 8));
+				}
+			}
+		}
+	}
+	free(labels);
+	return address;
+}
@@ -1,30 +1,58 @@
 #include "../common/def.h"
 
 #include <assert.h>
-#include <stdarg.h>
 
 #define REG_COUNT 11
 
-static regname r64[REG_COUNT] = { "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", };
-static regname r32[REG_COUNT] = { "ebx", "ecx", "edx", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d", };
-static regname r16[REG_COUNT] = { "bx", "cx", "dx", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w" };
-static regname r8[REG_COUNT]  = { "bl", "cl", "dl", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b" };
-static bool_t rmsk[REG_COUNT] = { 0,    0,    0,    0,     0,     0,      0,      0,      0,      0,      0      };
-static size_t label_count = 0;
+/* The hardware numbers of the registers that can be allocated. */
+static const int s_hw[REG_COUNT] = { 3, 1, 2, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+#define R(reg, size) oreg(s_hw[reg], size)
+#define ACC(size) oreg(REG_RAX, size)
+#define NONE onone()
+/* Each code generation thread has its own registers and labels. */
+static ECK_TLS bool_t rmsk[REG_COUNT] = { 0,    0,    0,    0,     0,     0,      0,      0,      0,      0,      0      };
+static ECK_TLS size_t label_count = 0;
+bool_t gen_result = FALSE;
+bool_t gen_line_table = FALSE;
 
 size_t label(void)
 {
 	return label_count++;
 }
 
-void goto_label(const char *jmp, size_t l)
+size_t label_mark(void)
+{
+	return label_count;
+}
+
+void label_restart(size_t next)
+{
+	label_count = next;
+}
+
+void rreset(void)
+{
+	int i;
+	for (i = 0; i < REG_COUNT; i++) {
+		rmsk[i] = 0;
+	}
+}
+
+void gen_reset(void)
+{
+	rreset();
+	label_count = 0;
+}
+
+void goto_label(insn jmp, size_t l)
 {
-	code("%s .L%04X", jmp, l);
+	emit(jmp, olabel(l), NONE, NULL);
 }
 
 void here_label(size_t l)
 {
-	code("\r.L%04X:", l);
+	emit_label(l);
 }
 
 static int ralloc(void)
@@ -42,15 +70,13 @@ static int ralloc(void)
 
 regname rget(int reg, size_t size)
 {
-	regname *getter;
 	assert(reg < REG_COUNT);
-	getter = (size == 8) ? r64 : (size == 4) ? r32 : (size == 2) ? r16 : r8;
-	return getter[reg];
+	return register_name(s_hw[reg], size);
 }
 
 regname racc(size_t size)
 {
-	return (size == 8) ? "rax" : (size == 4) ? "eax" : (size == 2) ? "ax" : "al";
+	return register_name(REG_RAX, size);
 }
 
 void rfree(int reg)
@@ -59,18 +85,6 @@ void rfree(int reg)
 	rmsk[reg] = 0;
 }
 
-FILE *asm_target;
-
-void code(const char *fmt, ...)
-{
-	va_list v;
-	va_start(v, fmt);
-	fprintf(asm_target, "\t");
-	vfprintf(asm_target, fmt, v);
-	fprintf(asm_target, "\n");
-	va_end(v);
-}
-
 size_t rsizeof(foodtype *t)
 {
 	switch (t->kind)
@@ -103,131 +117,201 @@ size_t rsizeof(foodtype *t)
 	}
 }
 
+static const char *const s_primary_comments[9] = {
+	"primary(size = 0)", "primary(size = 1)", "primary(size = 2)", NULL, "primary(size = 4)",
+	NULL, NULL, NULL, "primary(size = 8)"
+};
+static const char *const s_zero_comments[9] = {
+	"zero(size = 0)", "zero(size = 1)", "zero(size = 2)", NULL, "zero(size = 4)",
+	NULL, NULL, NULL, "zero(size = 8)"
+};
+
 static int g_primary(expression *tree)
 {
 	size_t size;
+	uint64_t value;
 	int reg;
 	size = rsizeof(&tree->type);
 	reg = ralloc();
-	if (tree->token.value.u64) {
-		code("mov %s, %lu ; primary(size = %d)", rget(reg, size), tree->token.value.u64, size);
+	value = tree->kind == EXPRESSION_BOOLEAN_LITERAL ? tree->token.kind == KEYWORD_TRUE : tree->token.value.u64;
+	if (value) {
+		emit(INSN_MOV, R(reg, size), oimm(value), s_primary_comments[size]);
 	} else {
-		code("xor %s, %s ; zero(size = %d)", rget(reg, size), rget(reg, size), size);
+		emit(INSN_XOR, R(reg, size), R(reg, size), s_zero_comments[size]);
 	}
 	return reg;
 }
 
+/* Shifts l by r. The count of a shift has to be in cl. */
+static void g_shift(insn op, int l, int r, int size, const char *comment)
+{
+	bool_t saved;
+	if (s_hw[r] == REG_RCX) {
+		emit(op, R(l, size), R(r, 1), comment);
+		return;
+	}
+	if (s_hw[l] == REG_RCX) {
+		/* The value is shifted in the accumulator instead. */
+		emit(INSN_MOV, ACC(size), R(l, size), NULL);
+		emit(INSN_MOV, oreg(REG_RCX, 1), R(r, 1), NULL);
+		emit(op, ACC(size), oreg(REG_RCX, 1), comment);
+		emit(INSN_MOV, R(l, size), ACC(size), NULL);
+		return;
+	}
+	saved = rmsk[1] != 0;
+	if (saved) emit(INSN_PUSH, oreg(REG_RCX, 8), NONE, "saving count register");
+	emit(INSN_MOV, oreg(REG_RCX, 1), R(r, 1), NULL);
+	emit(op, R(l, size), oreg(REG_RCX, 1), comment);
+	if (saved) emit(INSN_POP, oreg(REG_RCX, 8), NONE, "saving count register");
+}
+
+/* Extends a value of a narrower type to size, as the operand of a wider operation. */
+static void g_widen(int reg, foodtype *from, int size)
+{
+	int width = rsizeof(from);
+	if (width >= size) return;
+	if (!is_unsigned(from)) {
+		emit(INSN_MOVSX, R(reg, size), R(reg, width), "widen");
+	} else if (width == 4) {
+		/* Writing a 32 bits register clears the upper half. */
+		emit(INSN_MOV, R(reg, 4), R(reg, 4), "widen");
+	} else {
+		emit(INSN_MOVZX, R(reg, size), R(reg, width), "widen");
+	}
+}
+
+/*
+	Divides l by r, leaving the quotient or the remainder in l. idiv
+	divides rdx:rax, so rdx is saved if it holds another value, and
+	the divisor is moved out of it. Bytes are divided as words, for
+	their remainder to be in dx too.
+*/
+static void g_divide(expression_kind e, int l, int r, int size)
+{
+	bool_t saved = rmsk[2] && l != 2;
+	int divisor = r;
+	emit_comment(e == EXPRESSION_DIVISION ? "div" : "mod");
+	if (saved) emit(INSN_PUSH, oreg(REG_RDX, 8), NONE, "saving data register");
+	if (r == 2) {
+		divisor = ralloc();
+		emit(INSN_MOV, R(divisor, size), R(r, size), NULL);
+	}
+	if (size == 1) {
+		emit(INSN_MOVSX, R(l, 2), R(l, 1), NULL);
+		emit(INSN_MOVSX, R(divisor, 2), R(divisor, 1), NULL);
+		size = 2;
+	}
+	emit(INSN_MOV, ACC(size), R(l, size), NULL);
+	emit((size == 8) ? INSN_CQO : (size == 4) ? INSN_CDQ : INSN_CWD, NONE, NONE, NULL);
+	emit(INSN_IDIV, R(divisor, size), NONE, NULL);
+	if (e == EXPRESSION_DIVISION) {
+		emit(INSN_MOV, R(l, size), ACC(size), NULL);
+	} else if (l != 2) {
+		emit(INSN_MOV, R(l, size), oreg(REG_RDX, size), NULL);
+	}
+	if (divisor != r) rfree(divisor);
+	if (saved) emit(INSN_POP, oreg(REG_RDX, 8), NONE, "saving data register");
+}
+
+/* Makes the flag set by a comparison the value of l. */
+static void g_set(insn op, int l, int size)
+{
+	emit(op, R(l, 1), NONE, NULL);
+	if (size > 1) emit(INSN_MOVZX, R(l, size), R(l, 1), NULL);
+}
+
+/* Generates l = l op r. The operators are signed at the size of the operation but >>, which is logical for the unsigned types. */
 static void g_binary(expression_kind e, int l, int r, int size, bool_t u)
 {
-	(void)u;
 	switch (e)
 	{
 		case EXPRESSION_ADDITION:
-			code("add %s, %s ; add", rget(l, size), rget(r, size));
+			emit(INSN_ADD, R(l, size), R(r, size), "add");
 			break;
 		
 		case EXPRESSION_SUBTRACTION:
-			code("sub %s, %s ; sub", rget(l, size), rget(r, size));
+			emit(INSN_SUB, R(l, size), R(r, size), "sub");
 			break;
 
 		case EXPRESSION_MULTIPLY:
-			code("imul %s, %s ; mul", rget(l, size), rget(r, size));
+			emit(INSN_IMUL, R(l, size), R(r, size), "mul");
 			break;
 		
 		case EXPRESSION_DIVISION:
-			code("; div");
-			code("mov %s, %s", racc(size), rget(l, size));
-			code("%s", (size == 8) ? "cqo" : (size == 4) ? "cdq" : "cwd");
-			code("idiv %s", rget(r, size)); /* yes. lsize, because division size must match here */
-			code("mov %s, %s", rget(l, size), racc(size));
-			break;
-
 		case EXPRESSION_MODULO:
-			code("; mod");
-			if (rmsk[2] && l != 2 && r != 2) {
-				code("push rdx ; saving data register");
-			}
-			code("mov %s, %s", racc(size), rget(l, size));
-			code("%s", (size == 8) ? "cqo" : (size == 4) ? "cdq" : "cwd");
-			code("idiv %s", rget(r, size)); /* yes. lsize, because division size must match here */
-			if (rmsk[2] && l != 2 && r != 2) {
-				code("mov %s, %s", rget(l, size), rget(2, size));
-				code("pop rdx ; saving data register");
-			} else if (l == 2) {
-			} else {
-				code("mov %s, %s", rget(l, size), rget(2, size));
-			}
+			g_divide(e, l, r, size);
 			break;
 
 		case EXPRESSION_BITWISE_AND:
-			code("and %s, %s ; bitwise and", rget(l, size), rget(r, size));
+			emit(INSN_AND, R(l, size), R(r, size), "bitwise and");
 			break;
 		
 		case EXPRESSION_BITWISE_OR:
-			code("or %s, %s ; bitwise or", rget(l, size), rget(r, size));
+			emit(INSN_OR, R(l, size), R(r, size), "bitwise or");
 			break;
 		
 		case EXPRESSION_BITWISE_XOR:
-			code("xor %s, %s ; bitwise xor", rget(l, size), rget(r, size));
+			emit(INSN_XOR, R(l, size), R(r, size), "bitwise xor");
 			break;
 		
 		case EXPRESSION_LOGICAL_OR:
-			code("; logical or");
-			code("or %s, %s", rget(l, size), rget(r, size));
-			code("setne %s", rget(l, 1));
+			emit_comment("logical or");
+			emit(INSN_OR, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETNE, l, size);
 			break;
 		
 		case EXPRESSION_LOGICAL_AND:
-			code("; logical and");
-			code("test %s, %s", rget(l, size), rget(l, size));
-			code("setne %s", rget(l, 1));
-			code("test %s, %s", rget(r, size), rget(r, size));
-			code("setne %s", rget(r, 1));
-			code("and %s, %s", rget(l, 1), rget(r, 1));
+			emit_comment("logical and");
+			emit(INSN_TEST, R(l, size), R(l, size), NULL);
+			emit(INSN_SETNE, R(l, 1), NONE, NULL);
+			emit(INSN_TEST, R(r, size), R(r, size), NULL);
+			emit(INSN_SETNE, R(r, 1), NONE, NULL);
+			emit(INSN_AND, R(l, 1), R(r, 1), NULL);
+			if (size > 1) emit(INSN_MOVZX, R(l, size), R(l, 1), NULL);
 			break;
 		
 		case EXPRESSION_LOWER:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("setl %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETL, l, size);
 			break;
 
 		case EXPRESSION_LOWER_OR_EQUAL:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("setle %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETLE, l, size);
 			break;
 
 		case EXPRESSION_GREATER:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("setg %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETG, l, size);
 			break;
 
 		case EXPRESSION_GREATER_OR_EQUAL:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("setge %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETGE, l, size);
 			break;
 
 		case EXPRESSION_EQUAL:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("sete %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETE, l, size);
 			break;
 
 		case EXPRESSION_NOT_EQUAL:
-			code("; compare(lower)");
-			code("cmp %s, %s", rget(l, size), rget(r, size));
-			code("setne %s", rget(l, 1));
+			emit_comment("compare(lower)");
+			emit(INSN_CMP, R(l, size), R(r, size), NULL);
+			g_set(INSN_SETNE, l, size);
 			break;
 
 		case EXPRESSION_LSHIFT:
-			code("sal %s, %s ; left shift", rget(l, size), rget(r, 1));
+			g_shift(INSN_SAL, l, r, size, "left shift");
 			break;
 
 		case EXPRESSION_RSHIFT:
-			code("shr %s, %s ; right shift", rget(l, size), rget(r, 1));
+			g_shift(u ? INSN_SHR : INSN_SAR, l, r, size, "right shift");
 			break;
 
 		default:
@@ -245,19 +329,33 @@ int g_ternary(expression *tree)
 	exit_label = label();
 
 	/* Result is stored in right operand c in (a:b:c) */
-	code("; ternary expression");
-	code("test %s, %s", rget(e, 1), rget(e, 1));
-	goto_label("jne", true_label);
+	emit_comment("ternary expression");
+	emit(INSN_TEST, R(e, rsizeof(&tree->extra->type)), R(e, rsizeof(&tree->extra->type)), NULL);
+	goto_label(INSN_JNE, true_label);
 	r = g_expression(tree->right);
-	goto_label("jmp", exit_label);
+	g_widen(r, &tree->right->type, size);
+	goto_label(INSN_JMP, exit_label);
 	here_label(true_label);
 	l = g_expression(tree->left);
-	code("mov %s, %s", rget(r, size), rget(l, size));
+	g_widen(l, &tree->left->type, size);
+	emit(INSN_MOV, R(r, size), R(l, size), NULL);
 	here_label(exit_label);
 	return r;
 }
 
+static int s_expression(expression *tree);
+
 int g_expression(expression *tree)
+{
+	int yield;
+	if (!time_enabled) return s_expression(tree);
+	time_enter(PHASE_GENERATE, 0);
+	yield = s_expression(tree);
+	time_leave(PHASE_GENERATE);
+	return yield;
+}
+
+static int s_expression(expression *tree)
 {
 	int l = 0xFF, r = 0xFF;
 	int size = rsizeof(&tree->type);
@@ -280,14 +378,331 @@ int g_expression(expression *tree)
 			r = g_expression(tree->right);
 			l = g_expression(tree->left);
 		}
+		g_widen(l, &tree->left->type, size);
+		g_widen(r, &tree->right->type, size);
 		g_binary(tree->kind, l, r, size, is_unsigned(&tree->type));
 		rfree(r);
 		return l;
 	} else if (tree->kind == EXPRESSION_TERNARY_CONDITIONAL) {
 		return g_ternary(tree);
 
+	}
+
+	switch (tree->kind) {
+		case EXPRESSION_POSTFIX_UNARY_PLUS:
+			return g_expression(tree->left);
+
+		case EXPRESSION_POSTFIX_UNARY_MINUS:
+			l = g_expression(tree->left);
+			emit(INSN_NEG, R(l, size), NONE, "negation");
+			return l;
+
+		case EXPRESSION_POSTFIX_BITWISE_NOT:
+			l = g_expression(tree->left);
+			emit(INSN_NOT, R(l, size), NONE, "bitwise not");
+			return l;
+
+		case EXPRESSION_POSTFIX_LOGICAL_NOT:
+			l = g_expression(tree->left);
+			emit_comment("logical not");
+			emit(INSN_TEST, R(l, size), R(l, size), NULL);
+			emit(INSN_SETE, R(l, 1), NONE, NULL);
+			if (size > 1) emit(INSN_MOVZX, R(l, size), R(l, 1), NULL);
+			return l;
+
+		default:
+			derror(&tree->token, "this operator cannot be generated yet\n");
+			return ralloc();
+	}
+}
+
+size_t elabels(expression *tree)
+{
+	if (tree->kind == EXPRESSION_INTEGER_LITERAL
+	 || tree->kind == EXPRESSION_FLOATING_LITERAL
+	 || tree->kind == EXPRESSION_BOOLEAN_LITERAL) {
+
+		return 0;
+	}
+	if (is_binary(tree)) {
+		return elabels(tree->left) + elabels(tree->right);
+	} else if (tree->kind == EXPRESSION_TERNARY_CONDITIONAL) {
+		return 2 + elabels(tree->extra) + elabels(tree->left) + elabels(tree->right);
+	}
+	return elabels(tree->left);
+}
+
+size_t statement_labels(statement_tree *tree)
+{
+	size_t yield = 0, i;
+	if (!tree) return 0;
+
+	switch (tree->kind) {
+		case STATEMENT_EXPRESSION:
+			return elabels(tree->condition);
+
+		case STATEMENT_BLOCK:
+			for (i = 0; i < tree->childcount; i++) {
+				yield += statement_labels(tree->children[i]);
+			}
+			return yield;
+
+		case STATEMENT_IF:
+			yield = tree->has_else ? 4 : 3;
+			yield += statement_labels(tree->otherwise);
+			break;
+
+		case STATEMENT_WHILE:
+			yield = 2;
+			break;
+
+		case STATEMENT_DO:
+			yield = 1;
+			break;
+	}
+	return yield + statement_labels(tree->body) + elabels(tree->condition);
+}
+
+/* Moves the value of an expression statement to rax, extended to 64 bits. */
+static void g_result(int reg, foodtype *t)
+{
+	size_t size = rsizeof(t);
+	if (!size) return;
+	if (size == 8) {
+		emit(INSN_MOV, oreg(REG_RAX, 8), R(reg, 8), "result");
+	} else if (size == 4 && is_unsigned(t)) {
+		emit(INSN_MOV, oreg(REG_RAX, 4), R(reg, 4), "result");
 	} else {
-		l = g_expression(tree->left);
+		emit(is_unsigned(t) ? INSN_MOVZX : INSN_MOVSX, oreg(REG_RAX, 8), R(reg, size), "result");
+	}
+}
+
+/* Counts an edge taken (-fprofile-generate). The counters are in rdi. */
+static void g_count(size_t counter)
+{
+	emit(INSN_ADD, omem(REG_RDI, counter * 8, 8), oimm(1), "profile");
+}
+
+/*
+	Times a top-level statement (-finstrument-functions). The records
+	are in rsi, and rax holds the result of the statements so far.
+	When sampling, the countdown is back to its full value at exit
+	only if the call was timed, as top-level statements do not nest.
+*/
+static void g_instrument(size_t site, uint64_t pos, bool_t exit)
+{
+	uint64_t record = site * sizeof(instrument_record);
+	size_t skip = 0;
+
+	if (instrument_sample > 1) {
+		skip = label();
+		if (!exit) {
+			emit(INSN_SUB, omem(REG_RSI, record, 8), oimm(1), "sampling");
+			goto_label(INSN_JNE, skip);
+			emit(INSN_MOV, omem(REG_RSI, record, 8), oimm(instrument_sample), NULL);
+		} else {
+			emit(INSN_CMP, omem(REG_RSI, record, 8), oimm(instrument_sample), "sampled");
+			goto_label(INSN_JNE, skip);
+		}
+	}
+	emit(INSN_PUSH, oreg(REG_RAX, 8), NONE, NULL);
+	if (instrument_mode == INSTRUMENT_RDTSC) {
+		emit(INSN_RDTSC, NONE, NONE, NULL);
+		emit(INSN_SAL, oreg(REG_RDX, 8), oimm(32), NULL);
+		emit(INSN_OR, oreg(REG_RAX, 8), oreg(REG_RDX, 8), NULL);
+		if (!exit) {
+			emit(INSN_MOV, omem(REG_RSI, record + 8, 8), oreg(REG_RAX, 8), "start");
+		} else {
+			emit(INSN_SUB, oreg(REG_RAX, 8), omem(REG_RSI, record + 8, 8), NULL);
+			emit(INSN_ADD, omem(REG_RSI, record + 16, 8), oreg(REG_RAX, 8), "cycles");
+			emit(INSN_ADD, omem(REG_RSI, record + 24, 8), oimm(1), "calls");
+		}
+	} else {
+		/* With rax, three pushes keep the stack aligned for the call. */
+		emit(INSN_PUSH, oreg(REG_RSI, 8), NONE, NULL);
+		emit(INSN_PUSH, oreg(REG_RDI, 8), NONE, NULL);
+		emit(INSN_MOV, oreg(REG_RDI, 8), oimm(site), NULL);
+		emit(INSN_MOV, oreg(REG_RSI, 8), oimm(pos), NULL);
+		emit(INSN_MOV, oreg(REG_RAX, 8), oimm(instrument_hook(exit)), NULL);
+		emit(INSN_CALL, oreg(REG_RAX, 8), NONE, exit ? "__food_exit" : "__food_enter");
+		emit(INSN_POP, oreg(REG_RDI, 8), NONE, NULL);
+		emit(INSN_POP, oreg(REG_RSI, 8), NONE, NULL);
+	}
+	emit(INSN_POP, oreg(REG_RAX, 8), NONE, NULL);
+	if (instrument_sample > 1) here_label(skip);
+}
+
+static void s_statement(statement_tree *tree);
+
+void g_statement(statement_tree *tree)
+{
+	/* The position of the statement whose code is being generated, all ones outside of any. */
+	static ECK_TLS uint64_t marked = (uint64_t)-1;
+	static ECK_TLS size_t depth = 0;
+	uint64_t parent = marked;
+	size_t site = 0;
+	if ((!gen_line_table && !instrument_mode && !cost_report && !stack_usage) || !tree) {
+		s_statement(tree);
+		return;
+	}
+	if (stack_usage && !depth) stack_begin(tree);
+	if (instrument_mode && !depth) {
+		site = instrument_site(tree->token.pos);
+		g_instrument(site, tree->token.pos, FALSE);
+	}
+	if (cost_report && !depth) cost_begin(tree->token.pos);
+	if (gen_line_table) {
+		marked = tree->token.pos;
+		emit_mark(marked);
+	}
+	depth++;
+	s_statement(tree);
+	depth--;
+	/* The code after a nested statement is the one of its parent again. */
+	if (gen_line_table) {
+		marked = parent;
+		emit_mark(parent);
+	}
+	if (cost_report && !depth) cost_end();
+	if (instrument_mode && !depth) g_instrument(site, tree->token.pos, TRUE);
+	if (stack_usage && !depth) stack_end();
+}
+
+static void s_statement(statement_tree *tree)
+{
+	int condition_reg;
+	size_t i, condition_size;
+
+	if (!tree) return;
+	/* A condition is tested at the size of its type. */
+	condition_size = tree->condition ? rsizeof(&tree->condition->type) : 0;
+
+	switch (tree->kind) {
+
+		case STATEMENT_EXPRESSION:
+			condition_reg = g_expression(tree->condition);
+			rfree(condition_reg);
+			if (gen_result) g_result(condition_reg, &tree->condition->type);
+			return;
+
+		case STATEMENT_BLOCK:
+			if (tree->frame) {
+				emit(INSN_PUSH, oreg(REG_RBP, 8), NONE, NULL);
+				emit(INSN_MOV, oreg(REG_RBP, 8), oreg(REG_RSP, 8), NULL);
+				emit(INSN_SUB, oreg(REG_RSP, 8), oimm(tree->frame), NULL);
+			}
+			for (i = 0; i < tree->childcount; i++) {
+				g_statement(tree->children[i]);
+			}
+			if (tree->frame) {
+				emit(INSN_MOV, oreg(REG_RSP, 8), oreg(REG_RBP, 8), NULL);
+				emit(INSN_POP, oreg(REG_RBP, 8), NONE, NULL);
+			}
+			return;
+
+		case STATEMENT_IF: {
+			size_t condition_label, then_label, lead_label, else_label = 0, counter = 0;
+			uint64_t then_count, else_count;
+			condition_label = label();
+			then_label = label();
+			lead_label = label();
+			if (profile_generate) {
+				counter = profile_counter(tree);
+				g_count(counter + 1);
+			}
+			if (profile_use && profile_lookup(tree, &then_count, &else_count)) {
+				/* The hot branch falls through from the condition, the other one is jumped to. */
+				if (tree->has_else) else_label = label();
+				condition_reg = g_expression(tree->condition);
+				rfree(condition_reg);
+				emit(INSN_TEST, R(condition_reg, condition_size), R(condition_reg, condition_size), NULL);
+				if (tree->has_else && else_count > then_count) {
+					goto_label(INSN_JNE, then_label);
+					g_statement(tree->otherwise);
+					goto_label(INSN_JMP, lead_label);
+					here_label(then_label);
+					if (profile_generate) g_count(counter);
+					g_statement(tree->body);
+				} else {
+					goto_label(INSN_JE, tree->has_else ? else_label : lead_label);
+					if (profile_generate) g_count(counter);
+					g_statement(tree->body);
+					if (tree->has_else) {
+						goto_label(INSN_JMP, lead_label);
+						here_label(else_label);
+						g_statement(tree->otherwise);
+					}
+				}
+				here_label(lead_label);
+				return;
+			}
+			goto_label(INSN_JMP, condition_label);
+			here_label(then_label);
+			if (profile_generate) g_count(counter);
+			g_statement(tree->body);
+			goto_label(INSN_JMP, lead_label);
+			if (tree->has_else) {
+				else_label = label();
+				here_label(else_label);
+				g_statement(tree->otherwise);
+				goto_label(INSN_JMP, lead_label);
+			}
+			here_label(condition_label);
+			condition_reg = g_expression(tree->condition);
+			rfree(condition_reg);
+			emit(INSN_TEST, R(condition_reg, condition_size), R(condition_reg, condition_size), NULL);
+			goto_label(INSN_JNE, then_label);
+			/* The else label must be non-null at this point, as we generate at least three labels before. */
+			if (else_label) goto_label(INSN_JMP, else_label);
+			here_label(lead_label);
+			return;
+		}
+
+		case STATEMENT_WHILE: {
+			size_t condition_label, lead_label, counter = 0;
+			uint64_t iterations, exits;
+			condition_label = label();
+			lead_label = label();
+			if (profile_generate) counter = profile_counter(tree);
+			if (profile_use && profile_lookup(tree, &iterations, &exits) && iterations > exits) {
+				/* A loop that iterates is rotated, so that an iteration takes a single jump. */
+				goto_label(INSN_JMP, condition_label);
+				here_label(lead_label);
+				if (profile_generate) g_count(counter);
+				g_statement(tree->body);
+				here_label(condition_label);
+				condition_reg = g_expression(tree->condition);
+				rfree(condition_reg);
+				emit(INSN_TEST, R(condition_reg, condition_size), R(condition_reg, condition_size), NULL);
+				goto_label(INSN_JNE, lead_label);
+				if (profile_generate) g_count(counter + 1);
+				return;
+			}
+			here_label(condition_label);
+			condition_reg = g_expression(tree->condition);
+			rfree(condition_reg); /* TODO: should this be done? */
+			emit(INSN_TEST, R(condition_reg, condition_size), R(condition_reg, condition_size), NULL);
+			goto_label(INSN_JE, lead_label);
+			if (profile_generate) g_count(counter);
+			g_statement(tree->body);
+			goto_label(INSN_JMP, condition_label);
+			here_label(lead_label);
+			if (profile_generate) g_count(counter + 1);
+			return;
+		}
+
+		case STATEMENT_DO: {
+			size_t do_label, counter = 0;
+			do_label = label();
+			if (profile_generate) counter = profile_counter(tree);
+			here_label(do_label);
+			if (profile_generate) g_count(counter);
+			g_statement(tree->body);
+			condition_reg = g_expression(tree->condition);
+			emit(INSN_TEST, R(condition_reg, condition_size), R(condition_reg, condition_size), NULL);
+			goto_label(INSN_JNE, do_label);
+			if (profile_generate) g_count(counter + 1);
+			return;
+		}
 	}
-	return 0;
 }
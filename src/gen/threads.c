@@ -0,0 +1,133 @@
+/*
+	Parallel code generation for ECK
+
+	The source is parsed first, as the parser and the symbol
+	tables are not shared between threads. This gives a list of
+	top-level statements, the units, which do not depend on each
+	other once parsed: nothing is kept in registers between them
+	and each one knows how many labels it takes.
+
+	The units are then generated by a pool of threads. Every
+	thread has its own registers and its own output, and a unit
+	starts at the label it would have had in a sequential run.
+	The buffers are written in the order of the source, so the
+	output is the same whatever the number of threads.
+*/
+#include "../common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int codegen_threads = 1;
+
+#ifdef ECK_THREADS
+
+#include <pthread.h>
+
+/* A top-level statement to generate. */
+typedef struct codegen_unit
+{
+	statement_tree *tree; /* The statement. */
+	size_t label;         /* The number of its first label. */
+	emit_buffer text;     /* The assembly generated for it. */
+} codegen_unit;
+
+/* The units shared by the threads. */
+typedef struct codegen_queue
+{
+	codegen_unit *units;
+	size_t count;
+	size_t next;           /* The next unit to take. */
+	pthread_mutex_t lock;  /* Protects next. */
+} codegen_queue;
+
+static void *s_worker(void *data)
+{
+	codegen_queue *queue = data;
+	codegen_unit *unit;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		unit = queue->next < queue->count ? &queue->units[queue->next++] : NULL;
+		pthread_mutex_unlock(&queue->lock);
+		if (!unit) break;
+
+		asm_target = &unit->text;
+		rreset();
+		label_restart(unit->label);
+		g_statement(unit->tree);
+	}
+	return NULL;
+}
+
+bool_t compile_threaded(FILE *sfile, FILE *sout)
+{
+	codegen_queue queue;
+	pthread_t *threads;
+	emit_buffer *output;
+	lex_token token;
+	statement_tree *tree;
+	size_t max = 0, labels = 0, i;
+	int count, started;
+
+	memset(&queue, 0, sizeof(queue));
+	compile_begin(sfile, sout);
+	output = asm_target;
+
+	/* 1. Parsing every unit, giving each one its range of labels */
+	while (lex_peek(&token)) {
+		tree = parse_toplevel();
+		if (!tree) continue;
+		if (queue.count == max) {
+			max = max ? max * 2 : 64;
+			queue.units = realloc(queue.units, sizeof(codegen_unit) * max);
+		}
+		queue.units[queue.count].tree = tree;
+		queue.units[queue.count].label = labels;
+		memset(&queue.units[queue.count].text, 0, sizeof(emit_buffer));
+		if (asm_target->mc) queue.units[queue.count].text.mc = mc_new();
+		labels += statement_labels(tree);
+		queue.count++;
+	}
+
+	/* 2. Generating the units, unless the source has errors */
+	if (is_clean()) {
+		/* This thread is one of the workers. */
+		count = codegen_threads - 1;
+		if ((size_t)count > queue.count) count = queue.count;
+		threads = malloc(sizeof(pthread_t) * (count + 1));
+		pthread_mutex_init(&queue.lock, NULL);
+		for (started = 0; started < count; started++) {
+			if (pthread_create(&threads[started], NULL, s_worker, &queue) != 0) break;
+		}
+		s_worker(&queue);
+		while (started--) {
+			pthread_join(threads[started], NULL);
+		}
+		pthread_mutex_destroy(&queue.lock);
+		free(threads);
+		asm_target = output;
+		label_restart(labels);
+	}
+
+	/* 3. Putting the units back in the order of the source */
+	for (i = 0; i < queue.count; i++) {
+		if (output->mc) mc_append(output->mc, queue.units[i].text.mc);
+		else emit_text(output, queue.units[i].text.data, queue.units[i].text.length);
+		emit_free(&queue.units[i].text);
+		delete_statement(queue.units[i].tree);
+	}
+	free(queue.units);
+	return compile_end();
+}
+
+#else
+
+bool_t compile_threaded(FILE *sfile, FILE *sout)
+{
+	/* Generated in this thread only. */
+	codegen_threads = 1;
+	return compile_stream(sfile, sout);
+}
+
+#endif
@@ -0,0 +1,389 @@
+/*
+	Incremental recompilation for ECK
+
+	A source is split into units, one per top-level statement.
+	Each unit is identified by the hash of its tokens and of the
+	file scope symbols visible to it. The assembly generated for
+	each unit is kept in a manifest next to the output, so that
+	the units that did not change can be spliced back instead of
+	being parsed and generated again.
+
+	Labels are numbered for the whole file, so the assembly of a
+	unit is stored as if its first label was .L0000 and renumbered
+	when it is spliced. Registers are never kept between units.
+
+	Manifest layout (native byte order):
+	  char     magic[8]     "FDINC" + version
+	  uint8_t  build[32]    hash of the compiler and its options
+	  uint32_t unit_count
+	  units: uint8_t key[32], uint32_t labels, uint32_t length, char text[length]
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define INC_MAGIC "FDINC\0\0\1"
+
+bool_t incremental = FALSE;
+
+/* The code generated for a unit. */
+typedef struct inc_unit
+{
+	uint8_t key[32]; /* The hash of the tokens and dependencies of the unit. */
+	uint32_t labels; /* The number of labels used by the unit. */
+	char *text;      /* The assembly, with labels starting at zero. */
+	size_t length;   /* The length of the assembly. */
+	bool_t used;     /* Whether the unit was already spliced. */
+} inc_unit;
+
+typedef struct inc_manifest
+{
+	inc_unit *units;
+	size_t count;
+	size_t max;
+} inc_manifest;
+
+static void s_build_key(uint8_t key[32])
+{
+	static const char build[] = ECK_VERSION " " __DATE__ " " __TIME__;
+	sha256_ctx ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, build, sizeof(build));
+	options_signature(&ctx);
+	sha256_final(&ctx, key);
+}
+
+static void s_add(inc_manifest *m, inc_unit *unit)
+{
+	if (m->count == m->max) {
+		m->max = m->max ? m->max * 2 : 64;
+		m->units = realloc(m->units, sizeof(inc_unit) * m->max);
+	}
+	m->units[m->count++] = *unit;
+}
+
+static void s_free(inc_manifest *m)
+{
+	size_t i;
+	for (i = 0; i < m->count; i++) {
+		free(m->units[i].text);
+	}
+	free(m->units);
+	memset(m, 0, sizeof(*m));
+}
+
+/* Loads the manifest of the previous compilation. Leaves it empty if unusable. */
+static void s_load(inc_manifest *m, const char *path)
+{
+	char magic[8];
+	uint8_t build[32], expected[32];
+	uint32_t count, i, labels, length;
+	inc_unit unit;
+	FILE *f;
+
+	memset(m, 0, sizeof(*m));
+	f = fopen(path, "rb");
+	if (!f) return;
+
+	s_build_key(expected);
+	if (fread(magic, 8, 1, f) != 1 || memcmp(magic, INC_MAGIC, 8)
+	 || fread(build, 32, 1, f) != 1 || memcmp(build, expected, 32)
+	 || fread(&count, 4, 1, f) != 1) {
+		fclose(f);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		memset(&unit, 0, sizeof(unit));
+		if (fread(unit.key, 32, 1, f) != 1
+		 || fread(&labels, 4, 1, f) != 1
+		 || fread(&length, 4, 1, f) != 1) {
+			break;
+		}
+		unit.labels = labels;
+		unit.length = length;
+		unit.text = malloc(length + 1);
+		if (fread(unit.text, 1, length, f) != length) {
+			free(unit.text);
+			break;
+		}
+		s_add(m, &unit);
+	}
+	fclose(f);
+
+	/* A truncated manifest is not trusted at all. */
+	if (m->count != count) {
+		s_free(m);
+	}
+}
+
+static void s_save(inc_manifest *m, const char *path)
+{
+	uint8_t build[32];
+	uint32_t count = m->count, labels, length;
+	size_t i;
+	FILE *f = fopen(path, "wb");
+	if (!f) return;
+
+	s_build_key(build);
+	fwrite(INC_MAGIC, 8, 1, f);
+	fwrite(build, 32, 1, f);
+	fwrite(&count, 4, 1, f);
+	for (i = 0; i < m->count; i++) {
+		labels = m->units[i].labels;
+		length = m->units[i].length;
+		fwrite(m->units[i].key, 32, 1, f);
+		fwrite(&labels, 4, 1, f);
+		fwrite(&length, 4, 1, f);
+		fwrite(m->units[i].text, 1, length, f);
+	}
+	fclose(f);
+}
+
+/* Finds an unused unit with a given key. The hint is checked first, as most units don't move. */
+static inc_unit *s_find(inc_manifest *m, const uint8_t key[32], size_t hint)
+{
+	size_t i;
+	if (hint < m->count && !m->units[hint].used && !memcmp(m->units[hint].key, key, 32))
+		return &m->units[hint];
+	for (i = 0; i < m->count; i++) {
+		if (!m->units[i].used && !memcmp(m->units[i].key, key, 32))
+			return &m->units[i];
+	}
+	return NULL;
+}
+
+/*
+	Writes assembly, adding delta to the number of every label.
+	Labels are written as .L followed by (at least four) hex digits.
+*/
+static void s_relabel(emit_buffer *out, const char *text, size_t length, long delta)
+{
+	char label[32];
+	size_t i = 0, start = 0;
+	unsigned long number;
+
+	while (i + 2 < length) {
+		if (text[i] != '.' || text[i + 1] != 'L' || !isxdigit((unsigned char)text[i + 2])) {
+			i++;
+			continue;
+		}
+		emit_text(out, text + start, i - start);
+		i += 2;
+		number = 0;
+		while (i < length && isxdigit((unsigned char)text[i])) {
+			char c = text[i++];
+			number = number * 16 + (isdigit((unsigned char)c) ? c - '0' : (toupper((unsigned char)c) - 'A' + 10));
+		}
+		sprintf(label, ".L%04lX", (unsigned long)(number + delta));
+		emit_text(out, label, strlen(label));
+		start = i;
+	}
+	emit_text(out, text + start, length - start);
+}
+
+/* Hashes a token. Positions are left out, so units can move around. */
+static void s_hash_token(sha256_ctx *ctx, lex_token *tok)
+{
+	sha256_update(ctx, &tok->kind, sizeof(tok->kind));
+	if (tok->kind == 'I') {
+		sha256_update(ctx, tok->value.str, strlen(tok->value.str) + 1);
+	} else if (tok->kind == OP2('0', '.')) {
+		sha256_update(ctx, &tok->value.double_float, sizeof(double));
+	} else if (tok->kind == '0') {
+		sha256_update(ctx, &tok->value.u64, sizeof(uint64_t));
+	}
+}
+
+static bool_t s_next(sha256_ctx *ctx, lex_token *tok)
+{
+	if (!lex_fetch(tok))
+		return FALSE;
+	s_hash_token(ctx, tok);
+	return TRUE;
+}
+
+/* Skips tokens up to the closing token of a group (brackets or braces). */
+static void s_skip_group(sha256_ctx *ctx, uint64_t open, uint64_t close)
+{
+	lex_token tok;
+	size_t depth = 1;
+	while (depth && s_next(ctx, &tok)) {
+		if (tok.kind == open) depth++;
+		else if (tok.kind == close) depth--;
+	}
+}
+
+/* Skips a statement without parsing it, the same way statement() reads it. */
+static void s_skip_statement(sha256_ctx *ctx)
+{
+	lex_token tok;
+	size_t depth = 0;
+
+	if (!s_next(ctx, &tok))
+		return;
+
+	switch (tok.kind) {
+		case ';':
+			return;
+
+		case '{':
+			s_skip_group(ctx, '{', '}');
+			return;
+
+		case KEYWORD_IF:
+			if (s_next(ctx, &tok) && tok.kind == '(')
+				s_skip_group(ctx, '(', ')');
+			s_skip_statement(ctx);
+			if (lex_peek(&tok) && tok.kind == KEYWORD_ELSE) {
+				s_next(ctx, &tok);
+				s_skip_statement(ctx);
+			}
+			return;
+
+		case KEYWORD_WHILE:
+			if (s_next(ctx, &tok) && tok.kind == '(')
+				s_skip_group(ctx, '(', ')');
+			s_skip_statement(ctx);
+			return;
+
+		case KEYWORD_DO:
+			s_skip_statement(ctx);
+			if (s_next(ctx, &tok) && tok.kind == KEYWORD_WHILE
+			 && s_next(ctx, &tok) && tok.kind == '(') {
+				s_skip_group(ctx, '(', ')');
+				s_next(ctx, &tok);
+			}
+			return;
+
+		default:
+			/* Expressions end with a semicolon outside of brackets */
+			do {
+				if (tok.kind == '(') depth++;
+				else if (tok.kind == ')' && depth) depth--;
+				else if (tok.kind == ';' && !depth) return;
+			} while (s_next(ctx, &tok));
+			return;
+	}
+}
+
+/* Hashes the file scope symbols, which are all that a unit can depend on. */
+static void s_hash_dependencies(sha256_ctx *ctx)
+{
+	scope *base = scope_base();
+	foodtype *t;
+	size_t i;
+
+	for (i = 0; i < base->symbolcount; i++) {
+		sha256_update(ctx, base->symbols[i].name, strlen(base->symbols[i].name) + 1);
+		for (t = &base->symbols[i].t; t; t = t->sub) {
+			sha256_update(ctx, &t->kind, 1);
+			sha256_update(ctx, &t->qualifiers, 1);
+		}
+	}
+}
+
+/* Whether a unit changes the state of the compiler, in which case it is always compiled. */
+static bool_t s_stateful(void)
+{
+	foodtype discard_foodtype;
+	lex_token tok;
+	size_t base = lex_pos();
+	bool_t yield;
+
+	if (!lex_peek(&tok))
+		return TRUE;
+	if (tok.kind == KEYWORD_NAMESPACE || tok.kind == KEYWORD_USING)
+		return TRUE;
+	yield = tparse(&discard_foodtype);
+	lex_move(base);
+	return yield;
+}
+
+bool_t compile_incremental(FILE *sfile, FILE *sout, const char *manifest)
+{
+	inc_manifest previous, next;
+	inc_unit unit, *found;
+	emit_buffer normal;
+	lex_token token;
+	uint8_t key[32];
+	sha256_ctx ctx;
+	size_t start, end, hint = 0, diags, labels, from, length;
+
+	memset(&normal, 0, sizeof(normal));
+	s_load(&previous, manifest);
+	memset(&next, 0, sizeof(next));
+	compile_begin(sfile, sout);
+
+	while (lex_peek(&token)) {
+		rreset();
+
+		/* 1. Declarations and modules are always compiled */
+		if (s_stateful()) {
+			toplevel();
+			continue;
+		}
+
+		/* 2. Finding the end of the unit to look it up */
+		start = lex_pos();
+		sha256_init(&ctx);
+		s_hash_dependencies(&ctx);
+		s_skip_statement(&ctx);
+		sha256_final(&ctx, key);
+		end = lex_pos();
+
+		found = s_find(&previous, key, hint);
+		if (found) {
+			found->used = TRUE;
+			hint = found - previous.units + 1;
+			s_relabel(asm_target, found->text, found->length, (long)label_mark());
+			label_restart(label_mark() + found->labels);
+			memset(&unit, 0, sizeof(unit));
+			memcpy(unit.key, key, 32);
+			unit.labels = found->labels;
+			unit.text = found->text;
+			unit.length = found->length;
+			found->text = NULL;
+			s_add(&next, &unit);
+			lex_move(end);
+			continue;
+		}
+
+		/* 3. Compiling the unit */
+		lex_move(start);
+		diags = diag_count();
+		labels = label_mark();
+		from = asm_target->length;
+		toplevel();
+		length = asm_target->length - from;
+
+		/*
+			Only units that compiled without any diagnostic are kept, and
+			only if the parser agreed on where the unit ends.
+		*/
+		if (diag_count() == diags && lex_pos() == end) {
+			/* Stored as if its first label was the first of the file. */
+			normal.length = 0;
+			s_relabel(&normal, asm_target->data + from, length, -(long)labels);
+			memset(&unit, 0, sizeof(unit));
+			memcpy(unit.key, key, 32);
+			unit.labels = label_mark() - labels;
+			unit.length = normal.length;
+			unit.text = malloc(normal.length + 1);
+			memcpy(unit.text, normal.data, normal.length);
+			s_add(&next, &unit);
+		}
+	}
+
+	emit_free(&normal);
+	if (compile_end()) {
+		s_save(&next, manifest);
+	} else {
+		remove(manifest);
+	}
+	s_free(&previous);
+	s_free(&next);
+	return is_clean();
+}
@@ -0,0 +1,205 @@
+/*
+	Latency instrumentation for ECK (-finstrument-functions)
+
+	The language has no functions yet, so the bodies timed are the
+	top-level statements, which are what --run executes. The code
+	generator (gen.c) wraps each of them:
+	  - hooks: calls __food_enter(fn, site) and __food_exit(fn, site),
+	    fn being the number of the statement and site its offset.
+	    The hooks are the ones below, or the ones of the library given
+	    with -finstrument-hooks=LIB.
+	  - rdtsc: reads the time stamp counter inline, and adds up the
+	    cycles and the calls in the record of the statement.
+
+	With -finstrument-sample=N, only one call in N is timed: the
+	record counts down the calls inline, so the others cost a
+	subtraction and a jump.
+
+	The hooks of eck sort the latency of each call into a histogram
+	of powers of two, printed once the code returns.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+	#include <dlfcn.h>
+#endif
+
+/* The buckets of a histogram: calls of [2^i, 2^(i + 1)) cycles. */
+#define INSTRUMENT_BUCKETS 64
+
+int instrument_mode = INSTRUMENT_NONE;
+uint64_t instrument_sample = 1;
+const char *instrument_hooks = NULL;
+
+/* A statement timed. */
+typedef struct instrument_site_info
+{
+	uint64_t pos;
+	size_t line, col;
+	uint64_t start; /* The time stamp of the call of the hooks. */
+	uint64_t calls;
+	uint64_t cycles;
+	uint64_t histogram[INSTRUMENT_BUCKETS];
+} instrument_site_info;
+
+static instrument_site_info *s_sites = NULL;
+static size_t s_count = 0, s_max = 0;
+static uint64_t s_enter = 0, s_exit = 0; /* The addresses of the hooks. */
+
+static uint64_t s_cycles(void)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	return (uint64_t)(clock_seconds() * 1e9);
+#endif
+}
+
+void __food_enter(uint64_t fn, uint64_t site)
+{
+	(void)site;
+	s_sites[fn].start = s_cycles();
+}
+
+void __food_exit(uint64_t fn, uint64_t site)
+{
+	uint64_t cycles = s_cycles() - s_sites[fn].start;
+	size_t bucket = 0;
+	(void)site;
+	while (bucket + 1 < INSTRUMENT_BUCKETS && cycles >> (bucket + 1)) bucket++;
+	s_sites[fn].histogram[bucket]++;
+	s_sites[fn].cycles += cycles;
+	s_sites[fn].calls++;
+}
+
+size_t instrument_site(uint64_t pos)
+{
+	if (s_count == s_max) {
+		s_max = s_max ? s_max * 2 : 64;
+		s_sites = realloc(s_sites, sizeof(instrument_site_info) * s_max);
+	}
+	memset(&s_sites[s_count], 0, sizeof(instrument_site_info));
+	s_sites[s_count].pos = pos;
+	return s_count++;
+}
+
+void instrument_reset(void)
+{
+	s_count = 0;
+}
+
+/* Gets the address of a function, as an immediate. */
+static uint64_t s_address(void (*hook)(uint64_t, uint64_t))
+{
+	uint64_t yield = 0;
+	memcpy(&yield, &hook, sizeof(hook));
+	return yield;
+}
+
+uint64_t instrument_hook(bool_t exit)
+{
+	if (s_enter) return exit ? s_exit : s_enter;
+	if (!instrument_hooks) {
+		s_enter = s_address(__food_enter);
+		s_exit = s_address(__food_exit);
+	} else {
+#ifndef _WIN32
+		void *library = dlopen(instrument_hooks, RTLD_NOW);
+		void *enter, *leave;
+		if (!library) {
+			dfatal("cannot load the hooks: %s", dlerror());
+		}
+		enter = dlsym(library, "__food_enter");
+		leave = dlsym(library, "__food_exit");
+		if (!enter || !leave) {
+			dfatal("'%s' has no __food_enter or __food_exit", instrument_hooks);
+		}
+		memcpy(&s_enter, &enter, sizeof(enter));
+		memcpy(&s_exit, &leave, sizeof(leave));
+#else
+		dfatal("-finstrument-hooks is not supported on this system");
+#endif
+	}
+	return exit ? s_exit : s_enter;
+}
+
+void instrument_locate(void)
+{
+	uint64_t *positions;
+	size_t *lines, *cols, i;
+
+	/* The top-level statements come in the order of the source. */
+	positions = malloc(sizeof(uint64_t) * (s_count + 1));
+	lines = malloc(sizeof(size_t) * (s_count + 1));
+	cols = malloc(sizeof(size_t) * (s_count + 1));
+	for (i = 0; i < s_count; i++) {
+		positions[i] = s_sites[i].pos;
+	}
+	lex_sites(positions, s_count, lines, cols);
+	for (i = 0; i < s_count; i++) {
+		s_sites[i].line = lines[i];
+		s_sites[i].col = cols[i];
+	}
+	free(positions);
+	free(lines);
+	free(cols);
+}
+
+instrument_record *instrument_records(void)
+{
+	instrument_record *yield = calloc(s_count + 1, sizeof(instrument_record));
+	size_t i;
+	/* The first call is timed. */
+	for (i = 0; i < s_count; i++) {
+		yield[i].countdown = 1;
+	}
+	return yield;
+}
+
+void instrument_report(const char *source, instrument_record *records)
+{
+	instrument_site_info *site;
+	uint64_t most;
+	size_t i, bucket, first, last;
+	char name[256];
+
+	/* The hooks of a library keep their own statistics. */
+	if (instrument_mode == INSTRUMENT_HOOKS && instrument_hooks) {
+		free(records);
+		return;
+	}
+	fprintf(stderr, "latency of the statements of %s", source);
+	if (instrument_sample > 1) fprintf(stderr, ", one call in %lu timed", (unsigned long)instrument_sample);
+	fprintf(stderr, ":\n");
+	for (i = 0; i < s_count; i++) {
+		site = &s_sites[i];
+		if (instrument_mode == INSTRUMENT_RDTSC) {
+			site->calls = records[i].calls;
+			site->cycles = records[i].cycles;
+		}
+		if (!site->calls) continue;
+		sprintf(name, "%.200s:%lu:%lu", source, (unsigned long)site->line, (unsigned long)site->col);
+		fprintf(stderr, "  %-32s %10lu calls %12.1f cycles on average\n", name,
+			(unsigned long)site->calls, (double)site->cycles / site->calls);
+		if (instrument_mode != INSTRUMENT_HOOKS) continue;
+
+		/* The histogram, from the first bucket used to the last */
+		most = 0;
+		first = INSTRUMENT_BUCKETS;
+		last = 0;
+		for (bucket = 0; bucket < INSTRUMENT_BUCKETS; bucket++) {
+			if (!site->histogram[bucket]) continue;
+			if (site->histogram[bucket] > most) most = site->histogram[bucket];
+			if (first == INSTRUMENT_BUCKETS) first = bucket;
+			last = bucket;
+		}
+		for (bucket = first; bucket <= last; bucket++) {
+			fprintf(stderr, "    %12lu cycles or more %10lu %.*s\n", bucket ? (unsigned long)1 << bucket : 0UL,
+				(unsigned long)site->histogram[bucket], (int)(40 * site->histogram[bucket] / most), "########################################");
+		}
+	}
+	free(records);
+}
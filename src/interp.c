@@ -0,0 +1,412 @@
+/*
+	Bytecode interpreter for ECK (--interpret)
+
+	Short scripts spend more time being assembled and linked than
+	running. The interpreter lowers the statement trees into a
+	compact register bytecode instead, and runs it right away.
+
+	Registers are 64 bits, of which only the bytes of the type of
+	their value are meaningful. The operators that look at the
+	upper bytes (division, comparisons, >>, the tests) extend their
+	operands from the size of the operation first, and an operand
+	of a narrower type is extended before a wider operation. They
+	compute like eval, the constant folder, and the generated code:
+	signed but for >> of an unsigned type, at the size of the
+	operation. The last expression statement executed is kept as
+	the result, truncated to its type then extended to 64 bits.
+
+	Registers are numbered like a stack: an expression computed in
+	register n uses the registers above n for its operands.
+
+	With GCC, the instructions are dispatched with computed goto,
+	each handler jumping to the next one directly. Otherwise (or
+	with ECK_SWITCH_DISPATCH defined), a switch is used.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(ECK_SWITCH_DISPATCH)
+	#define ECK_COMPUTED_GOTO
+#endif
+
+typedef enum bc_op
+{
+	BC_CONST,
+	BC_ADD, BC_SUB, BC_MUL, BC_DIV, BC_MOD, BC_AND, BC_OR, BC_XOR, BC_SHL, BC_SHR, BC_SAR,
+	BC_LT, BC_LE, BC_GT, BC_GE, BC_EQ, BC_NE, BC_LAND, BC_LOR,
+	BC_NOT, BC_LNOT, BC_NEG, BC_ZEXT, BC_SEXT,
+	BC_JUMP, BC_JZ, BC_JNZ,
+	BC_RESULT, BC_RESULT_SIGNED,
+	BC_HALT,
+	BC_COUNT
+} bc_op;
+
+/* An instruction: a = b op c, or a = value. */
+typedef struct bc_insn
+{
+	uint8_t op;     /* BC_* */
+	uint8_t size;   /* The size of the operation or of the value tested, in bytes. */
+	uint16_t a;     /* The destination register. */
+	uint16_t b;     /* The first operand. */
+	uint16_t c;     /* The second operand. */
+	uint64_t value; /* A constant, or the index of the instruction to jump to. */
+} bc_insn;
+
+/* The program being lowered. */
+static bc_insn *s_code = NULL;
+static size_t s_count = 0, s_max = 0;
+static size_t s_registers = 0; /* The number of registers the program uses. */
+
+static size_t s_insn(bc_op op, size_t a, size_t b, size_t c, uint64_t value)
+{
+	bc_insn *item;
+	if (s_count == s_max) {
+		s_max = s_max ? s_max * 2 : 1024;
+		s_code = realloc(s_code, sizeof(bc_insn) * s_max);
+	}
+	if (a >= 0xFFFF || b >= 0xFFFF || c >= 0xFFFF) {
+		dfatal("expression too deep to be interpreted");
+	}
+	item = &s_code[s_count];
+	item->op = (uint8_t)op;
+	item->size = 0;
+	item->a = (uint16_t)a;
+	item->b = (uint16_t)b;
+	item->c = (uint16_t)c;
+	item->value = value;
+	if (a + 1 > s_registers) s_registers = a + 1;
+	return s_count++;
+}
+
+/* Makes a jump go to the next instruction. */
+static void s_here(size_t jump)
+{
+	s_code[jump].value = s_count;
+}
+
+static bc_op s_binary(expression_kind kind)
+{
+	switch (kind) {
+		case EXPRESSION_ADDITION: return BC_ADD;
+		case EXPRESSION_SUBTRACTION: return BC_SUB;
+		case EXPRESSION_MULTIPLY: return BC_MUL;
+		case EXPRESSION_DIVISION: return BC_DIV;
+		case EXPRESSION_MODULO: return BC_MOD;
+		case EXPRESSION_BITWISE_AND: return BC_AND;
+		case EXPRESSION_BITWISE_OR: return BC_OR;
+		case EXPRESSION_BITWISE_XOR: return BC_XOR;
+		case EXPRESSION_LSHIFT: return BC_SHL;
+		case EXPRESSION_RSHIFT: return BC_SHR;
+		case EXPRESSION_LOWER: return BC_LT;
+		case EXPRESSION_LOWER_OR_EQUAL: return BC_LE;
+		case EXPRESSION_GREATER: return BC_GT;
+		case EXPRESSION_GREATER_OR_EQUAL: return BC_GE;
+		case EXPRESSION_EQUAL: return BC_EQ;
+		case EXPRESSION_NOT_EQUAL: return BC_NE;
+		case EXPRESSION_LOGICAL_AND: return BC_LAND;
+		case EXPRESSION_LOGICAL_OR: return BC_LOR;
+		default: return BC_COUNT;
+	}
+}
+
+static void s_expression(expression *tree, size_t r);
+
+/* Lowers the operand of an operation of size bytes, extended if its type is narrower. */
+static void s_operand(expression *tree, size_t r, size_t size)
+{
+	size_t width = rsizeof(&tree->type), extend;
+	s_expression(tree, r);
+	if (width && width < size) {
+		extend = s_insn(is_unsigned(&tree->type) ? BC_ZEXT : BC_SEXT, r, r, 0, 0);
+		s_code[extend].size = (uint8_t)width;
+	}
+}
+
+/* Lowers an expression, computing it in register r. */
+static void s_expression(expression *tree, size_t r)
+{
+	size_t jump, end, item, size = rsizeof(&tree->type);
+	bc_op op;
+
+	switch (tree->kind) {
+		case EXPRESSION_INTEGER_LITERAL:
+		case EXPRESSION_FLOATING_LITERAL:
+			s_insn(BC_CONST, r, 0, 0, tree->token.value.u64);
+			return;
+
+		case EXPRESSION_BOOLEAN_LITERAL:
+			s_insn(BC_CONST, r, 0, 0, tree->token.kind == KEYWORD_TRUE);
+			return;
+
+		case EXPRESSION_TERNARY_CONDITIONAL:
+			s_expression(tree->extra, r);
+			jump = s_insn(BC_JZ, 0, r, 0, 0);
+			s_code[jump].size = (uint8_t)rsizeof(&tree->extra->type);
+			s_operand(tree->left, r, size);
+			end = s_insn(BC_JUMP, 0, 0, 0, 0);
+			s_here(jump);
+			s_operand(tree->right, r, size);
+			s_here(end);
+			return;
+
+		case EXPRESSION_POSTFIX_UNARY_PLUS:
+			s_expression(tree->left, r);
+			return;
+
+		case EXPRESSION_POSTFIX_UNARY_MINUS:
+		case EXPRESSION_POSTFIX_BITWISE_NOT:
+		case EXPRESSION_POSTFIX_LOGICAL_NOT:
+			s_expression(tree->left, r);
+			item = s_insn(tree->kind == EXPRESSION_POSTFIX_UNARY_MINUS ? BC_NEG
+				: tree->kind == EXPRESSION_POSTFIX_BITWISE_NOT ? BC_NOT : BC_LNOT, r, r, 0, 0);
+			s_code[item].size = (uint8_t)size;
+			return;
+
+		default:
+			if (!is_binary(tree) || s_binary(tree->kind) == BC_COUNT) {
+				dfatal("unsupported expression");
+			}
+			s_operand(tree->left, r, size);
+			s_operand(tree->right, r + 1, size);
+			op = s_binary(tree->kind);
+			if (op == BC_SHR && !is_unsigned(&tree->type)) op = BC_SAR;
+			item = s_insn(op, r, r, r + 1, 0);
+			s_code[item].size = (uint8_t)size;
+			return;
+	}
+}
+
+static void s_statement(statement_tree *tree)
+{
+	size_t jump, end, top, result, i;
+
+	if (!tree) return;
+	switch (tree->kind) {
+		case STATEMENT_EXPRESSION:
+			s_expression(tree->condition, 1);
+			if (!rsizeof(&tree->condition->type)) return;
+			result = s_insn(is_unsigned(&tree->condition->type) ? BC_RESULT : BC_RESULT_SIGNED, 0, 1, 0, 0);
+			s_code[result].size = (uint8_t)rsizeof(&tree->condition->type);
+			return;
+
+		case STATEMENT_BLOCK:
+			for (i = 0; i < tree->childcount; i++) {
+				s_statement(tree->children[i]);
+			}
+			return;
+
+		case STATEMENT_IF:
+			s_expression(tree->condition, 1);
+			jump = s_insn(BC_JZ, 0, 1, 0, 0);
+			s_code[jump].size = (uint8_t)rsizeof(&tree->condition->type);
+			s_statement(tree->body);
+			if (tree->has_else) {
+				end = s_insn(BC_JUMP, 0, 0, 0, 0);
+				s_here(jump);
+				s_statement(tree->otherwise);
+				s_here(end);
+			} else {
+				s_here(jump);
+			}
+			return;
+
+		case STATEMENT_WHILE:
+			top = s_count;
+			s_expression(tree->condition, 1);
+			jump = s_insn(BC_JZ, 0, 1, 0, 0);
+			s_code[jump].size = (uint8_t)rsizeof(&tree->condition->type);
+			s_statement(tree->body);
+			s_insn(BC_JUMP, 0, 0, 0, top);
+			s_here(jump);
+			return;
+
+		case STATEMENT_DO:
+			top = s_count;
+			s_statement(tree->body);
+			s_expression(tree->condition, 1);
+			jump = s_insn(BC_JNZ, 0, 1, 0, top);
+			s_code[jump].size = (uint8_t)rsizeof(&tree->condition->type);
+			return;
+	}
+}
+
+/* The bytes and the sign bit of each size, to extend a value from its size. */
+static const uint64_t s_masks[9] = {
+	~(uint64_t)0, 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF, 0xFFFFFFFFFF, 0xFFFFFFFFFFFF, 0xFFFFFFFFFFFFFF, ~(uint64_t)0
+};
+static const uint64_t s_signs[9] = {
+	(uint64_t)1 << 63, 0x80, 0x8000, 0x800000, 0x80000000, 0x8000000000, 0x800000000000, 0x80000000000000, (uint64_t)1 << 63
+};
+
+/* Runs the program. Register 0 holds the result. */
+static uint64_t s_run(const bc_insn *code, uint64_t *r)
+{
+	const bc_insn *pc = code;
+	int64_t x, y;
+
+	/* A value extended from the size of the instruction, and the count of a shift at that size. */
+	#define ZX(v) ((v) & s_masks[pc->size])
+	#define SX(v) ((ZX(v) ^ s_signs[pc->size]) - s_signs[pc->size])
+	#define COUNT(v) ((v) & (pc->size == 8 ? 63 : 31))
+
+#ifdef ECK_COMPUTED_GOTO
+	/* Labels as values are a GNU extension. */
+	#pragma GCC diagnostic push
+	#pragma GCC diagnostic ignored "-Wpedantic"
+	static const void *const dispatch[BC_COUNT] = {
+		&&l_BC_CONST,
+		&&l_BC_ADD, &&l_BC_SUB, &&l_BC_MUL, &&l_BC_DIV, &&l_BC_MOD, &&l_BC_AND, &&l_BC_OR, &&l_BC_XOR, &&l_BC_SHL, &&l_BC_SHR, &&l_BC_SAR,
+		&&l_BC_LT, &&l_BC_LE, &&l_BC_GT, &&l_BC_GE, &&l_BC_EQ, &&l_BC_NE, &&l_BC_LAND, &&l_BC_LOR,
+		&&l_BC_NOT, &&l_BC_LNOT, &&l_BC_NEG, &&l_BC_ZEXT, &&l_BC_SEXT,
+		&&l_BC_JUMP, &&l_BC_JZ, &&l_BC_JNZ,
+		&&l_BC_RESULT, &&l_BC_RESULT_SIGNED,
+		&&l_BC_HALT
+	};
+	#define CASE(op) l_##op:
+	#define DISPATCH() goto *dispatch[pc->op]
+	#define NEXT() pc++; DISPATCH()
+	#define JUMP(i) pc = code + (i); DISPATCH()
+	DISPATCH();
+#else
+	#define CASE(op) case op:
+	#define NEXT() pc++; continue
+	#define JUMP(i) pc = code + (i); continue
+	for (;;) switch ((bc_op)pc->op) {
+#endif
+
+	CASE(BC_CONST) r[pc->a] = pc->value; NEXT();
+	CASE(BC_ADD)   r[pc->a] = r[pc->b] + r[pc->c]; NEXT();
+	CASE(BC_SUB)   r[pc->a] = r[pc->b] - r[pc->c]; NEXT();
+	CASE(BC_MUL)   r[pc->a] = r[pc->b] * r[pc->c]; NEXT();
+	CASE(BC_DIV)
+	CASE(BC_MOD)
+		x = (int64_t)SX(r[pc->b]);
+		y = (int64_t)SX(r[pc->c]);
+		if (!y) dfatal("division by zero");
+		/* The lowest value by -1 overflows, and traps like the generated code. */
+		if (y == -1 && x && SX(0 - (uint64_t)x) == (uint64_t)x) dfatal("division overflow");
+		r[pc->a] = pc->op == BC_DIV ? (uint64_t)(x / y) : (uint64_t)(x % y);
+		NEXT();
+	CASE(BC_AND)   r[pc->a] = r[pc->b] & r[pc->c]; NEXT();
+	CASE(BC_OR)    r[pc->a] = r[pc->b] | r[pc->c]; NEXT();
+	CASE(BC_XOR)   r[pc->a] = r[pc->b] ^ r[pc->c]; NEXT();
+	CASE(BC_SHL)   r[pc->a] = r[pc->b] << COUNT(r[pc->c]); NEXT();
+	CASE(BC_SHR)   r[pc->a] = ZX(r[pc->b]) >> COUNT(r[pc->c]); NEXT();
+	CASE(BC_SAR)   r[pc->a] = (uint64_t)((int64_t)SX(r[pc->b]) >> COUNT(r[pc->c])); NEXT();
+	CASE(BC_LT)    r[pc->a] = (int64_t)SX(r[pc->b]) < (int64_t)SX(r[pc->c]); NEXT();
+	CASE(BC_LE)    r[pc->a] = (int64_t)SX(r[pc->b]) <= (int64_t)SX(r[pc->c]); NEXT();
+	CASE(BC_GT)    r[pc->a] = (int64_t)SX(r[pc->b]) > (int64_t)SX(r[pc->c]); NEXT();
+	CASE(BC_GE)    r[pc->a] = (int64_t)SX(r[pc->b]) >= (int64_t)SX(r[pc->c]); NEXT();
+	CASE(BC_EQ)    r[pc->a] = ZX(r[pc->b]) == ZX(r[pc->c]); NEXT();
+	CASE(BC_NE)    r[pc->a] = ZX(r[pc->b]) != ZX(r[pc->c]); NEXT();
+	CASE(BC_LAND)  r[pc->a] = ZX(r[pc->b]) && ZX(r[pc->c]); NEXT();
+	CASE(BC_LOR)   r[pc->a] = ZX(r[pc->b]) || ZX(r[pc->c]); NEXT();
+	CASE(BC_NOT)   r[pc->a] = ~r[pc->b]; NEXT();
+	CASE(BC_LNOT)  r[pc->a] = !ZX(r[pc->b]); NEXT();
+	CASE(BC_NEG)   r[pc->a] = 0 - r[pc->b]; NEXT();
+	CASE(BC_ZEXT)  r[pc->a] = ZX(r[pc->b]); NEXT();
+	CASE(BC_SEXT)  r[pc->a] = SX(r[pc->b]); NEXT();
+	CASE(BC_JUMP)  JUMP(pc->value);
+	CASE(BC_JZ)
+		if (!ZX(r[pc->b])) { JUMP(pc->value); }
+		NEXT();
+	CASE(BC_JNZ)
+		if (ZX(r[pc->b])) { JUMP(pc->value); }
+		NEXT();
+	CASE(BC_RESULT)        r[0] = ZX(r[pc->b]); NEXT();
+	CASE(BC_RESULT_SIGNED) r[0] = SX(r[pc->b]); NEXT();
+	CASE(BC_HALT)  return r[0];
+
+#ifdef ECK_COMPUTED_GOTO
+	#pragma GCC diagnostic pop
+#else
+		default: dfatal("invalid instruction");
+	}
+#endif
+	#undef ZX
+	#undef SX
+	#undef COUNT
+	#undef CASE
+	#undef NEXT
+	#undef JUMP
+	#undef DISPATCH
+	return r[0];
+}
+
+bool_t run_interpreted(const char *source, run_timing *timing)
+{
+	FILE *sfile;
+	lex_token token;
+	statement_tree *tree;
+	uint64_t *registers;
+	double start;
+
+	sfile = fopen(source, "r");
+	if (!sfile) {
+		dfatal("cannot open '%s'", source);
+	}
+	start = clock_seconds();
+	compile_begin(sfile, NULL);
+	diag_source = source;
+	s_count = 0;
+	s_registers = 1;
+
+	/* 1. Lowering the statements as they are parsed */
+	memset(&token, 0, sizeof(lex_token));
+	while (lex_peek(&token)) {
+		tree = parse_toplevel();
+		if (tree && is_clean()) s_statement(tree);
+		delete_statement(tree);
+	}
+	s_insn(BC_HALT, 0, 0, 0, 0);
+	if (pass_report) pass_print(source);
+	if (print_after) pass_flush(source);
+	fclose(sfile);
+	diag_flush();
+	if (!is_clean()) {
+		return FALSE;
+	}
+	timing->size = s_count;
+	timing->compile = clock_seconds() - start;
+
+	/* 2. Running it */
+	start = clock_seconds();
+	registers = calloc(s_registers, sizeof(uint64_t));
+	timing->result = s_run(s_code, registers);
+	timing->run = clock_seconds() - start;
+	free(registers);
+	return TRUE;
+}
+
+bool_t run_bench(const char *source, int repeats)
+{
+	static const char *const names[2] = { "native", "interpreted" };
+	run_timing timing, best[2];
+	int i, way;
+
+	/* The fastest of the runs, as the others were disturbed. */
+	for (way = 0; way < 2; way++) {
+		for (i = 0; i < repeats; i++) {
+			if (!(way ? run_interpreted : run_native)(source, &timing)) {
+				return FALSE;
+			}
+			if (!i || timing.compile + timing.run < best[way].compile + best[way].run) {
+				best[way] = timing;
+			}
+		}
+	}
+
+	printf("%-12s %10s %12s %12s %14s %s\n", "", "size", "compile ms", "run ms", "first result", "result");
+	for (way = 0; way < 2; way++) {
+		printf("%-12s %10lu %12.3f %12.3f %14.3f %ld\n", names[way], (unsigned long)best[way].size,
+			best[way].compile * 1e3, best[way].run * 1e3,
+			(best[way].compile + best[way].run) * 1e3, (long)best[way].result);
+	}
+	if (best[0].result != best[1].result) {
+		fprintf(stderr, "run-bench: the results differ\n");
+		return FALSE;
+	}
+	return TRUE;
+}
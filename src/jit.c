@@ -0,0 +1,222 @@
+/*
+	In-process execution for ECK (--run)
+
+	The source is encoded to machine code in memory (encode.c),
+	copied to an executable mapping and called right away, with no
+	assembler, linker or temporary file involved.
+
+	The code is wrapped in a function. The registers the System V
+	ABI asks to preserve are saved around it, and rax starts at
+	zero then holds the value of the last expression statement
+	executed (gen_result), which is the result of the function.
+
+	--interpret runs the source with the interpreter (interp.c)
+	instead, and prints the same way.
+
+	With -fprofile-generate, the function takes the counters of the
+	profile (profile.c) as its argument, which leaves them in rdi.
+
+	With -finstrument-functions, the records of the statements timed
+	(instrument.c) are the second argument, in rsi.
+
+	With -fperf-map, the code of each statement is named after its
+	site in /tmp/perf-PID.map, where perf finds the symbols of JIT
+	code, as eck:source:line:column. perf2eck.py turns the samples of
+	perf record into a sample profile for -fprofile-sample-use.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* rbx, rbp and r12 to r15, which the called code does not preserve. */
+static const int s_saved[6] = { 3, 5, 12, 13, 14, 15 };
+
+static int s_by_position(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a, r = *(const uint64_t *)b;
+	return l < r ? -1 : (l > r);
+}
+
+/* Locates the statements of the line table. The source must still be open for the lexer. */
+static void s_locate(mc_line *lines, size_t count, size_t *rows, size_t *cols)
+{
+	uint64_t *positions, *found;
+	size_t *sorted_rows, *sorted_cols, unique = 0, i;
+
+	positions = malloc(sizeof(uint64_t) * (count + 1));
+	for (i = 0; i < count; i++) {
+		positions[i] = lines[i].pos;
+	}
+	qsort(positions, count, sizeof(uint64_t), s_by_position);
+	/* The code outside of any statement is last, being marked all ones. */
+	for (i = 0; i < count && positions[i] != (uint64_t)-1; i++) {
+		if (!unique || positions[unique - 1] != positions[i]) positions[unique++] = positions[i];
+	}
+	sorted_rows = malloc(sizeof(size_t) * (unique + 1));
+	sorted_cols = malloc(sizeof(size_t) * (unique + 1));
+	lex_sites(positions, unique, sorted_rows, sorted_cols);
+	for (i = 0; i < count; i++) {
+		found = bsearch(&lines[i].pos, positions, unique, sizeof(uint64_t), s_by_position);
+		rows[i] = found ? sorted_rows[found - positions] : 0;
+		cols[i] = found ? sorted_cols[found - positions] : 0;
+	}
+	free(positions);
+	free(sorted_rows);
+	free(sorted_cols);
+}
+
+/* Writes the perf map of the code: a symbol per range of code of the same statement. */
+static void s_perf_map(const char *source, const uint8_t *memory, size_t length, mc_line *lines, size_t count, size_t *rows, size_t *cols)
+{
+	char path[64];
+	size_t i, end;
+	FILE *out;
+
+	sprintf(path, "/tmp/perf-%ld.map", (long)getpid());
+	out = fopen(path, "w");
+	if (!out) {
+		fprintf(stderr, "%s: cannot write the perf map\n", path);
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		end = i + 1 < count ? lines[i + 1].address : length;
+		/* The code outside of any statement (the wrapper) is not named. */
+		if (lines[i].pos == (uint64_t)-1 || end == lines[i].address) continue;
+		fprintf(out, "%lx %lx eck:%s:%lu:%lu\n", (unsigned long)(memory + lines[i].address),
+			(unsigned long)(end - lines[i].address), source, (unsigned long)rows[i], (unsigned long)cols[i]);
+	}
+	fclose(out);
+}
+
+bool_t run_native(const char *source, run_timing *timing)
+{
+	FILE *sfile;
+	lex_token token;
+	emit_buffer code;
+	uint8_t *text;
+	void *memory;
+	uint64_t (*entry)(uint64_t *counters, instrument_record *records), *counters = NULL;
+	instrument_record *records = NULL;
+	mc_line *lines = NULL;
+	size_t length, i, count = 0, *rows = NULL, *cols = NULL;
+	double start;
+
+	sfile = fopen(source, "r");
+	if (!sfile) {
+		dfatal("cannot open '%s'", source);
+	}
+	start = clock_seconds();
+	if (profile_use) profile_load(source);
+	profile_reset();
+	instrument_reset();
+	compile_begin(sfile, NULL);
+	diag_source = source;
+	memset(&code, 0, sizeof(code));
+	code.mc = mc_new();
+	asm_target = &code;
+	gen_line_table = perf_map;
+
+	/* 1. Compiling the source as the body of a function */
+	for (i = 0; i < 6; i++) {
+		emit(INSN_PUSH, oreg(s_saved[i], 8), onone(), NULL);
+	}
+	emit(INSN_XOR, oreg(REG_RAX, 4), oreg(REG_RAX, 4), NULL);
+	gen_result = TRUE;
+	memset(&token, 0, sizeof(lex_token));
+	while (lex_peek(&token)) {
+		rreset();
+		toplevel();
+	}
+	gen_result = FALSE;
+	for (i = 6; i-- > 0;) {
+		emit(INSN_POP, oreg(s_saved[i], 8), onone(), NULL);
+	}
+	emit(INSN_RET, onone(), onone(), NULL);
+	gen_line_table = FALSE;
+	diag_flush();
+	if (!is_clean()) {
+		fclose(sfile);
+		emit_free(&code);
+		return FALSE;
+	}
+	length = mc_link(code.mc, &text);
+	if (perf_map) {
+		count = mc_lines(code.mc, &lines);
+		rows = malloc(sizeof(size_t) * (count + 1));
+		cols = malloc(sizeof(size_t) * (count + 1));
+		s_locate(lines, count, rows, cols);
+	}
+	if (instrument_mode) instrument_locate();
+	if (cost_report) cost_print(source);
+	if (pass_report) pass_print(source);
+	if (print_after) pass_flush(source);
+	fclose(sfile);
+	emit_free(&code);
+
+	/* 2. Moving the code to executable memory */
+	memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		dfatal("cannot map %lu bytes of code", (unsigned long)length);
+	}
+	memcpy(memory, text, length);
+	free(text);
+	if (mprotect(memory, length, PROT_READ | PROT_EXEC) != 0) {
+		dfatal("cannot make the code executable");
+	}
+	if (perf_map) {
+		s_perf_map(source, memory, length, lines, count, rows, cols);
+		free(lines);
+		free(rows);
+		free(cols);
+	}
+	/* ISO C has no conversion from a data pointer to a function pointer. */
+	memcpy(&entry, &memory, sizeof(entry));
+	timing->size = length;
+	timing->compile = clock_seconds() - start;
+
+	/* 3. Running it */
+	if (profile_generate) counters = calloc(profile_counters() + 1, sizeof(uint64_t));
+	if (instrument_mode) records = instrument_records();
+	start = clock_seconds();
+	timing->result = entry(counters, records);
+	timing->run = clock_seconds() - start;
+	munmap(memory, length);
+	if (records) instrument_report(source, records);
+	if (counters) {
+		profile_write(source, counters);
+		free(counters);
+	}
+	return TRUE;
+}
+
+#else
+
+bool_t run_native(const char *source, run_timing *timing)
+{
+	(void)source;
+	(void)timing;
+	dfatal("--run is only supported on x86-64");
+	return FALSE;
+}
+
+#endif
+
+bool_t compile_run(const char *source, bool_t interpreted)
+{
+	run_timing timing;
+	if (!(interpreted ? run_interpreted : run_native)(source, &timing)) {
+		return FALSE;
+	}
+	printf("%ld\n", (long)timing.result);
+	fflush(stdout);
+	fprintf(stderr, "%s: %lu %s, compiled in %.3f ms, ran in %.3f ms\n",
+		interpreted ? "interpret" : "run", (unsigned long)timing.size,
+		interpreted ? "instructions" : "bytes", timing.compile * 1e3, timing.run * 1e3);
+	return TRUE;
+}
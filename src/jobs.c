@@ -0,0 +1,190 @@
+/*
+	Worker pool for the driver
+
+	Most of the compiler keeps its state in globals, so
+	objects are compiled in forked worker processes. The
+	diagnostics of each worker are written to a temporary
+	file and copied to stderr once all of the previous
+	sources are done, which keeps the output grouped and
+	in the order of the command line.
+
+	A worker that dies (abort, crash) stops the pool like
+	it would stop a sequential compilation: no source after
+	it is compiled, and once the sources before it are done,
+	eck dies of the same signal, or exits with the same
+	status.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <signal.h>
+	#include <sys/types.h>
+	#include <sys/wait.h>
+#endif
+
+/* Compiles a single source, as done by a worker. */
+static bool_t s_compile_one(const char *source)
+{
+	bool_t status;
+	char *output = object_name(source);
+	if (server_path) {
+		status = compile_remote(source, output);
+	} else {
+		status = compile_object(source, output);
+	}
+	free(output);
+	return status;
+}
+
+static bool_t s_compile_sequential(char **sources, size_t count)
+{
+	size_t i;
+	bool_t yield = TRUE;
+	for (i = 0; i < count; i++) {
+		if (!s_compile_one(sources[i])) {
+			yield = FALSE;
+		}
+	}
+	return yield;
+}
+
+#ifndef _WIN32
+
+/* A single job of the pool. */
+typedef struct job
+{
+	pid_t pid;   /* The worker compiling this job. 0 if not started. */
+	FILE *log;   /* The diagnostics written by the worker. */
+	bool_t done; /* Whether the worker has exited. */
+	bool_t ok;   /* Whether the compilation succeeded. */
+	int status;  /* The exit status of the worker, if it is not 0 or 1. */
+	int signal;  /* The signal that killed the worker, 0 if none. */
+} job;
+
+/* Copies the diagnostics of a job to stderr. */
+static void s_flush_log(job *j)
+{
+	char buffer[4096];
+	size_t n;
+	if (!j->log) return;
+	rewind(j->log);
+	while ((n = fread(buffer, 1, sizeof(buffer), j->log)) != 0) {
+		DISCARD(fwrite(buffer, 1, n, stderr));
+	}
+	fclose(j->log);
+	j->log = NULL;
+}
+
+/* Starts a worker. Falls back to compiling in-process if that is impossible. */
+static void s_spawn(job *j, const char *source)
+{
+	j->log = tmpfile();
+	/* Nothing buffered must be written twice. */
+	fflush(stdout);
+	fflush(stderr);
+	j->pid = j->log ? fork() : -1;
+
+	if (j->pid == 0) {
+		dup2(fileno(j->log), 2);
+		fflush(NULL);
+		_exit(s_compile_one(source) ? 0 : 1);
+	}
+
+	if (j->pid < 0) {
+		if (j->log) fclose(j->log);
+		j->log = NULL;
+		j->pid = 0;
+		j->ok = s_compile_one(source);
+		j->done = TRUE;
+	}
+}
+
+/* Dies like a worker that died. */
+static void s_die(job *j)
+{
+	fflush(NULL);
+	if (j->signal) {
+		signal(j->signal, SIG_DFL);
+		raise(j->signal);
+	}
+	exit(j->status ? j->status : 1);
+}
+
+bool_t compile_objects(char **sources, size_t count, int jobs)
+{
+	job *pool;
+	size_t next = 0, flushed = 0, died = count, i, k;
+	int running = 0, status;
+	pid_t pid;
+	bool_t yield = TRUE;
+
+	if (jobs <= 1 || count <= 1) {
+		return s_compile_sequential(sources, count);
+	}
+
+	pool = calloc(count, sizeof(job));
+	while (flushed < count) {
+		/* 1. Keeping all of the workers busy, until one dies */
+		while (running < jobs && next < count && died == count) {
+			s_spawn(&pool[next], sources[next]);
+			if (!pool[next].done) {
+				running++;
+			}
+			next++;
+		}
+
+		/* 2. Waiting for any worker to exit */
+		if (running) {
+			pid = waitpid(-1, &status, 0);
+			if (pid < 0) {
+				dfatal("lost track of the compilation workers");
+			}
+			for (i = 0; i < next; i++) {
+				if (pool[i].pid == pid && !pool[i].done) {
+					pool[i].done = TRUE;
+					pool[i].ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+					if (WIFSIGNALED(status)) pool[i].signal = WTERMSIG(status);
+					else if (WEXITSTATUS(status) > 1) pool[i].status = WEXITSTATUS(status);
+					running--;
+					/* The sources after the first one that died would not have been compiled. */
+					if ((pool[i].signal || pool[i].status) && i < died) {
+						died = i;
+						for (k = i + 1; k < next; k++) {
+							if (!pool[k].done) kill(pool[k].pid, SIGKILL);
+						}
+					}
+					break;
+				}
+			}
+		}
+
+		/* 3. Printing the diagnostics of the sources that are done, in order */
+		while (flushed < count && pool[flushed].done) {
+			s_flush_log(&pool[flushed]);
+			if (flushed == died) {
+				s_die(&pool[flushed]);
+			}
+			if (!pool[flushed].ok) {
+				yield = FALSE;
+			}
+			flushed++;
+		}
+	}
+
+	free(pool);
+	return yield;
+}
+
+#else
+
+bool_t compile_objects(char **sources, size_t count, int jobs)
+{
+	(void)jobs;
+	return s_compile_sequential(sources, count);
+}
+
+#endif
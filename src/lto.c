@@ -0,0 +1,374 @@
+/*
+	Link-time optimization for ECK
+
+	With -flto, a source is not generated: its statement trees are
+	written to the output (<source>.lto) in a flat, versioned form.
+	eck --lto-link OUTPUT a.fd.lto b.fd.lto ... then maps every unit,
+	optimizes the whole program at once and writes a single assembly
+	file (or object, with -c).
+
+	Layout (native byte order, checked through the header):
+	  lto_header
+	  lto_expression [expression_count]
+	  lto_statement  [statement_count]
+	  uint32_t       [child_count]     (the statements of the blocks)
+	  uint32_t       [root_count]      (the top-level statements)
+	Nodes are written after the nodes they refer to, so a reference
+	is always to a lower index, which also rules out cycles. A
+	reference is the index plus one, 0 meaning none.
+
+	The program has no functions yet, so the whole-program passes are
+	the ones of passes.c, at -O2 unless another level is given:
+	constant propagation (folding with eval, across every unit) and
+	dead code removal, branches and loops whose condition is known
+	being replaced by what they run. Labels are numbered once for the
+	whole program.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LTO_MAGIC      "FDL"
+#define LTO_VERSION    1
+#define LTO_BYTE_ORDER 0x01020304
+
+bool_t lto = FALSE;
+
+typedef struct lto_header
+{
+	char     magic[4];         /* LTO_MAGIC */
+	uint32_t version;          /* LTO_VERSION */
+	uint32_t byte_order;       /* LTO_BYTE_ORDER, as written by the host */
+	uint32_t expression_count; /* The number of expressions. */
+	uint32_t statement_count;  /* The number of statements. */
+	uint32_t child_count;      /* The number of statements in blocks. */
+	uint32_t root_count;       /* The number of top-level statements. */
+	uint32_t reserved;         /* Always zero. */
+} lto_header;
+
+typedef struct lto_expression
+{
+	uint8_t  kind;       /* The kind of the expression. */
+	uint8_t  type;       /* The kind of its type. */
+	uint8_t  qualifiers; /* The qualifiers of its type. */
+	uint8_t  reserved;   /* Always zero. */
+	uint32_t token;      /* The kind of its token. */
+	uint32_t left;       /* References to the operands. */
+	uint32_t right;
+	uint32_t extra;
+	uint32_t pad;        /* Always zero. */
+	uint64_t value;      /* The value of its token. */
+} lto_expression;
+
+typedef struct lto_statement
+{
+	uint8_t  kind;       /* The kind of the statement. */
+	uint8_t  has_else;   /* Whether an if statement has an else branch. */
+	uint16_t reserved;   /* Always zero. */
+	uint32_t frame;      /* The stack space of a block. */
+	uint32_t condition;  /* A reference to an expression. */
+	uint32_t body;       /* References to statements. */
+	uint32_t otherwise;
+	uint32_t children;   /* The index of the first child in the child table. */
+	uint32_t childcount; /* The number of children. */
+	uint32_t pad;        /* Always zero. */
+} lto_statement;
+
+/* The unit being written. */
+typedef struct lto_writer
+{
+	lto_expression *expressions;
+	size_t expression_count, expression_max;
+	lto_statement *statements;
+	size_t statement_count, statement_max;
+	uint32_t *children;
+	size_t child_count, child_max;
+	uint32_t *roots;
+	size_t root_count, root_max;
+} lto_writer;
+
+/* Makes room for one more item in an array. */
+static void *s_grow(void *array, size_t count, size_t *max, size_t size)
+{
+	if (count < *max) return array;
+	*max = *max ? *max * 2 : 256;
+	return realloc(array, size * *max);
+}
+
+static uint32_t s_put_expression(lto_writer *w, expression *e)
+{
+	lto_expression node;
+	if (!e) return 0;
+
+	memset(&node, 0, sizeof(node));
+	node.left = s_put_expression(w, e->left);
+	node.right = s_put_expression(w, e->right);
+	node.extra = s_put_expression(w, e->extra);
+	node.kind = (uint8_t)e->kind;
+	node.type = e->type.kind;
+	node.qualifiers = e->type.qualifiers;
+	node.token = (uint32_t)e->token.kind;
+	node.value = e->token.value.u64;
+
+	w->expressions = s_grow(w->expressions, w->expression_count, &w->expression_max, sizeof(lto_expression));
+	w->expressions[w->expression_count++] = node;
+	return (uint32_t)w->expression_count;
+}
+
+static uint32_t s_put_statement(lto_writer *w, statement_tree *tree)
+{
+	lto_statement node;
+	uint32_t *children;
+	size_t i;
+	if (!tree) return 0;
+
+	memset(&node, 0, sizeof(node));
+	node.kind = (uint8_t)tree->kind;
+	node.has_else = (uint8_t)tree->has_else;
+	node.frame = (uint32_t)tree->frame;
+	node.condition = s_put_expression(w, tree->condition);
+	node.body = s_put_statement(w, tree->body);
+	node.otherwise = s_put_statement(w, tree->otherwise);
+
+	/* The children are written first, their references are then put together. */
+	children = malloc(sizeof(uint32_t) * (tree->childcount + 1));
+	for (i = 0; i < tree->childcount; i++) {
+		children[i] = s_put_statement(w, tree->children[i]);
+	}
+	node.children = (uint32_t)w->child_count;
+	node.childcount = (uint32_t)tree->childcount;
+	for (i = 0; i < tree->childcount; i++) {
+		w->children = s_grow(w->children, w->child_count, &w->child_max, sizeof(uint32_t));
+		w->children[w->child_count++] = children[i];
+	}
+	free(children);
+
+	w->statements = s_grow(w->statements, w->statement_count, &w->statement_max, sizeof(lto_statement));
+	w->statements[w->statement_count++] = node;
+	return (uint32_t)w->statement_count;
+}
+
+bool_t compile_lto(FILE *sfile, FILE *sout)
+{
+	lto_writer w;
+	lto_header header;
+	lex_token token;
+	statement_tree *tree;
+	bool_t written = TRUE, yield;
+
+	compile_begin(sfile, sout);
+	memset(&w, 0, sizeof(w));
+	memset(&token, 0, sizeof(lex_token));
+
+	/* 1. Flattening the statements as they are parsed */
+	while (lex_peek(&token)) {
+		tree = parse_toplevel();
+		if (tree) {
+			uint32_t root = s_put_statement(&w, tree);
+			w.roots = s_grow(w.roots, w.root_count, &w.root_max, sizeof(uint32_t));
+			w.roots[w.root_count++] = root - 1;
+			delete_statement(tree);
+		}
+	}
+
+	/* 2. Writing the unit */
+	if (is_clean()) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, LTO_MAGIC, 4);
+		header.version = LTO_VERSION;
+		header.byte_order = LTO_BYTE_ORDER;
+		header.expression_count = (uint32_t)w.expression_count;
+		header.statement_count = (uint32_t)w.statement_count;
+		header.child_count = (uint32_t)w.child_count;
+		header.root_count = (uint32_t)w.root_count;
+		written = fwrite(&header, sizeof(header), 1, sout) == 1
+		       && fwrite(w.expressions, sizeof(lto_expression), w.expression_count, sout) == w.expression_count
+		       && fwrite(w.statements, sizeof(lto_statement), w.statement_count, sout) == w.statement_count
+		       && fwrite(w.children, sizeof(uint32_t), w.child_count, sout) == w.child_count
+		       && fwrite(w.roots, sizeof(uint32_t), w.root_count, sout) == w.root_count
+		       && fflush(sout) == 0;
+	}
+	free(w.expressions);
+	free(w.statements);
+	free(w.children);
+	free(w.roots);
+	yield = compile_end();
+	/* A truncated unit fails the compilation, and the driver removes it. */
+	if (!written) {
+		fprintf(stderr, "%s: cannot write the unit\n", diag_source ? diag_source : "(stdin)");
+		return FALSE;
+	}
+	return yield;
+}
+
+/* ===================== READING ===================== */
+
+/* A unit, as mapped. */
+typedef struct lto_unit
+{
+	const lto_header *header;
+	const lto_expression *expressions;
+	const lto_statement *statements;
+	const uint32_t *children;
+	const uint32_t *roots;
+} lto_unit;
+
+/* Checks that a unit is well-formed before using it. */
+static bool_t s_valid(const char *map, size_t size, lto_unit *unit)
+{
+	const lto_header *header = (const lto_header *)map;
+	size_t expected, i, j;
+
+	if (size < sizeof(lto_header)
+	 || memcmp(header->magic, LTO_MAGIC, 4)
+	 || header->version != LTO_VERSION
+	 || header->byte_order != LTO_BYTE_ORDER)
+		return FALSE;
+
+	expected = sizeof(lto_header)
+	         + (size_t)header->expression_count * sizeof(lto_expression)
+	         + (size_t)header->statement_count * sizeof(lto_statement)
+	         + ((size_t)header->child_count + header->root_count) * sizeof(uint32_t);
+	if (expected != size)
+		return FALSE;
+
+	unit->header = header;
+	unit->expressions = (const lto_expression *)(header + 1);
+	unit->statements = (const lto_statement *)(unit->expressions + header->expression_count);
+	unit->children = (const uint32_t *)(unit->statements + header->statement_count);
+	unit->roots = unit->children + header->child_count;
+
+	for (i = 0; i < header->expression_count; i++) {
+		const lto_expression *e = &unit->expressions[i];
+		if (e->left > i || e->right > i || e->extra > i)
+			return FALSE;
+	}
+	for (i = 0; i < header->statement_count; i++) {
+		const lto_statement *s = &unit->statements[i];
+		if (s->kind > STATEMENT_DO
+		 || s->condition > header->expression_count
+		 || s->body > i || s->otherwise > i
+		 || s->children > header->child_count
+		 || s->childcount > header->child_count - s->children)
+			return FALSE;
+		for (j = 0; j < s->childcount; j++) {
+			if (unit->children[s->children + j] > i || !unit->children[s->children + j])
+				return FALSE;
+		}
+	}
+	for (i = 0; i < header->root_count; i++) {
+		if (unit->roots[i] >= header->statement_count)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static expression *s_get_expression(lto_unit *unit, uint32_t reference)
+{
+	const lto_expression *node;
+	expression *yield;
+	if (!reference) return NULL;
+
+	node = &unit->expressions[reference - 1];
+	yield = calloc(1, sizeof(expression));
+	yield->kind = (expression_kind)node->kind;
+	yield->type.kind = node->type;
+	yield->type.qualifiers = node->qualifiers;
+	yield->token.kind = node->token;
+	yield->token.value.u64 = node->value;
+	yield->left = s_get_expression(unit, node->left);
+	yield->right = s_get_expression(unit, node->right);
+	yield->extra = s_get_expression(unit, node->extra);
+	return yield;
+}
+
+static statement_tree *s_get_statement(lto_unit *unit, uint32_t reference)
+{
+	const lto_statement *node;
+	statement_tree *yield;
+	size_t i;
+	if (!reference) return NULL;
+
+	node = &unit->statements[reference - 1];
+	yield = calloc(1, sizeof(statement_tree));
+	yield->kind = (statement_kind)node->kind;
+	yield->has_else = (bool_t)node->has_else;
+	yield->frame = node->frame;
+	yield->condition = s_get_expression(unit, node->condition);
+	yield->body = s_get_statement(unit, node->body);
+	yield->otherwise = s_get_statement(unit, node->otherwise);
+	yield->childcount = node->childcount;
+	yield->children = malloc(sizeof(statement_tree *) * (node->childcount + 1));
+	for (i = 0; i < node->childcount; i++) {
+		yield->children[i] = s_get_statement(unit, unit->children[node->children + i]);
+	}
+	return yield;
+}
+
+bool_t lto_link(char **units, size_t count, const char *output)
+{
+	statement_tree **roots = NULL;
+	size_t root_count = 0, root_max = 0, size, i, j;
+	lto_unit unit;
+	emit_buffer out;
+	char *map;
+	FILE *sout;
+
+	/* 1. Loading every unit */
+	for (i = 0; i < count; i++) {
+		map = map_file(units[i], &size);
+		if (!map) {
+			fprintf(stderr, "%s: cannot open the unit\n", units[i]);
+			return FALSE;
+		}
+		if (!s_valid(map, size, &unit)) {
+			fprintf(stderr, "%s: not a unit of this version of eck (-flto)\n", units[i]);
+			unmap_file(map, size);
+			return FALSE;
+		}
+		for (j = 0; j < unit.header->root_count; j++) {
+			roots = s_grow(roots, root_count, &root_max, sizeof(statement_tree *));
+			roots[root_count++] = s_get_statement(&unit, unit.roots[j] + 1);
+		}
+		unmap_file(map, size);
+	}
+
+	/* 2. Optimizing the whole program, at -O2 unless another level is given */
+	if (opt_level == OPT_DEFAULT) opt_level = OPT_O2;
+	for (i = j = 0; i < root_count; i++) {
+		statement_tree *tree = passes_run(roots[i]);
+		if (tree) roots[j++] = tree;
+	}
+	root_count = j;
+
+	/* 3. Generating it as one source */
+	reset_diags();
+	gen_reset();
+	memset(&out, 0, sizeof(out));
+	if (emit_object) out.mc = mc_new();
+	asm_target = &out;
+	for (i = 0; i < root_count; i++) {
+		rreset();
+		g_statement(roots[i]);
+		delete_statement(roots[i]);
+	}
+	free(roots);
+
+	sout = fopen(output, "w");
+	if (!sout) {
+		emit_free(&out);
+		fprintf(stderr, "%s: cannot write the output\n", output);
+		return FALSE;
+	}
+	if (out.mc) {
+		uint8_t *code;
+		size = mc_link(out.mc, &code);
+		object_write(sout, code, size, output);
+		free(code);
+	}
+	emit_flush(&out, sout);
+	fclose(sout);
+	emit_free(&out);
+	return TRUE;
+}
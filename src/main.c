@@ -1,35 +1,316 @@
 #include "common/def.h"
 #include <malloc.h>
+#include <stdlib.h>
 #include <string.h>
 
+/* The options the driver acts on, the others being globals of the compiler. */
+static int s_jobs = 1;
+static bool_t s_stats = FALSE;
+static const char *s_run = NULL;
+static int s_run_mode = 0;
+static const char *s_link = NULL;
+
+/* Applies the option argv[i]. Returns the index of its last argument, or -1 if argv[i] is not an option. */
+static int s_option(int argc, char *argv[], int i)
+{
+	/* -j N or -jN: number of objects compiled at once */
+	if (!strncmp(argv[i], "-j", 2)) {
+		const char *n = argv[i] + 2;
+		if (!*n && i + 1 < argc) {
+			n = argv[++i];
+		}
+		s_jobs = atoi(n);
+		if (s_jobs < 1) {
+			dfatal("invalid job count '%s'", n);
+		}
+		return i;
+	}
+	/* -I DIR or -IDIR: where the interfaces of the modules are searched */
+	if (!strncmp(argv[i], "-I", 2)) {
+		const char *dir = argv[i] + 2;
+		if (!*dir && i + 1 < argc) {
+			dir = argv[++i];
+		}
+		module_add_path(dir);
+		return i;
+	}
+	/* -fincremental: only generates the top-level statements that changed */
+	if (!strcmp(argv[i], "-fincremental")) {
+		incremental = TRUE;
+		return i;
+	}
+	/* -fcodegen-threads=N: number of threads generating the code of an object */
+	if (!strncmp(argv[i], "-fcodegen-threads=", 18)) {
+		codegen_threads = atoi(argv[i] + 18);
+		if (codegen_threads < 1) {
+			dfatal("invalid thread count '%s'", argv[i] + 18);
+		}
+		return i;
+	}
+	/* -fpipeline: lexes, parses and generates an object on three threads */
+	if (!strcmp(argv[i], "-fpipeline")) {
+		pipeline = TRUE;
+		return i;
+	}
+	/* -fpipeline-stats: prints how full the queues of the pipeline were */
+	if (!strcmp(argv[i], "-fpipeline-stats")) {
+		pipeline = pipeline_stats = TRUE;
+		return i;
+	}
+	/* --run FILE: compiles a source in memory and runs it */
+	if (!strcmp(argv[i], "--run") && i + 1 < argc) {
+		s_run = argv[++i];
+		s_run_mode = 0;
+		return i;
+	}
+	/* --interpret FILE: compiles a source to bytecode and interprets it */
+	if (!strcmp(argv[i], "--interpret") && i + 1 < argc) {
+		s_run = argv[++i];
+		s_run_mode = 1;
+		return i;
+	}
+	/* --run-bench FILE: compares the time to the first result of --run and --interpret */
+	if (!strcmp(argv[i], "--run-bench") && i + 1 < argc) {
+		s_run = argv[++i];
+		s_run_mode = 2;
+		return i;
+	}
+	/* -flto: writes the sources as units to optimize together with --lto-link */
+	if (!strcmp(argv[i], "-flto")) {
+		lto = TRUE;
+		return i;
+	}
+	/* --lto-link OUTPUT: optimizes the units given as sources into a single output */
+	if (!strcmp(argv[i], "--lto-link") && i + 1 < argc) {
+		s_link = argv[++i];
+		return i;
+	}
+	/* -ftime-report: prints the time spent in each phase, for each source */
+	if (!strcmp(argv[i], "-ftime-report")) {
+		time_enabled = time_report = TRUE;
+		return i;
+	}
+	/* -ftime-trace=FILE: writes the phases and the top-level statements as Chrome trace events */
+	if (!strncmp(argv[i], "-ftime-trace=", 13)) {
+		time_enabled = TRUE;
+		time_trace = argv[i] + 13;
+		return i;
+	}
+	/* -fmem-report: prints the allocations of each subsystem at exit */
+	if (!strcmp(argv[i], "-fmem-report")) {
+		mem_report = TRUE;
+		return i;
+	}
+	/* -fprofile-generate: counts the edges of the branches of --run into source.profile */
+	if (!strcmp(argv[i], "-fprofile-generate")) {
+		profile_generate = TRUE;
+		return i;
+	}
+	/* -fprofile-use: lays out the branches after source.profile */
+	if (!strcmp(argv[i], "-fprofile-use")) {
+		profile_use = TRUE;
+		return i;
+	}
+	/* -fprofile-sample-use=FILE: lays out the branches after a sample profile (perf2eck.py) */
+	if (!strncmp(argv[i], "-fprofile-sample-use=", 21)) {
+		profile_use = TRUE;
+		profile_sample = argv[i] + 21;
+		return i;
+	}
+	/* -finstrument-functions[=hooks|rdtsc]: times each top-level statement of --run */
+	if (!strncmp(argv[i], "-finstrument-functions", 22)) {
+		const char *mode = argv[i][22] == '=' ? argv[i] + 23 : "hooks";
+		if (!strcmp(mode, "hooks")) instrument_mode = INSTRUMENT_HOOKS;
+		else if (!strcmp(mode, "rdtsc")) instrument_mode = INSTRUMENT_RDTSC;
+		else dfatal("unknown instrumentation '%s'", mode);
+		return i;
+	}
+	/* -finstrument-sample=N: only times one call in N */
+	if (!strncmp(argv[i], "-finstrument-sample=", 20)) {
+		instrument_sample = strtoul(argv[i] + 20, NULL, 10);
+		/* The countdown is written as a 32 bits immediate. */
+		if (instrument_sample < 1 || instrument_sample > 0x7FFFFFFF) {
+			dfatal("invalid sampling period '%s'", argv[i] + 20);
+		}
+		return i;
+	}
+	/* -finstrument-hooks=LIB: calls the __food_enter and __food_exit of a shared library */
+	if (!strncmp(argv[i], "-finstrument-hooks=", 19)) {
+		instrument_hooks = argv[i] + 19;
+		if (!instrument_mode) instrument_mode = INSTRUMENT_HOOKS;
+		return i;
+	}
+	/* -fperf-map: names the code of --run after the lines of the source for perf */
+	if (!strcmp(argv[i], "-fperf-map")) {
+		perf_map = TRUE;
+		return i;
+	}
+	/* -fcost-report: estimates the cycles of the code of each top-level statement */
+	if (!strcmp(argv[i], "-fcost-report")) {
+		cost_report = TRUE;
+		return i;
+	}
+	/* -mtune=NAME: the processor of the estimates (generic, skylake, znver3) */
+	if (!strncmp(argv[i], "-mtune=", 7)) {
+		if (!cost_tune(argv[i] + 7)) {
+			dfatal("unknown processor '%s'", argv[i] + 7);
+		}
+		return i;
+	}
+	/* -fstack-usage: writes the stack used by each top-level statement to source.su */
+	if (!strcmp(argv[i], "-fstack-usage")) {
+		stack_usage = TRUE;
+		return i;
+	}
+	/* -O0, -O1 (the default), -O2, -Os (the same as -O2): the passes run on the statements */
+	if (!strcmp(argv[i], "-O0") || !strcmp(argv[i], "-O1") || !strcmp(argv[i], "-O") || !strcmp(argv[i], "-O2") || !strcmp(argv[i], "-Os")) {
+		opt_level = argv[i][2] == 's' ? OPT_O2 : argv[i][2] ? argv[i][2] - '0' : OPT_O1;
+		return i;
+	}
+	/* -fno-PASS, -fPASS: turns off or on a pass whatever the level */
+	if (!strncmp(argv[i], "-fno-", 5) && pass_option(argv[i] + 5, FALSE)) {
+		return i;
+	}
+	if (!strncmp(argv[i], "-f", 2) && pass_option(argv[i] + 2, TRUE)) {
+		return i;
+	}
+	/* -fpass-report: prints the runs, the changes and the time of each pass */
+	if (!strcmp(argv[i], "-fpass-report")) {
+		pass_report = TRUE;
+		return i;
+	}
+	/* -print-after=PASS: prints the statements once a pass is done */
+	if (!strncmp(argv[i], "-print-after=", 13)) {
+		print_after = argv[i] + 13;
+		if (!pass_exists(print_after)) {
+			dfatal("unknown pass '%s'", print_after);
+		}
+		return i;
+	}
+	/* -c: writes ELF objects (.o) instead of assembly */
+	if (!strcmp(argv[i], "-c")) {
+		emit_object = TRUE;
+		return i;
+	}
+	/* -fno-asm-comments: leaves the comments out of the assembly */
+	if (!strcmp(argv[i], "-fno-asm-comments")) {
+		asm_comments = FALSE;
+		return i;
+	}
+	/* -ferror-limit=N: stops after N errors, 0 for no limit */
+	if (!strncmp(argv[i], "-ferror-limit=", 14)) {
+		error_limit = strtoul(argv[i] + 14, NULL, 10);
+		return i;
+	}
+	/* -fdiagnostics-format=text|json */
+	if (!strncmp(argv[i], "-fdiagnostics-format=", 21)) {
+		if (!strcmp(argv[i] + 21, "json")) diag_json = TRUE;
+		else if (!strcmp(argv[i] + 21, "text")) diag_json = FALSE;
+		else dfatal("unknown diagnostics format '%s'", argv[i] + 21);
+		return i;
+	}
+	/* --cache-dir DIR: caches the objects by their contents */
+	if (!strcmp(argv[i], "--cache-dir") && i + 1 < argc) {
+		cache_dir = argv[++i];
+		return i;
+	}
+	/* --cache-size N[K|M|G]: the size after which the cache is trimmed */
+	if (!strcmp(argv[i], "--cache-size") && i + 1 < argc) {
+		char *unit;
+		cache_limit = strtoul(argv[++i], &unit, 10);
+		if (*unit == 'K' || *unit == 'k') cache_limit <<= 10;
+		if (*unit == 'M' || *unit == 'm') cache_limit <<= 20;
+		if (*unit == 'G' || *unit == 'g') cache_limit <<= 30;
+		return i;
+	}
+	/* --cache-stats: prints the statistics of the cache at exit */
+	if (!strcmp(argv[i], "--cache-stats")) {
+		s_stats = TRUE;
+		return i;
+	}
+	return -1;
+}
+
+void options_apply(int argc, char *argv[])
+{
+	int i, last;
+	for (i = 0; i < argc; i++) {
+		last = s_option(argc, argv, i);
+		if (last >= 0) i = last;
+	}
+}
+
 /* Compiler entrypoint */
 int main(int argc, char *argv[])
 {
-	int i, yield = 0;
-	char *source;
-	char *output;
-	bool_t status;
-	size_t len;
+	int i, last;
+	char **sources;
+	size_t count = 0;
 	if (argc < 0) {
 		dfatal("No file specified.");
 	}
 
+	server_path = getenv("ECK_SERVER");
+	cache_dir = getenv("ECK_CACHE_DIR");
+	sources = malloc(sizeof(char *) * argc);
+	server_options = malloc(sizeof(char *) * argc);
 	for (i = 1; i < argc; i++) {
-		source = argv[i];
-		len = strlen(source);
-		output = malloc(len + 2);
-		strcpy(output, source);
-		output[len] = '.';
-		output[len + 1] = 's';
-
-		status = compile_object(source, output);
+		/* --server PATH: serves compilations on a local socket */
+		if (!strcmp(argv[i], "--server") && i + 1 < argc) {
+			server_run(argv[++i]);
+		}
+		/* --connect PATH: compiles through a running server */
+		if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+			server_path = argv[++i];
+			continue;
+		}
+		last = s_option(argc, argv, i);
+		if (last < 0) {
+			sources[count++] = argv[i];
+			continue;
+		}
+		/* The server compiles with the options of the client. */
+		while (i <= last) {
+			server_options[server_option_count++] = argv[i++];
+		}
+		i = last;
+	}
 
-		free(output);
+	/* The counters and the records are only written by the code eck runs itself. */
+	if (profile_generate && (!s_run || s_run_mode != 0)) {
+		dfatal("-fprofile-generate needs --run");
+	}
+	if (instrument_mode && (!s_run || s_run_mode != 0)) {
+		dfatal("-finstrument-functions needs --run");
+	}
 
-		if (!status) {
-			yield = 1;
-		}
+	/* The events and the allocations of the workers would be lost. */
+	if (time_trace || mem_report) s_jobs = 1;
+	/* The statements estimated, measured or optimized are collected by a single thread. */
+	if (cost_report || stack_usage || pass_report || print_after) {
+		s_jobs = 1;
+		codegen_threads = 1;
 	}
 
-	return yield;
-}
\ No newline at end of file
+	if (s_link) {
+		i = lto_link(sources, count, s_link) ? 0 : 1;
+	} else if (s_run && s_run_mode == 2) {
+		i = run_bench(s_run, 10) ? 0 : 1;
+	} else if (s_run) {
+		i = compile_run(s_run, s_run_mode == 1) ? 0 : 1;
+	} else {
+		i = compile_objects(sources, count, s_jobs) ? 0 : 1;
+	}
+	if (s_stats) {
+		cache_report();
+	}
+	if (time_trace && !time_trace_write(time_trace)) {
+		fprintf(stderr, "cannot write the trace '%s'\n", time_trace);
+	}
+	if (mem_report) {
+		mem_print();
+	}
+	free(sources);
+	free(server_options);
+	return i;
+}
@@ -0,0 +1,343 @@
+/*
+	Module interfaces for ECK
+
+	A source that declares a namespace gets an interface written
+	next to its output (<name>.fdi). The interface holds the file
+	scope symbols of the module along with their types, so that
+	a using clause only has to map the file instead of lexing and
+	parsing the declarations again. An interface does not refer
+	to the interfaces it was built with: each one is self-contained.
+
+	Layout (native byte order, checked through the header):
+	  module_header
+	  module_type   [type_count]    (interned, subtypes come first)
+	  module_symbol [symbol_count]
+	  char          [strings_size]  (names, null-terminated)
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MODULE_MAGIC      "FDI"
+#define MODULE_VERSION    1
+#define MODULE_BYTE_ORDER 0x01020304
+
+typedef struct module_header
+{
+	char     magic[4];     /* MODULE_MAGIC */
+	uint32_t version;      /* MODULE_VERSION */
+	uint32_t byte_order;   /* MODULE_BYTE_ORDER, as written by the host */
+	uint32_t type_count;   /* The number of types. */
+	uint32_t symbol_count; /* The number of symbols. */
+	uint32_t strings_size; /* The size of the string pool, in bytes. */
+} module_header;
+
+typedef struct module_type
+{
+	uint8_t  qualifiers; /* The qualifiers of the type. */
+	uint8_t  kind;       /* The kind of the type. */
+	uint16_t reserved;   /* Always zero. */
+	uint32_t sub;        /* The index of the subtype plus one, 0 if none. */
+} module_type;
+
+typedef struct module_symbol
+{
+	uint32_t name; /* The offset of the name in the string pool. */
+	uint32_t type; /* The index of the type. */
+} module_symbol;
+
+static char **s_paths = NULL;  /* Directories given with -I */
+static size_t s_pathcount = 0;
+static char *s_source_dir = NULL; /* Where the interfaces are searched first */
+static char *s_output_dir = NULL; /* Where the interface is written */
+static char *s_name = NULL;       /* The name of the module, NULL if none */
+static char **s_loaded = NULL;    /* The modules already imported */
+static size_t s_loadedcount = 0;
+
+/* Copies the directory part of a path. Must be freed. */
+static char *s_dirname(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *yield;
+	if (!slash) {
+		yield = malloc(2);
+		strcpy(yield, ".");
+		return yield;
+	}
+	yield = malloc(slash - path + 1);
+	memcpy(yield, path, slash - path);
+	yield[slash - path] = 0;
+	return yield;
+}
+
+/* Joins a directory and a module name into the path of an interface. Must be freed. */
+static char *s_interface_path(const char *dir, const char *name)
+{
+	char *yield = malloc(strlen(dir) + strlen(name) + 6);
+	sprintf(yield, "%s/%s.fdi", dir, name);
+	return yield;
+}
+
+void module_add_path(const char *dir)
+{
+	s_paths = realloc(s_paths, sizeof(char *) * (s_pathcount + 1));
+	s_paths[s_pathcount] = malloc(strlen(dir) + 1);
+	strcpy(s_paths[s_pathcount], dir);
+	s_pathcount++;
+}
+
+void module_begin(const char *source, const char *output)
+{
+	size_t i;
+	free(s_source_dir);
+	free(s_output_dir);
+	free(s_name);
+	for (i = 0; i < s_loadedcount; i++) {
+		free(s_loaded[i]);
+	}
+	free(s_loaded);
+	s_loaded = NULL;
+	s_loadedcount = 0;
+	s_name = NULL;
+	s_source_dir = source ? s_dirname(source) : NULL;
+	s_output_dir = output ? s_dirname(output) : NULL;
+}
+
+void module_name(const char *name, lex_token *site)
+{
+	if (s_name) {
+		derror(site, "the module is already named %s\n", s_name);
+		return;
+	}
+	s_name = malloc(strlen(name) + 1);
+	strcpy(s_name, name);
+}
+
+/* ===================== WRITING ===================== */
+
+/* The interface being written. */
+typedef struct module_writer
+{
+	module_type *types;
+	size_t typecount;
+	module_symbol *symbols;
+	size_t symbolcount;
+	string_builder strings;
+} module_writer;
+
+/* Interns a type and its subtypes. Returns its index. */
+static uint32_t s_intern(module_writer *w, foodtype *t)
+{
+	module_type entry;
+	size_t i;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.qualifiers = t->qualifiers;
+	entry.kind = t->kind;
+	entry.sub = t->sub ? s_intern(w, t->sub) + 1 : 0;
+
+	for (i = 0; i < w->typecount; i++) {
+		if (!memcmp(&w->types[i], &entry, sizeof(entry)))
+			return i;
+	}
+	w->types = realloc(w->types, sizeof(module_type) * (w->typecount + 1));
+	w->types[w->typecount] = entry;
+	return w->typecount++;
+}
+
+static bool_t s_write(const char *path, module_writer *w)
+{
+	module_header header;
+	char *tmp;
+	FILE *f;
+	bool_t ok;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MODULE_MAGIC, 4);
+	header.version = MODULE_VERSION;
+	header.byte_order = MODULE_BYTE_ORDER;
+	header.type_count = w->typecount;
+	header.symbol_count = w->symbolcount;
+	header.strings_size = w->strings.length;
+
+	/* Another compilation might be reading the previous interface. */
+	tmp = malloc(strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		free(tmp);
+		return FALSE;
+	}
+	ok = fwrite(&header, sizeof(header), 1, f) == 1
+	  && fwrite(w->types, sizeof(module_type), w->typecount, f) == w->typecount
+	  && fwrite(w->symbols, sizeof(module_symbol), w->symbolcount, f) == w->symbolcount
+	  && fwrite(w->strings.storage, 1, w->strings.length, f) == w->strings.length;
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp, path) == 0;
+	if (!ok) remove(tmp);
+	free(tmp);
+	return ok;
+}
+
+void module_end(bool_t ok)
+{
+	module_writer w;
+	scope *base = scope_base();
+	char *path;
+	size_t i;
+
+	if (!s_name || !ok || !s_output_dir)
+		return;
+
+	memset(&w, 0, sizeof(w));
+	strbuilder_alloc(&w.strings, 256);
+	w.symbols = malloc(sizeof(module_symbol) * (base->symbolcount + 1));
+	for (i = 0; i < base->symbolcount; i++) {
+		symbol *sym = &base->symbols[i];
+		/* Imported symbols belong to their own module. */
+		if (sym->flags & SYMBOL_IMPORTED)
+			continue;
+		w.symbols[w.symbolcount].name = w.strings.length;
+		w.symbols[w.symbolcount].type = s_intern(&w, &sym->t);
+		strbuilder_append_string(&w.strings, (char *)sym->name);
+		strbuilder_append_char(&w.strings, 0);
+		w.symbolcount++;
+	}
+
+	path = s_interface_path(s_output_dir, s_name);
+	if (!s_write(path, &w)) {
+		dfatal("cannot write the interface '%s'", path);
+	}
+	free(path);
+	free(w.types);
+	free(w.symbols);
+	strbuilder_free(&w.strings);
+}
+
+/* ===================== READING ===================== */
+
+/* Rebuilds a type from the table of an interface. */
+static void s_type(const module_type *types, uint32_t index, foodtype *dest)
+{
+	dest->qualifiers = types[index].qualifiers;
+	dest->kind = types[index].kind;
+	dest->extra = NULL;
+	dest->sub = NULL;
+	if (types[index].sub) {
+		foodtype sub;
+		s_type(types, types[index].sub - 1, &sub);
+		dest->sub = MEMORIZE(foodtype, &sub);
+	}
+}
+
+static bool_t s_same_type(foodtype *a, foodtype *b)
+{
+	while (a && b) {
+		if (a->kind != b->kind || a->qualifiers != b->qualifiers)
+			return FALSE;
+		a = a->sub;
+		b = b->sub;
+	}
+	return a == b;
+}
+
+/* Checks that an interface is well-formed before using it. */
+static bool_t s_valid(const char *map, size_t size)
+{
+	const module_header *header = (const module_header *)map;
+	const module_type *types;
+	const module_symbol *symbols;
+	size_t expected, i;
+
+	if (size < sizeof(module_header)
+	 || memcmp(header->magic, MODULE_MAGIC, 4)
+	 || header->version != MODULE_VERSION
+	 || header->byte_order != MODULE_BYTE_ORDER)
+		return FALSE;
+
+	expected = sizeof(module_header)
+	         + (size_t)header->type_count * sizeof(module_type)
+	         + (size_t)header->symbol_count * sizeof(module_symbol)
+	         + header->strings_size;
+	if (expected != size || (header->strings_size && map[size - 1] != 0))
+		return FALSE;
+
+	types = (const module_type *)(header + 1);
+	symbols = (const module_symbol *)(types + header->type_count);
+	for (i = 0; i < header->type_count; i++) {
+		/* Subtypes always come first, which also rules out cycles. */
+		if (types[i].sub > i)
+			return FALSE;
+	}
+	for (i = 0; i < header->symbol_count; i++) {
+		if (symbols[i].name >= header->strings_size || symbols[i].type >= header->type_count)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+bool_t module_import(const char *name, lex_token *site)
+{
+	const module_header *header;
+	const module_type *types;
+	const module_symbol *symbols;
+	const char *strings;
+	char *map = NULL, *path;
+	size_t size = 0, i;
+
+	/* 1. Every module is only imported once */
+	for (i = 0; i < s_loadedcount; i++) {
+		if (!strcmp(s_loaded[i], name))
+			return TRUE;
+	}
+
+	/* 2. Finding the interface: next to the source, then in the search paths */
+	if (s_source_dir) {
+		path = s_interface_path(s_source_dir, name);
+		map = map_file(path, &size);
+		free(path);
+	}
+	for (i = 0; !map && i < s_pathcount; i++) {
+		path = s_interface_path(s_paths[i], name);
+		map = map_file(path, &size);
+		free(path);
+	}
+	if (!map) {
+		derror(site, "cannot find the interface of module %s\n", name);
+		return FALSE;
+	}
+	if (!s_valid(map, size)) {
+		derror(site, "the interface of module %s is invalid or out of date\n", name);
+		unmap_file(map, size);
+		return FALSE;
+	}
+
+	/* 3. Declaring the symbols */
+	header = (const module_header *)map;
+	types = (const module_type *)(header + 1);
+	symbols = (const module_symbol *)(types + header->type_count);
+	strings = (const char *)(symbols + header->symbol_count);
+	for (i = 0; i < header->symbol_count; i++) {
+		const char *sname = strings + symbols[i].name;
+		symbol *existing = lookup(sname);
+		foodtype t;
+
+		s_type(types, symbols[i].type, &t);
+		if (existing) {
+			/* The same symbol can reach us through several modules. */
+			if (!(existing->flags & SYMBOL_IMPORTED) || !s_same_type(&existing->t, &t)) {
+				derror(site, "%s from module %s conflicts with another declaration\n", sname, name);
+			}
+			continue;
+		}
+		decl(sname, &t);
+		lookup(sname)->flags |= SYMBOL_IMPORTED;
+	}
+	unmap_file(map, size);
+
+	s_loaded = realloc(s_loaded, sizeof(char *) * (s_loadedcount + 1));
+	s_loaded[s_loadedcount] = malloc(strlen(name) + 1);
+	strcpy(s_loaded[s_loadedcount++], name);
+	return TRUE;
+}
@@ -0,0 +1,534 @@
+/*
+	Optimization passes for ECK (-O0, -O1, -O2, -Os)
+
+	Each top-level statement is parsed into a tree, which the passes
+	rewrite one after the other before its code is generated:
+	  - fold: computes the constant expressions (esimple);
+	  - branches: keeps only the branch of an if whose condition is
+	    known, and removes the loops that never run;
+	  - dead: removes the expression statements whose value is not
+	    used, which is the case of all but the last of a block, as
+	    the value of the last one executed is the result of --run.
+
+	None of the passes makes the code larger, so -Os is -O2.
+
+	A pass runs after the one it requires, whatever their order in
+	the table. The level chooses the passes, then -fno-PASS and
+	-fPASS turn one off or on, so that a change of the code can be
+	bisected down to a single pass.
+
+	With -fpass-report, the runs, the statements changed and the
+	time of each pass are printed for each source. -print-after=PASS
+	prints the statements as they are once a pass is done. They are
+	kept until the source is done, to be located all at once.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int opt_level = OPT_DEFAULT;
+bool_t pass_report = FALSE;
+const char *print_after = NULL;
+
+#define PASS_LEVEL(level) (1 << (level))
+
+/* A pass. It changes the tree in place and returns what replaces it, NULL if nothing does. */
+typedef struct pass
+{
+	const char *name;
+	const char *requires; /* The pass it runs after. NULL if none. */
+	int levels;           /* The levels it runs at (PASS_LEVEL). */
+	statement_tree *(*run)(statement_tree *tree);
+} pass;
+
+static statement_tree *s_fold(statement_tree *tree);
+static statement_tree *s_branches(statement_tree *tree);
+static statement_tree *s_dead(statement_tree *tree);
+
+static const pass s_passes[] = {
+	{ "fold", NULL, PASS_LEVEL(OPT_O1) | PASS_LEVEL(OPT_O2), s_fold },
+	{ "branches", "fold", PASS_LEVEL(OPT_O2), s_branches },
+	{ "dead", "branches", PASS_LEVEL(OPT_O2), s_dead }
+};
+#define PASS_COUNT (sizeof(s_passes) / sizeof(s_passes[0]))
+
+/* -fPASS and -fno-PASS: 0 to follow the level, 1 on, 2 off. */
+static uint8_t s_overrides[PASS_COUNT];
+
+/* The passes, in the order they run. */
+static size_t s_order[PASS_COUNT];
+static bool_t s_ordered = FALSE;
+
+/* The statistics of a pass, for -fpass-report. */
+typedef struct pass_stats
+{
+	size_t runs;    /* The top-level statements it ran on. */
+	size_t changed; /* The ones it changed. */
+	double seconds;
+} pass_stats;
+
+static pass_stats s_stats[PASS_COUNT];
+
+static size_t s_find(const char *name)
+{
+	size_t i;
+	for (i = 0; i < PASS_COUNT; i++) {
+		if (!strcmp(s_passes[i].name, name)) return i;
+	}
+	return PASS_COUNT;
+}
+
+bool_t pass_exists(const char *name)
+{
+	return s_find(name) < PASS_COUNT;
+}
+
+bool_t pass_option(const char *name, bool_t enabled)
+{
+	size_t i = s_find(name);
+	if (i == PASS_COUNT) return FALSE;
+	s_overrides[i] = enabled ? 1 : 2;
+	return TRUE;
+}
+
+/* The level the passes run at. */
+static int s_level(void)
+{
+	return opt_level == OPT_DEFAULT ? OPT_O1 : opt_level;
+}
+
+static bool_t s_enabled(size_t i)
+{
+	if (s_overrides[i]) return s_overrides[i] == 1;
+	return (s_passes[i].levels & PASS_LEVEL(s_level())) != 0;
+}
+
+/* Puts a pass in the order after the one it requires. */
+static void s_visit(size_t i, bool_t *placed, size_t *count)
+{
+	size_t required;
+	if (placed[i]) return;
+	placed[i] = TRUE;
+	if (s_passes[i].requires) {
+		required = s_find(s_passes[i].requires);
+		if (required < PASS_COUNT) s_visit(required, placed, count);
+	}
+	s_order[(*count)++] = i;
+}
+
+static void s_sort(void)
+{
+	bool_t placed[PASS_COUNT];
+	size_t i, count = 0;
+	memset(placed, 0, sizeof(placed));
+	for (i = 0; i < PASS_COUNT; i++) {
+		s_visit(i, placed, &count);
+	}
+	s_ordered = TRUE;
+}
+
+void passes_signature(sha256_ctx *ctx)
+{
+	uint8_t enabled[PASS_COUNT];
+	size_t i;
+	for (i = 0; i < PASS_COUNT; i++) {
+		enabled[i] = (uint8_t)s_enabled(i);
+	}
+	sha256_update(ctx, enabled, sizeof(enabled));
+}
+
+/* ===================== PASSES ===================== */
+
+static statement_tree *s_fold(statement_tree *tree)
+{
+	size_t i;
+	if (tree->condition) esimple(&tree->condition);
+	if (tree->body) s_fold(tree->body);
+	if (tree->otherwise) s_fold(tree->otherwise);
+	for (i = 0; i < tree->childcount; i++) {
+		s_fold(tree->children[i]);
+	}
+	return tree;
+}
+
+/* Gets the value of a condition, if it is known. */
+static bool_t s_known(expression *condition, uint64_t *value)
+{
+	bool_t failed;
+	if (condition->kind != EXPRESSION_INTEGER_LITERAL && condition->kind != EXPRESSION_BOOLEAN_LITERAL)
+		return FALSE;
+	*value = eval(condition, &failed);
+	return !failed;
+}
+
+static statement_tree *s_branches(statement_tree *tree)
+{
+	statement_tree *yield;
+	uint64_t value;
+	size_t i, count;
+
+	if (!tree) return NULL;
+	tree->body = s_branches(tree->body);
+	tree->otherwise = s_branches(tree->otherwise);
+	for (i = count = 0; i < tree->childcount; i++) {
+		yield = s_branches(tree->children[i]);
+		if (yield) tree->children[count++] = yield;
+	}
+	tree->childcount = count;
+
+	yield = tree;
+	switch (tree->kind) {
+		case STATEMENT_IF:
+			if (!s_known(tree->condition, &value)) break;
+			/* Only the branch taken is kept. */
+			yield = value ? tree->body : tree->otherwise;
+			if (value) tree->body = NULL;
+			else tree->otherwise = NULL;
+			break;
+
+		case STATEMENT_WHILE:
+			if (!s_known(tree->condition, &value) || value) break;
+			yield = NULL;
+			break;
+
+		case STATEMENT_DO:
+			if (!s_known(tree->condition, &value) || value) break;
+			/* The body runs once. */
+			yield = tree->body;
+			tree->body = NULL;
+			break;
+
+		default:
+			break;
+	}
+	if (yield != tree) delete_statement(tree);
+	return yield;
+}
+
+/* Whether computing an expression changes anything but its register. */
+static bool_t s_side_effects(expression *tree)
+{
+	if (!tree) return FALSE;
+	switch (tree->kind) {
+		case EXPRESSION_POSTFIX_INCREMENT:
+		case EXPRESSION_POSTFIX_DECREMENT:
+		case EXPRESSION_PREFIX_INCREMENT:
+		case EXPRESSION_PREFIX_DECREMENT:
+		case EXPRESSION_FUNCTION_CALL:
+			return TRUE;
+		default:
+			if (tree->kind >= EXPRESSION_ASSIGN && tree->kind <= EXPRESSION_OR_ASSIGN) return TRUE;
+			break;
+	}
+	return s_side_effects(tree->left) || s_side_effects(tree->right) || s_side_effects(tree->extra);
+}
+
+static statement_tree *s_dead(statement_tree *tree)
+{
+	size_t i, count;
+	bool_t overwritten = FALSE;
+
+	if (!tree) return NULL;
+	tree->body = s_dead(tree->body);
+	tree->otherwise = s_dead(tree->otherwise);
+	/* From the last statement of the block: the ones before an expression statement have their value overwritten. */
+	for (i = tree->childcount; i-- > 0; ) {
+		statement_tree *child = tree->children[i];
+		if (child->kind != STATEMENT_EXPRESSION) {
+			tree->children[i] = s_dead(child);
+		} else if (overwritten && !s_side_effects(child->condition)) {
+			delete_statement(child);
+			tree->children[i] = NULL;
+		} else {
+			overwritten = TRUE;
+		}
+	}
+	for (i = count = 0; i < tree->childcount; i++) {
+		if (tree->children[i]) tree->children[count++] = tree->children[i];
+	}
+	tree->childcount = count;
+	return tree;
+}
+
+/* ===================== PRINTING ===================== */
+
+static const char *s_operator(expression_kind kind)
+{
+	switch (kind) {
+		case EXPRESSION_POSTFIX_INCREMENT: case EXPRESSION_PREFIX_INCREMENT: return "++";
+		case EXPRESSION_POSTFIX_DECREMENT: case EXPRESSION_PREFIX_DECREMENT: return "--";
+		case EXPRESSION_POSTFIX_UNARY_PLUS: return "+";
+		case EXPRESSION_POSTFIX_UNARY_MINUS: return "-";
+		case EXPRESSION_POSTFIX_LOGICAL_NOT: return "!";
+		case EXPRESSION_POSTFIX_BITWISE_NOT: return "~";
+		case EXPRESSION_DEREFERENCE: return "*";
+		case EXPRESSION_ADDRESS_OF: return "&";
+		case EXPRESSION_MULTIPLY: return "*";
+		case EXPRESSION_DIVISION: return "/";
+		case EXPRESSION_MODULO: return "%";
+		case EXPRESSION_ADDITION: return "+";
+		case EXPRESSION_SUBTRACTION: return "-";
+		case EXPRESSION_LSHIFT: return "<<";
+		case EXPRESSION_RSHIFT: return ">>";
+		case EXPRESSION_LOWER: return "<";
+		case EXPRESSION_LOWER_OR_EQUAL: return "<=";
+		case EXPRESSION_GREATER: return ">";
+		case EXPRESSION_GREATER_OR_EQUAL: return ">=";
+		case EXPRESSION_EQUAL: return "==";
+		case EXPRESSION_NOT_EQUAL: return "!=";
+		case EXPRESSION_BITWISE_AND: return "&";
+		case EXPRESSION_BITWISE_XOR: return "^";
+		case EXPRESSION_BITWISE_OR: return "|";
+		case EXPRESSION_LOGICAL_AND: return "&&";
+		case EXPRESSION_LOGICAL_OR: return "||";
+		case EXPRESSION_ASSIGN: return "=";
+		case EXPRESSION_SUM_ASSIGN: return "+=";
+		case EXPRESSION_DIFFERENCE_ASSIGN: return "-=";
+		case EXPRESSION_PRODUCT_ASSIGN: return "*=";
+		case EXPRESSION_QUOTIENT_ASSIGN: return "/=";
+		case EXPRESSION_REMAINDER_ASSIGN: return "%=";
+		case EXPRESSION_LSHIFT_ASSIGN: return "<<=";
+		case EXPRESSION_RSHIFT_ASSIGN: return ">>=";
+		case EXPRESSION_AND_ASSIGN: return "&=";
+		case EXPRESSION_XOR_ASSIGN: return "^=";
+		case EXPRESSION_OR_ASSIGN: return "|=";
+		default: return "?";
+	}
+}
+
+/*
+	The statements printed by -print-after, located once the source
+	is done, all at once (lex_sites).
+*/
+typedef struct pass_printed
+{
+	uint64_t pos;  /* The offset of the statement. */
+	size_t text;   /* The offset of its text in s_printed. */
+	size_t length; /* The length of its text. */
+} pass_printed;
+
+static string_builder s_printed = { NULL, 0, 0, 0 };
+static pass_printed *s_statements = NULL;
+static size_t s_statement_count = 0, s_statement_max = 0;
+
+static void s_put(const char *text)
+{
+	strbuilder_append_string(&s_printed, (char *)text);
+}
+
+/* Prints an expression as Food, every operation in brackets. */
+static void s_print_expression(expression *tree)
+{
+	char buffer[32];
+	switch (tree->kind) {
+		case EXPRESSION_INTEGER_LITERAL:
+			/* The folded values are kept extended to 64 bits, the sign following the type. */
+			if (is_unsigned(&tree->type)) sprintf(buffer, "%lu", (unsigned long)tree->token.value.u64);
+			else sprintf(buffer, "%ld", (long)(int64_t)tree->token.value.u64);
+			s_put(buffer);
+			return;
+		case EXPRESSION_BOOLEAN_LITERAL:
+			s_put(tree->token.value.u64 ? "true" : "false");
+			return;
+		case EXPRESSION_TERNARY_CONDITIONAL:
+			strbuilder_append_char(&s_printed, '(');
+			s_print_expression(tree->extra);
+			s_put(" ? ");
+			s_print_expression(tree->left);
+			s_put(" : ");
+			s_print_expression(tree->right);
+			strbuilder_append_char(&s_printed, ')');
+			return;
+		case EXPRESSION_POSTFIX_INCREMENT:
+		case EXPRESSION_POSTFIX_DECREMENT:
+			s_print_expression(tree->left);
+			s_put(s_operator(tree->kind));
+			return;
+		default:
+			break;
+	}
+	if (tree->left && tree->right) {
+		strbuilder_append_char(&s_printed, '(');
+		s_print_expression(tree->left);
+		strbuilder_append_char(&s_printed, ' ');
+		s_put(s_operator(tree->kind));
+		strbuilder_append_char(&s_printed, ' ');
+		s_print_expression(tree->right);
+		strbuilder_append_char(&s_printed, ')');
+	} else if (tree->left) {
+		s_put(s_operator(tree->kind));
+		s_print_expression(tree->left);
+	} else {
+		sprintf(buffer, "<expression %d>", tree->kind);
+		s_put(buffer);
+	}
+}
+
+static void s_indent(int depth)
+{
+	while (depth-- > 0) strbuilder_append_char(&s_printed, '\t');
+}
+
+static void s_print_statement(statement_tree *tree, int depth)
+{
+	size_t i;
+	s_indent(depth);
+	if (!tree) {
+		s_put(";\n");
+		return;
+	}
+	switch (tree->kind) {
+		case STATEMENT_EXPRESSION:
+			s_print_expression(tree->condition);
+			s_put(";\n");
+			break;
+		case STATEMENT_BLOCK:
+			s_put("{\n");
+			for (i = 0; i < tree->childcount; i++) {
+				s_print_statement(tree->children[i], depth + 1);
+			}
+			s_indent(depth);
+			s_put("}\n");
+			break;
+		case STATEMENT_IF:
+			s_put("if (");
+			s_print_expression(tree->condition);
+			s_put(")\n");
+			s_print_statement(tree->body, depth + 1);
+			if (tree->has_else) {
+				s_indent(depth);
+				s_put("else\n");
+				s_print_statement(tree->otherwise, depth + 1);
+			}
+			break;
+		case STATEMENT_WHILE:
+			s_put("while (");
+			s_print_expression(tree->condition);
+			s_put(")\n");
+			s_print_statement(tree->body, depth + 1);
+			break;
+		case STATEMENT_DO:
+			s_put("do\n");
+			s_print_statement(tree->body, depth + 1);
+			s_indent(depth);
+			s_put("while (");
+			s_print_expression(tree->condition);
+			s_put(");\n");
+			break;
+	}
+}
+
+/* ===================== RUNNING ===================== */
+
+/* Counts the nodes of a statement, to tell whether a pass changed it. */
+static size_t s_weight(statement_tree *tree)
+{
+	size_t yield = 1, i;
+	if (!tree) return 0;
+	if (tree->condition) yield += eweight(tree->condition);
+	yield += s_weight(tree->body) + s_weight(tree->otherwise);
+	for (i = 0; i < tree->childcount; i++) {
+		yield += s_weight(tree->children[i]);
+	}
+	return yield;
+}
+
+/* Prints a statement for -print-after, or keeps it to be located first. */
+static void s_print(uint64_t pos, statement_tree *tree)
+{
+	size_t start;
+	if (!s_printed.storage) strbuilder_alloc(&s_printed, 4096);
+	start = s_printed.length;
+	s_print_statement(tree, 0);
+
+	/* The statements of the units linked by --lto-link have no source to be located in. */
+	if (!diag_source) {
+		fprintf(stderr, "; after %s, in the units linked\n%.*s", print_after,
+			(int)(s_printed.length - start), s_printed.storage + start);
+		s_printed.length = start;
+		return;
+	}
+	if (s_statement_count == s_statement_max) {
+		s_statement_max = s_statement_max ? s_statement_max * 2 : 64;
+		s_statements = realloc(s_statements, sizeof(pass_printed) * s_statement_max);
+	}
+	s_statements[s_statement_count].pos = pos;
+	s_statements[s_statement_count].text = start;
+	s_statements[s_statement_count].length = s_printed.length - start;
+	s_statement_count++;
+}
+
+statement_tree *passes_run(statement_tree *tree)
+{
+	uint64_t site;
+	size_t i, p, before = 0;
+	double start = 0;
+
+	if (!s_ordered) s_sort();
+	site = tree->token.pos;
+	for (i = 0; i < PASS_COUNT && tree; i++) {
+		p = s_order[i];
+		if (!s_enabled(p)) continue;
+		if (pass_report) {
+			before = s_weight(tree);
+			start = clock_seconds();
+		}
+		tree = s_passes[p].run(tree);
+		if (pass_report) {
+			s_stats[p].seconds += clock_seconds() - start;
+			s_stats[p].runs++;
+			if (s_weight(tree) != before) s_stats[p].changed++;
+		}
+		if (print_after && !strcmp(print_after, s_passes[p].name)) {
+			s_print(site, tree);
+		}
+	}
+	return tree;
+}
+
+void pass_print(const char *source)
+{
+	static const char *const levels[] = { "-O0", "-O1", "-O2" };
+	size_t i, p;
+
+	fprintf(stderr, "passes of %s at %s:\n", source, levels[s_level()]);
+	fprintf(stderr, "  %-12s %8s %8s %10s\n", "pass", "runs", "changed", "ms");
+	if (!s_ordered) s_sort();
+	for (i = 0; i < PASS_COUNT; i++) {
+		p = s_order[i];
+		if (!s_enabled(p)) {
+			fprintf(stderr, "  %-12s %8s\n", s_passes[p].name, "off");
+			continue;
+		}
+		fprintf(stderr, "  %-12s %8lu %8lu %10.3f\n", s_passes[p].name, (unsigned long)s_stats[p].runs,
+			(unsigned long)s_stats[p].changed, s_stats[p].seconds * 1e3);
+	}
+	memset(s_stats, 0, sizeof(s_stats));
+}
+
+void pass_flush(const char *source)
+{
+	uint64_t *positions;
+	size_t *lines, *cols, i;
+
+	positions = malloc(sizeof(uint64_t) * (s_statement_count + 1));
+	lines = malloc(sizeof(size_t) * (s_statement_count + 1));
+	cols = malloc(sizeof(size_t) * (s_statement_count + 1));
+	/* The statements are printed in the order of the source. */
+	for (i = 0; i < s_statement_count; i++) {
+		positions[i] = s_statements[i].pos;
+	}
+	lex_sites(positions, s_statement_count, lines, cols);
+
+	for (i = 0; i < s_statement_count; i++) {
+		fprintf(stderr, "; after %s, %s:%lu:%lu\n%.*s", print_after, source,
+			(unsigned long)lines[i], (unsigned long)cols[i],
+			(int)s_statements[i].length, s_printed.storage + s_statements[i].text);
+	}
+	free(positions);
+	free(lines);
+	free(cols);
+	s_statement_count = 0;
+	s_printed.length = 0;
+}
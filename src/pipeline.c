@@ -0,0 +1,289 @@
+/*
+	Pipelined compilation for ECK
+
+	A single large source is compiled by three threads:
+	  lexer    reads the source and pushes tokens to a ring
+	  parser   takes the tokens and pushes statement trees to a ring
+	  codegen  (the calling thread) generates the trees in order
+	Both rings have a single producer and a single consumer, so
+	they only need an atomic index on each side.
+
+	The parser backtracks by moving the lexer to a previous
+	position. The tokens it took are kept in a history, and a
+	position is turned back into an index in the history. The
+	parser never moves back before the top-level statement it is
+	on, so the history is cut at the start of each one.
+
+	The parser thread is the only one redirecting the lexer.
+
+	With -fpipeline-stats, the occupancy of each ring is printed
+	once done: a ring that is often full means the consumer is
+	the slowest stage, one that is often empty the producer.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool_t pipeline = FALSE;
+bool_t pipeline_stats = FALSE;
+
+#ifdef ECK_THREADS
+
+#include <pthread.h>
+#include <sched.h>
+
+#define TOKEN_RING_SIZE     4096
+#define STATEMENT_RING_SIZE 256
+
+/* The number of polls before yielding to the other threads. */
+#define RING_SPIN 64
+
+/* A token, as passed from the lexer to the parser. */
+typedef struct pipe_token
+{
+	lex_token token; /* The token. */
+	size_t end;      /* The position of the lexer after the token. */
+	bool_t ok;       /* Whether a token was read at all. */
+	bool_t last;     /* Whether the source ends here. */
+} pipe_token;
+
+/*
+	A bounded single-producer, single-consumer ring. Each index is
+	only written by one side and lives on its own cache line.
+*/
+typedef struct spsc_ring
+{
+	char *items;        /* The items. */
+	size_t item_size;   /* The size of an item. */
+	size_t capacity;    /* The number of items, a power of two. */
+
+	char pad0[64];
+	size_t head;        /* The next item to pop. Written by the consumer. */
+	uint64_t empty;     /* The number of times the consumer waited. */
+
+	char pad1[64];
+	size_t tail;        /* The next item to push. Written by the producer. */
+	uint64_t pushes;    /* The number of items pushed. */
+	uint64_t occupancy; /* The sum of the occupancy at each push. */
+	uint64_t highest;   /* The highest occupancy. */
+	uint64_t full;      /* The number of times the producer waited. */
+	char pad2[64];
+} spsc_ring;
+
+static void s_ring_init(spsc_ring *ring, size_t item_size, size_t capacity)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->items = malloc(item_size * capacity);
+	ring->item_size = item_size;
+	ring->capacity = capacity;
+}
+
+/* Waits a bit for the other side of a ring. */
+static void s_ring_wait(unsigned *spins)
+{
+	if (++*spins >= RING_SPIN) {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+static void s_ring_push(spsc_ring *ring, const void *item)
+{
+	size_t tail = ring->tail, used;
+	unsigned spins = 0;
+
+	while ((used = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) == ring->capacity) {
+		if (!spins) ring->full++;
+		s_ring_wait(&spins);
+	}
+	memcpy(ring->items + (tail & (ring->capacity - 1)) * ring->item_size, item, ring->item_size);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring->pushes++;
+	ring->occupancy += used + 1;
+	if (used + 1 > ring->highest) ring->highest = used + 1;
+}
+
+static void s_ring_pop(spsc_ring *ring, void *item)
+{
+	size_t head = ring->head;
+	unsigned spins = 0;
+
+	while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+		if (!spins) ring->empty++;
+		s_ring_wait(&spins);
+	}
+	memcpy(item, ring->items + (head & (ring->capacity - 1)) * ring->item_size, ring->item_size);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void s_ring_report(spsc_ring *ring, const char *name)
+{
+	fprintf(stderr, "pipeline: %-10s capacity %5lu, %8lu items, average %7.1f, highest %5lu, full %6lu, empty %6lu\n",
+		name, (unsigned long)ring->capacity, (unsigned long)ring->pushes,
+		ring->pushes ? (double)ring->occupancy / ring->pushes : 0.0,
+		(unsigned long)ring->highest, (unsigned long)ring->full, (unsigned long)ring->empty);
+}
+
+static spsc_ring s_tokens;
+static spsc_ring s_statements;
+
+/* The tokens taken by the parser, only used by the parser thread. */
+static pipe_token *s_history;
+static size_t s_history_count;
+static size_t s_history_max;
+static size_t s_index; /* The next token of the history to give to the parser. */
+static size_t s_pos;   /* The position the parser sees. */
+static bool_t s_ended; /* Whether the last token was taken from the ring. */
+static size_t s_end;   /* The position of the end of the source. */
+
+static void *s_lexer(void *data)
+{
+	pipe_token item;
+	(void)data;
+
+	do {
+		memset(&item, 0, sizeof(item));
+		item.ok = lex_scan(&item.token);
+		item.end = lex_pos();
+		/* Only the end of the source stops the lexer, like a parser that keeps fetching. */
+		item.last = !item.ok && lex_scan(&item.token) == FALSE && lex_pos() == item.end;
+		lex_move(item.end);
+		s_ring_push(&s_tokens, &item);
+	} while (!item.last);
+	return NULL;
+}
+
+static bool_t s_fetch(lex_token *token)
+{
+	pipe_token *item;
+
+	if (s_index == s_history_count) {
+		if (s_ended) {
+			s_pos = s_end;
+			return FALSE;
+		}
+		if (s_history_count == s_history_max) {
+			s_history_max = s_history_max ? s_history_max * 2 : 1024;
+			s_history = realloc(s_history, sizeof(pipe_token) * s_history_max);
+		}
+		s_ring_pop(&s_tokens, &s_history[s_history_count]);
+		if (s_history[s_history_count].last) {
+			s_ended = TRUE;
+			s_pos = s_end = s_history[s_history_count].end;
+			return FALSE;
+		}
+		s_history_count++;
+	}
+
+	item = &s_history[s_index++];
+	s_pos = item->end;
+	if (item->ok) *token = item->token;
+	return item->ok;
+}
+
+static size_t s_position(void)
+{
+	return s_pos;
+}
+
+/* Moves back (or forward) to a position, which is the number of tokens ending before it. */
+static void s_move(size_t pos)
+{
+	size_t low = 0, high = s_history_count, middle;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		if (s_history[middle].end <= pos) low = middle + 1;
+		else high = middle;
+	}
+	s_index = low;
+	s_pos = pos;
+}
+
+/* Forgets the tokens before the next one, which the parser cannot move back to anymore. */
+static void s_rebase(void)
+{
+	s_history_count -= s_index;
+	memmove(s_history, s_history + s_index, sizeof(pipe_token) * s_history_count);
+	s_index = 0;
+}
+
+static const lex_hooks s_pipe_hooks = { s_fetch, s_position, s_move };
+
+static void *s_parser(void *data)
+{
+	lex_token token;
+	pipe_token discard;
+	statement_tree *tree;
+	(void)data;
+
+	lex_redirect(&s_pipe_hooks);
+	while (lex_peek(&token)) {
+		s_rebase();
+		tree = parse_toplevel();
+		if (tree) s_ring_push(&s_statements, &tree);
+	}
+	/* The parser can stop early (error limit), the lexer must not be left waiting. */
+	while (!s_ended) {
+		s_ring_pop(&s_tokens, &discard);
+		s_ended = discard.last;
+	}
+	tree = NULL;
+	s_ring_push(&s_statements, &tree);
+	return NULL;
+}
+
+bool_t compile_pipelined(FILE *sfile, FILE *sout)
+{
+	pthread_t lexer, parser;
+	statement_tree *tree;
+
+	compile_begin(sfile, sout);
+	s_ring_init(&s_tokens, sizeof(pipe_token), TOKEN_RING_SIZE);
+	s_ring_init(&s_statements, sizeof(statement_tree *), STATEMENT_RING_SIZE);
+	s_history = NULL;
+	s_history_count = s_history_max = s_index = s_pos = 0;
+	s_ended = FALSE;
+	s_end = 0;
+
+	/* 1. Starting the lexer and the parser */
+	if (pthread_create(&lexer, NULL, s_lexer, NULL) != 0) {
+		dfatal("cannot start the lexer thread");
+	}
+	if (pthread_create(&parser, NULL, s_parser, NULL) != 0) {
+		dfatal("cannot start the parser thread");
+	}
+
+	/* 2. Generating the statements as they come */
+	for (;;) {
+		s_ring_pop(&s_statements, &tree);
+		if (!tree) break;
+		rreset();
+		g_statement(tree);
+		delete_statement(tree);
+	}
+
+	pthread_join(parser, NULL);
+	pthread_join(lexer, NULL);
+
+	if (pipeline_stats) {
+		s_ring_report(&s_tokens, "tokens");
+		s_ring_report(&s_statements, "statements");
+	}
+	free(s_tokens.items);
+	free(s_statements.items);
+	free(s_history);
+	s_history = NULL;
+	return compile_end();
+}
+
+#else
+
+bool_t compile_pipelined(FILE *sfile, FILE *sout)
+{
+	pipeline = FALSE;
+	return compile_stream(sfile, sout);
+}
+
+#endif
@@ -0,0 +1,373 @@
+/*
+	Profile-guided layout for ECK (-fprofile-generate, -fprofile-use)
+
+	With -fprofile-generate, each if, while and do gets two counters,
+	incremented on its edges by the generated code (gen.c). The code
+	run by --run receives the counters in rdi, and they are written
+	to source.profile once it returns. The counts of several runs add
+	up.
+
+	The profile is a text file: a header with the hash of the source,
+	then a line per branching statement, with its kind, the offset of
+	its keyword and its two edge counts:
+
+		eck-profile 1 <sha256 of the source>
+		i 120 9000 1000
+		w 214 990000 10000
+
+	The counts of an if are its then and else edges, the ones of a
+	loop its iterations and its exits. With -fprofile-use, the code
+	generator looks them up by offset to lay out the hot paths as
+	straight-line code. A profile that does not match its source is
+	ignored with a warning.
+
+	-fprofile-sample-use=FILE reads a sample profile instead, in the
+	text format of AutoFDO, where each source is a function:
+
+		pgo.fd:1500:0
+		 2.14: 1000
+		 3.9: 500
+
+	Each line is a line offset from the start of the source (line 1),
+	with the column as its discriminator, then the number of samples
+	taken in the code of the statement there. perf2eck.py makes it
+	from the output of perf script, for code run with --run -fperf-map
+	(jit.c). The samples are mapped back to the offsets of the
+	statements, and the edges of a branching statement are estimated
+	from the samples of its branches.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_VERSION 1
+
+bool_t profile_generate = FALSE;
+bool_t profile_use = FALSE;
+const char *profile_sample = NULL;
+bool_t perf_map = FALSE;
+
+/* A branching statement of a profile. */
+typedef struct profile_entry
+{
+	char kind;       /* i, w or d. */
+	uint64_t pos;    /* The offset of its keyword. */
+	uint64_t first;  /* The then edge, or the iterations. */
+	uint64_t second; /* The else edge, or the exits. */
+} profile_entry;
+
+/* The statements instrumented, in the order of their counters. */
+static profile_entry *s_counted = NULL;
+static size_t s_counted_count = 0, s_counted_max = 0;
+
+/* The profile loaded, sorted by offset. */
+static profile_entry *s_loaded = NULL;
+static size_t s_loaded_count = 0;
+
+/* The samples loaded, sorted by offset: the first count of an entry is its number of samples. */
+static profile_entry *s_samples = NULL;
+static size_t s_samples_count = 0;
+static bool_t s_sampled = FALSE; /* Whether the source was in the sample profile. */
+
+static char s_kind(statement_tree *tree)
+{
+	switch (tree->kind) {
+		case STATEMENT_IF: return 'i';
+		case STATEMENT_WHILE: return 'w';
+		default: return 'd';
+	}
+}
+
+size_t profile_counter(statement_tree *tree)
+{
+	if (s_counted_count == s_counted_max) {
+		s_counted_max = s_counted_max ? s_counted_max * 2 : 64;
+		s_counted = realloc(s_counted, sizeof(profile_entry) * s_counted_max);
+	}
+	s_counted[s_counted_count].kind = s_kind(tree);
+	s_counted[s_counted_count].pos = tree->token.pos;
+	return 2 * s_counted_count++;
+}
+
+size_t profile_counters(void)
+{
+	return 2 * s_counted_count;
+}
+
+void profile_reset(void)
+{
+	s_counted_count = 0;
+}
+
+char *profile_input(const char *source)
+{
+	char *yield;
+	if (!profile_sample) return profile_name(source);
+	yield = malloc(strlen(profile_sample) + 1);
+	strcpy(yield, profile_sample);
+	return yield;
+}
+
+char *profile_name(const char *source)
+{
+	char *yield = malloc(strlen(source) + 9);
+	sprintf(yield, "%s.profile", source);
+	return yield;
+}
+
+/* Hashes the contents of a source, in hexadecimal. */
+static void s_source_hash(const char *source, char hex[65])
+{
+	sha256_ctx ctx;
+	uint8_t digest[32];
+	size_t size;
+	void *map = map_file(source, &size);
+
+	sha256_init(&ctx);
+	if (map) {
+		sha256_update(&ctx, map, size);
+		unmap_file(map, size);
+	}
+	sha256_final(&ctx, digest);
+	sha256_hex(digest, hex);
+}
+
+/*
+	Reads a profile. Returns the number of entries, which must be
+	freed, or -1 if it cannot be read or was made for another version
+	of the source.
+*/
+static long s_read(const char *path, const char *hash, profile_entry **entries)
+{
+	FILE *in;
+	char found[65], kind;
+	unsigned long pos, first, second;
+	size_t count = 0, max = 0;
+	int version;
+
+	*entries = NULL;
+	in = fopen(path, "r");
+	if (!in) return -1;
+	if (fscanf(in, "eck-profile %d %64s", &version, found) != 2 || version != PROFILE_VERSION || strcmp(found, hash)) {
+		fclose(in);
+		return -1;
+	}
+	while (fscanf(in, " %c %lu %lu %lu", &kind, &pos, &first, &second) == 4) {
+		if (count == max) {
+			max = max ? max * 2 : 64;
+			*entries = realloc(*entries, sizeof(profile_entry) * max);
+		}
+		(*entries)[count].kind = kind;
+		(*entries)[count].pos = pos;
+		(*entries)[count].first = first;
+		(*entries)[count].second = second;
+		count++;
+	}
+	fclose(in);
+	return (long)count;
+}
+
+bool_t profile_write(const char *source, const uint64_t *counters)
+{
+	profile_entry *previous;
+	char hash[65], *path;
+	long count;
+	size_t i;
+	FILE *out;
+
+	/* 1. Turning the counters into edges: an if counts its executions, not its else edge */
+	for (i = 0; i < s_counted_count; i++) {
+		s_counted[i].first = counters[2 * i];
+		s_counted[i].second = counters[2 * i + 1];
+		if (s_counted[i].kind == 'i') s_counted[i].second -= s_counted[i].first;
+	}
+
+	/* 2. Adding up the counts of the previous runs of the same source */
+	s_source_hash(source, hash);
+	path = profile_name(source);
+	count = s_read(path, hash, &previous);
+	if (count == (long)s_counted_count) {
+		for (i = 0; i < s_counted_count; i++) {
+			if (previous[i].pos != s_counted[i].pos || previous[i].kind != s_counted[i].kind) break;
+		}
+		if (i == s_counted_count) {
+			for (i = 0; i < s_counted_count; i++) {
+				s_counted[i].first += previous[i].first;
+				s_counted[i].second += previous[i].second;
+			}
+		}
+	}
+	free(previous);
+
+	/* 3. Writing it */
+	out = fopen(path, "w");
+	if (!out) {
+		fprintf(stderr, "%s: cannot write the profile\n", path);
+		free(path);
+		return FALSE;
+	}
+	fprintf(out, "eck-profile %d %s\n", PROFILE_VERSION, hash);
+	for (i = 0; i < s_counted_count; i++) {
+		fprintf(out, "%c %lu %lu %lu\n", s_counted[i].kind, (unsigned long)s_counted[i].pos,
+			(unsigned long)s_counted[i].first, (unsigned long)s_counted[i].second);
+	}
+	free(path);
+	return fclose(out) == 0;
+}
+
+static int s_by_pos(const void *a, const void *b)
+{
+	const profile_entry *l = a, *r = b;
+	return l->pos < r->pos ? -1 : (l->pos > r->pos);
+}
+
+/* Whether a function of the sample profile is a source. */
+static bool_t s_same_source(const char *function, const char *source)
+{
+	const char *base = strrchr(source, '/');
+	return !strcmp(function, source) || (base && !strcmp(function, base + 1));
+}
+
+static int s_by_site(const void *a, const void *b)
+{
+	const profile_entry *l = a, *r = b;
+	if (l->first != r->first) return l->first < r->first ? -1 : 1;
+	return l->second < r->second ? -1 : (l->second > r->second);
+}
+
+/*
+	Reads the samples of a source. The lines and columns are turned
+	back into offsets by counting them like lex_sites, so a sample
+	lands on the statement it was taken in.
+*/
+static void s_load_samples(const char *source)
+{
+	profile_entry *sites = NULL, key, *found;
+	char line[1024], *function;
+	unsigned long offset, column, samples;
+	size_t count = 0, max = 0, size, at, row = 1, col = 1;
+	const char *map;
+	bool_t current = FALSE;
+	FILE *in;
+
+	s_sampled = FALSE;
+	in = fopen(profile_sample, "r");
+	if (!in) {
+		fprintf(stderr, "%s: cannot open the sample profile\n", profile_sample);
+		return;
+	}
+	/* 1. Reading the lines of the source: "line.column: samples" under "source:total:head" */
+	while (fgets(line, sizeof(line), in)) {
+		if (line[0] != ' ') {
+			function = strtok(line, ":");
+			current = function && s_same_source(function, source);
+			s_sampled |= current;
+			continue;
+		}
+		if (!current || sscanf(line, " %lu.%lu: %lu", &offset, &column, &samples) != 3) continue;
+		if (count == max) {
+			max = max ? max * 2 : 64;
+			sites = realloc(sites, sizeof(profile_entry) * max);
+		}
+		sites[count].kind = 0;
+		sites[count].first = offset + 1; /* line */
+		sites[count].second = column;
+		sites[count++].pos = samples;
+	}
+	fclose(in);
+	if (!s_sampled) {
+		fprintf(stderr, "%s: not in the sample profile, the layout is not profiled\n", source);
+		free(sites);
+		return;
+	}
+
+	/* 2. Finding their offsets */
+	qsort(sites, count, sizeof(profile_entry), s_by_site);
+	s_samples = malloc(sizeof(profile_entry) * (count + 1));
+	map = map_file(source, &size);
+	for (at = 0; map && at <= size && count; at++) {
+		key.first = row;
+		key.second = col + 1;
+		found = bsearch(&key, sites, count, sizeof(profile_entry), s_by_site);
+		if (found && found->kind != 'x') {
+			s_samples[s_samples_count].pos = at;
+			s_samples[s_samples_count++].first = found->pos;
+			found->kind = 'x'; /* taken */
+		}
+		if (at == size) break;
+		if (map[at] == '\n') {
+			row++;
+			col = 0;
+		} else if (map[at] == '\r') {
+			col = 0;
+		} else if (map[at] == '\f') {
+			row++;
+		} else if (map[at] == '\t') {
+			col += 4;
+		} else {
+			col++;
+		}
+	}
+	if (map) unmap_file((void *)map, size);
+	free(sites);
+}
+
+void profile_load(const char *source)
+{
+	char hash[65], *path;
+	long count;
+
+	free(s_loaded);
+	free(s_samples);
+	s_loaded = s_samples = NULL;
+	s_loaded_count = s_samples_count = 0;
+	if (profile_sample) {
+		s_load_samples(source);
+		return;
+	}
+	s_source_hash(source, hash);
+	path = profile_name(source);
+	count = s_read(path, hash, &s_loaded);
+	if (count < 0) {
+		fprintf(stderr, "%s: no profile matching this source, the layout is not profiled\n", source);
+	} else {
+		s_loaded_count = (size_t)count;
+		qsort(s_loaded, s_loaded_count, sizeof(profile_entry), s_by_pos);
+	}
+	free(path);
+}
+
+/* Gets the samples taken in a statement and in the statements nested in it. */
+static uint64_t s_weight(statement_tree *tree)
+{
+	profile_entry key, *found;
+	uint64_t yield = 0;
+	size_t i;
+	if (!tree) return 0;
+	key.pos = tree->token.pos;
+	found = bsearch(&key, s_samples, s_samples_count, sizeof(profile_entry), s_by_pos);
+	if (found) yield = found->first;
+	for (i = 0; i < tree->childcount; i++) {
+		yield += s_weight(tree->children[i]);
+	}
+	return yield + s_weight(tree->body) + s_weight(tree->otherwise);
+}
+
+bool_t profile_lookup(statement_tree *tree, uint64_t *first, uint64_t *second)
+{
+	profile_entry key, *found;
+	if (s_sampled) {
+		/* The samples of the branches stand for their edges. A loop whose body was sampled iterates. */
+		*first = s_weight(tree->body);
+		*second = tree->kind == STATEMENT_IF ? s_weight(tree->otherwise) : 0;
+		return TRUE;
+	}
+	if (!s_loaded_count) return FALSE;
+	key.pos = tree->token.pos;
+	found = bsearch(&key, s_loaded, s_loaded_count, sizeof(profile_entry), s_by_pos);
+	if (!found || found->kind != s_kind(tree)) return FALSE;
+	*first = found->first;
+	*second = found->second;
+	return TRUE;
+}
@@ -0,0 +1,315 @@
+/*
+	Compile server for ECK
+
+	Build systems call eck on a lot of tiny files. The server is
+	started once and listens on a local socket. Each connection
+	is handled by a process forked from the server, and each
+	request by a worker forked from that process: a compilation
+	costs a fork instead of the exec and the dynamic linking of
+	a new process, and one that aborts never takes the server
+	down. The compiler has no state worth keeping warm between
+	requests, so each worker starts from the clean state of the
+	server.
+
+	A worker moves to the directory of the client and applies
+	its options before compiling, so the result is the same as
+	compiling in-process.
+
+	The protocol is made of fixed headers followed by strings:
+	  request:  server_request, source, output, directory, options
+	  reply:    server_reply, diagnostics
+	The options are terminated by a null character each. Integers
+	are sent in the byte order of the host, as both ends are on
+	the same machine.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+const char *server_path = NULL;
+char **server_options = NULL;
+size_t server_option_count = 0;
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* A compilation request. */
+typedef struct server_request
+{
+	uint32_t source_length;    /* The length of the source path */
+	uint32_t output_length;    /* The length of the output path */
+	uint32_t directory_length; /* The length of the working directory of the client */
+	uint32_t options_length;   /* The length of the options, their terminators included */
+	uint32_t option_count;     /* The number of options */
+} server_request;
+
+/* The reply to a compilation request. */
+typedef struct server_reply
+{
+	uint32_t status;      /* The exit status of the worker. */
+	uint32_t signal;      /* The signal that killed the worker, 0 if none. */
+	uint32_t diag_length; /* The length of the diagnostics. */
+} server_reply;
+
+static bool_t s_read_all(int fd, void *buffer, size_t length)
+{
+	char *at = buffer;
+	ssize_t n;
+	while (length) {
+		n = read(fd, at, length);
+		if (n <= 0) return FALSE;
+		at += n;
+		length -= n;
+	}
+	return TRUE;
+}
+
+static bool_t s_write_all(int fd, const void *buffer, size_t length)
+{
+	const char *at = buffer;
+	ssize_t n;
+	while (length) {
+		n = write(fd, at, length);
+		if (n <= 0) return FALSE;
+		at += n;
+		length -= n;
+	}
+	return TRUE;
+}
+
+/* Reads a string of a known length. Must be freed. */
+static char *s_read_string(int fd, size_t length)
+{
+	char *yield = malloc(length + 1);
+	if (!s_read_all(fd, yield, length)) {
+		free(yield);
+		return NULL;
+	}
+	yield[length] = 0;
+	return yield;
+}
+
+static void s_address(struct sockaddr_un *address, const char *path)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) {
+		dfatal("socket path '%s' is too long", path);
+	}
+	strcpy(address->sun_path, path);
+}
+
+/* Applies the options of a request, in a worker. */
+static void s_apply(server_request *request, char *options)
+{
+	char **argv = malloc(sizeof(char *) * (request->option_count + 1));
+	char *at = options, *end = options + request->options_length;
+	uint32_t i;
+	for (i = 0; i < request->option_count && at < end; i++) {
+		argv[i] = at;
+		at += strlen(at) + 1;
+	}
+	argv[i] = NULL;
+	options_apply((int)i, argv);
+	free(argv);
+}
+
+/* Compiles a request in a worker. The diagnostics are written to log. */
+static void s_compile(server_request *request, const char *source, const char *output, const char *directory, char *options, FILE *log, server_reply *reply)
+{
+	pid_t pid;
+	int status;
+
+	fflush(NULL);
+	pid = fork();
+	if (pid == 0) {
+		bool_t ok;
+		dup2(fileno(log), 2);
+		if (chdir(directory) < 0) {
+			dfatal("cannot compile in '%s'", directory);
+		}
+		s_apply(request, options);
+		ok = compile_object(source, output);
+		fflush(NULL);
+		_exit(ok ? 0 : 1);
+	}
+
+	memset(reply, 0, sizeof(*reply));
+	if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+		fprintf(log, "(internal)\x1B[31m fatal: could not start a worker\x1B[0m\n");
+		reply->status = 1;
+	} else if (WIFSIGNALED(status)) {
+		reply->status = 1;
+		reply->signal = WTERMSIG(status);
+	} else {
+		reply->status = WEXITSTATUS(status);
+	}
+	fseek(log, 0, SEEK_END);
+	reply->diag_length = ftell(log);
+}
+
+/* Serves all of the requests of a single connection. */
+static void s_serve(int fd)
+{
+	server_request request;
+	server_reply reply;
+	char *source, *output, *directory, *options, buffer[4096];
+	FILE *log;
+	size_t n;
+
+	while (s_read_all(fd, &request, sizeof(request))) {
+		source = s_read_string(fd, request.source_length);
+		output = source ? s_read_string(fd, request.output_length) : NULL;
+		directory = output ? s_read_string(fd, request.directory_length) : NULL;
+		options = directory ? s_read_string(fd, request.options_length) : NULL;
+		if (!options) {
+			free(source);
+			free(output);
+			free(directory);
+			return;
+		}
+
+		log = tmpfile();
+		if (!log) {
+			dfatal("cannot create the diagnostics log");
+		}
+		s_compile(&request, source, output, directory, options, log, &reply);
+		free(source);
+		free(output);
+		free(directory);
+		free(options);
+
+		if (!s_write_all(fd, &reply, sizeof(reply))) {
+			fclose(log);
+			return;
+		}
+		rewind(log);
+		while ((n = fread(buffer, 1, sizeof(buffer), log)) != 0) {
+			if (!s_write_all(fd, buffer, n)) break;
+		}
+		fclose(log);
+	}
+}
+
+void server_run(const char *path)
+{
+	struct sockaddr_un address;
+	int listener, fd;
+	pid_t pid;
+
+	s_address(&address, path);
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) {
+		dfatal("cannot create the server socket");
+	}
+	unlink(path); /* stale socket of a previous server */
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+	 || listen(listener, 64) < 0) {
+		dfatal("cannot listen on '%s'", path);
+	}
+
+	for (;;) {
+		/* Collecting the connections that have been closed. */
+		while (waitpid(-1, NULL, WNOHANG) > 0);
+
+		fd = accept(listener, NULL, NULL);
+		if (fd < 0) continue;
+
+		fflush(NULL);
+		pid = fork();
+		if (pid == 0) {
+			close(listener);
+			s_serve(fd);
+			close(fd);
+			_exit(0);
+		}
+		if (pid < 0) {
+			/* No process left, serving it here. */
+			s_serve(fd);
+		}
+		close(fd);
+	}
+}
+
+
+bool_t compile_remote(const char *source, const char *output)
+{
+	struct sockaddr_un address;
+	server_request request;
+	server_reply reply;
+	char directory[4096], *options, *at, *diags;
+	size_t i;
+	int fd;
+
+	s_address(&address, server_path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		dfatal("cannot connect to the compile server at '%s'", server_path);
+	}
+
+	/* The paths are relative to the directory of the client, which the worker moves to. */
+	if (!getcwd(directory, sizeof(directory))) {
+		dfatal("cannot get the current directory");
+	}
+	request.source_length = strlen(source);
+	request.output_length = strlen(output);
+	request.directory_length = strlen(directory);
+	request.options_length = 0;
+	request.option_count = server_option_count;
+	for (i = 0; i < server_option_count; i++) {
+		request.options_length += strlen(server_options[i]) + 1;
+	}
+	options = at = malloc(request.options_length + 1);
+	for (i = 0; i < server_option_count; i++) {
+		strcpy(at, server_options[i]);
+		at += strlen(at) + 1;
+	}
+	if (!s_write_all(fd, &request, sizeof(request))
+	 || !s_write_all(fd, source, request.source_length)
+	 || !s_write_all(fd, output, request.output_length)
+	 || !s_write_all(fd, directory, request.directory_length)
+	 || !s_write_all(fd, options, request.options_length)
+	 || !s_read_all(fd, &reply, sizeof(reply))
+	 || (diags = s_read_string(fd, reply.diag_length)) == NULL) {
+		dfatal("lost the connection to the compile server");
+		return FALSE;
+	}
+	close(fd);
+	free(options);
+
+	DISCARD(fwrite(diags, 1, reply.diag_length, stderr));
+	free(diags);
+
+	/* A compilation that crashed in the server also crashes here. */
+	if (reply.signal) {
+		fflush(NULL);
+		signal(reply.signal, SIG_DFL);
+		raise(reply.signal);
+	}
+	return reply.status == 0;
+}
+
+#else
+
+void server_run(const char *path)
+{
+	(void)path;
+	dfatal("the compile server is not supported on this platform");
+}
+
+bool_t compile_remote(const char *source, const char *output)
+{
+	(void)source;
+	(void)output;
+	dfatal("the compile server is not supported on this platform");
+	return FALSE;
+}
+
+#endif
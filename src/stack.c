@@ -0,0 +1,161 @@
+/*
+	Stack usage for ECK (-fstack-usage)
+
+	The language has no functions yet: the code of a source is its
+	top-level statements, so each one is reported as a function.
+	While a statement is generated, emit() passes the instructions
+	that move rsp here, which follows the depth of the stack:
+	  - push and pop, such as the spill of rdx around a modulo;
+	  - the frames of the blocks (required_size_for_scope), made with
+	    push rbp, mov rbp, rsp and sub rsp, and freed by restoring
+	    rsp from rbp;
+	  - the return address of a call, as the hooks of
+	    -finstrument-functions are called.
+	The deepest point of a statement is its usage, relative to the
+	stack when it starts.
+
+	Once the source is done, source.su gets a line per statement, in
+	the format of GCC:
+
+		test.fd:3:1:while	24	static
+
+	Every frame has a size known at compile time. Without calls
+	between statements, there are no call chains to add up nor any
+	recursion to flag: the worst case of a source is its deepest
+	statement. The hooks of -finstrument-functions are outside of it.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool_t stack_usage = FALSE;
+
+static const char *const s_kinds[] = { "expression", "block", "if", "while", "do" };
+
+/* A top-level statement measured. */
+typedef struct stack_function
+{
+	uint64_t pos;
+	uint8_t kind;
+	size_t bytes;
+} stack_function;
+
+/* The statement being generated, by the thread generating it. */
+static ECK_TLS bool_t s_open = FALSE;
+static ECK_TLS size_t s_depth = 0, s_deepest = 0;
+static ECK_TLS stack_function s_current;
+
+/* The depths rbp was set at, for each frame being built. */
+static ECK_TLS size_t *s_frames = NULL;
+static ECK_TLS size_t s_frame_count = 0, s_frame_max = 0;
+
+/* The statements of the source. */
+static stack_function *s_functions = NULL;
+static size_t s_function_count = 0, s_function_max = 0;
+
+void stack_begin(statement_tree *tree)
+{
+	s_current.pos = tree->token.pos;
+	s_current.kind = (uint8_t)tree->kind;
+	s_depth = s_deepest = s_frame_count = 0;
+	s_open = TRUE;
+}
+
+static void s_grow(size_t bytes)
+{
+	s_depth += bytes;
+	if (s_depth > s_deepest) s_deepest = s_depth;
+}
+
+static void s_shrink(size_t bytes)
+{
+	s_depth = bytes > s_depth ? 0 : s_depth - bytes;
+}
+
+void stack_track(insn op, const operand *a, const operand *b)
+{
+	bool_t rsp = a->kind == OPERAND_REGISTER && a->reg == REG_RSP;
+	if (!s_open) return;
+	switch (op) {
+		case INSN_PUSH:
+			s_grow(8);
+			break;
+		case INSN_POP:
+			s_shrink(8);
+			break;
+		case INSN_CALL:
+			/* The return address, popped by the callee. */
+			s_grow(8);
+			s_shrink(8);
+			break;
+		case INSN_SUB:
+			if (rsp && b->kind == OPERAND_IMMEDIATE) s_grow((size_t)b->value);
+			break;
+		case INSN_ADD:
+			if (rsp && b->kind == OPERAND_IMMEDIATE) s_shrink((size_t)b->value);
+			break;
+		case INSN_MOV:
+			if (a->kind == OPERAND_REGISTER && a->reg == REG_RBP && b->kind == OPERAND_REGISTER && b->reg == REG_RSP) {
+				if (s_frame_count == s_frame_max) {
+					s_frame_max = s_frame_max ? s_frame_max * 2 : 16;
+					s_frames = realloc(s_frames, sizeof(size_t) * s_frame_max);
+				}
+				s_frames[s_frame_count++] = s_depth;
+			} else if (rsp && b->kind == OPERAND_REGISTER && b->reg == REG_RBP && s_frame_count) {
+				s_depth = s_frames[--s_frame_count];
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void stack_end(void)
+{
+	s_open = FALSE;
+	if (s_function_count == s_function_max) {
+		s_function_max = s_function_max ? s_function_max * 2 : 64;
+		s_functions = realloc(s_functions, sizeof(stack_function) * s_function_max);
+	}
+	s_current.bytes = s_deepest;
+	s_functions[s_function_count++] = s_current;
+}
+
+bool_t stack_write(const char *source)
+{
+	uint64_t *positions;
+	size_t *lines, *cols, i;
+	char *path;
+	FILE *out;
+	int status;
+
+	positions = malloc(sizeof(uint64_t) * (s_function_count + 1));
+	lines = malloc(sizeof(size_t) * (s_function_count + 1));
+	cols = malloc(sizeof(size_t) * (s_function_count + 1));
+	/* The statements are measured in the order of the source. */
+	for (i = 0; i < s_function_count; i++) {
+		positions[i] = s_functions[i].pos;
+	}
+	lex_sites(positions, s_function_count, lines, cols);
+
+	path = malloc(strlen(source) + 4);
+	sprintf(path, "%s.su", source);
+	out = fopen(path, "w");
+	if (out) {
+		for (i = 0; i < s_function_count; i++) {
+			fprintf(out, "%s:%lu:%lu:%s\t%lu\tstatic\n", source, (unsigned long)lines[i], (unsigned long)cols[i],
+				s_kinds[s_functions[i].kind], (unsigned long)s_functions[i].bytes);
+		}
+		status = fclose(out);
+	} else {
+		status = EOF;
+	}
+	if (status) fprintf(stderr, "%s: cannot write the stack usage\n", path);
+	free(positions);
+	free(lines);
+	free(cols);
+	free(path);
+	s_function_count = 0;
+	return status == 0;
+}
@@ -14,18 +14,18 @@ void scope_enter(void)
 	/*
 		1. Create a new scope
 	*/
-	new = calloc(1, sizeof(scope));
+	new = MEM_CALLOC(MEM_SYMBOLS, 1, sizeof(scope));
 	new->parent = head; /* The new scope is under the current scope. */
 
 	/* 2. Adding a new child to the list */
 	if (head->childcount == 0) {
 		/* If the current node has no children */
-		head->children = malloc(sizeof(scope *));
+		head->children = MEM_MALLOC(MEM_SYMBOLS, sizeof(scope *));
 		head->childcount++;
 		head->children[0] = new;
 	} else {
 		/* If the current node has children */
-		head->children = realloc(
+		head->children = MEM_REALLOC(MEM_SYMBOLS,
 			head->children,
 			sizeof(scope *) * (head->childcount + 1)
 		);
@@ -52,20 +52,27 @@ void destroy_scopes(scope *s)
 	size_t i;
 	if (s == NULL) {
 		/* Destroy base. Annihilate. */
-		for (i = 0; i < base.childcount; i++) {
-			destroy_scopes(base.children[i]);
-		}
-		if (base.symbols) free(base.symbols);
-		if (base.children) free(base.children);
+		destroy_scopes(&base);
+		memset(&base, 0, sizeof(scope));
+		head = &base;
 	} else {
 		for (i = 0; i < s->childcount; i++) {
 			destroy_scopes(s->children[i]);
+			MEM_FREE(MEM_SYMBOLS, s->children[i]);
+		}
+		for (i = 0; i < s->symbolcount; i++) {
+			MEM_FREE(MEM_SYMBOLS, (char *)s->symbols[i].name);
 		}
-		if (s->symbols) free(s->symbols);
-		if (s->children) free(s->children);
+		if (s->symbols) MEM_FREE(MEM_SYMBOLS, s->symbols);
+		if (s->children) MEM_FREE(MEM_SYMBOLS, s->children);
 	}
 }
 
+scope *scope_base(void)
+{
+	return &base;
+}
+
 static bool_t internal_declared(scope *s, const char *name)
 {
 	size_t i;
@@ -98,18 +105,33 @@ bool_t decl(const char *name, foodtype *t)
 	if (head->symbolcount == 0) {
 		/* No symbols yet? No problem */
 		head->symbolcount++;
-		head->symbols = malloc(sizeof(symbol));
+		head->symbols = MEM_MALLOC(MEM_SYMBOLS, sizeof(symbol));
 	} else {
 		/* Resizing array to allow for more symbols */
 		head->symbolcount++;
-		head->symbols = realloc(head->symbols, sizeof(symbol) * head->symbolcount);
+		head->symbols = MEM_REALLOC(MEM_SYMBOLS, head->symbols, sizeof(symbol) * head->symbolcount);
 	}
-	head->symbols[head->symbolcount - 1].name = malloc(strlen(name));
+	head->symbols[head->symbolcount - 1].name = MEM_MALLOC(MEM_SYMBOLS, strlen(name) + 1);
 	strcpy((char *)head->symbols[head->symbolcount - 1].name, name);
 	memcpy(&(head->symbols[head->symbolcount - 1].t), t, sizeof(foodtype));
+	head->symbols[head->symbolcount - 1].flags = 0;
 	return TRUE;
 }
 
+symbol *lookup(const char *name)
+{
+	scope *s;
+	size_t i;
+
+	for (s = head; s; s = s->parent) {
+		for (i = 0; i < s->symbolcount; i++) {
+			if (!strcmp(s->symbols[i].name, name))
+				return &s->symbols[i];
+		}
+	}
+	return NULL;
+}
+
 bool_t decltype(foodtype *dest, const char *name)
 {
 	size_t i;
@@ -1,6 +1,7 @@
 #include "../common/def.h"
 
 #include <assert.h>
+#include <stdlib.h>
 
 void declaration(void)
 {
@@ -43,6 +44,86 @@ void declaration(void)
 	}
 }
 
+/* Parses the name and the semicolon that follow namespace and using. */
+static bool_t s_module_clause(lex_token *name, const char *what)
+{
+	lex_token tok;
+
+	lex_fetch(&tok); /* namespace or using */
+	if (!lex_fetch(name) || name->kind != 'I') {
+		derror(name, "expected the name of a module after %s\n", what);
+		return FALSE;
+	}
+	if (!lex_fetch(&tok) || tok.kind != ';') {
+		derror(&tok, "expected a semicolon\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void namespace_declaration(void)
+{
+	lex_token name;
+	if (s_module_clause(&name, "namespace")) {
+		module_name(name.value.str, &name);
+	}
+}
+
+void using_declaration(void)
+{
+	lex_token name;
+	if (s_module_clause(&name, "using")) {
+		module_import(name.value.str, &name);
+	}
+}
+
+statement_tree *parse_toplevel(void)
+{
+	foodtype discard_foodtype;
+	statement_tree *tree;
+	lex_token tok;
+	size_t base;
+
+	if (!lex_peek(&tok)) {
+		derror(&tok, "expected a declaration or a statement\n");
+		return NULL;
+	}
+	if (tok.kind == KEYWORD_NAMESPACE) {
+		namespace_declaration();
+		return NULL;
+	}
+
+	/* Global declarations */
+	base = lex_pos();
+	if (tparse(&discard_foodtype)) {
+		lex_move(base);
+		declaration();
+		return NULL;
+	}
+	lex_move(base);
+	tree = parse_statement();
+	return tree ? passes_run(tree) : NULL;
+}
+
+void toplevel(void)
+{
+	statement_tree *tree;
+	lex_token tok;
+
+	/* The statement is located by its first token. */
+	if (time_enabled) {
+		tok.pos = 0;
+		lex_peek(&tok);
+		time_enter(PHASE_STATEMENT, tok.pos);
+	}
+	tree = parse_toplevel();
+	if (tree) {
+		g_statement(tree);
+		delete_statement(tree);
+	}
+	if (time_enabled) time_leave(PHASE_STATEMENT);
+}
+
 static void parse_locals(void)
 {
 	foodtype discard_foodtype;
@@ -57,184 +138,195 @@ static void parse_locals(void)
 	lex_move(base);
 }
 
-void statement(void)
+/* A constructor for a statement tree. */
+static statement_tree *s_statement_tree(statement_kind kind, lex_token *token)
+{
+	statement_tree *yield = MEM_CALLOC(MEM_PARSER, 1, sizeof(statement_tree));
+	yield->kind = kind;
+	yield->token = *token;
+	return yield;
+}
+
+/* Parses a bracketed condition, as found after if and while. */
+static expression *s_condition(void)
 {
 	lex_token tok;
+	expression *condition;
+	if (!lex_fetch(&tok)) {
+		derror(&tok, "expected open bracket (\n");
+		return NULL;
+	}
+	if (tok.kind != '(') {
+		derror(&tok, "expected open bracket (\n");
+		return NULL;
+	}
+	condition = parse_expression();
+	if (!lex_fetch(&tok)) {
+		derror(&tok, "expected closing bracket )\n");
+		delete_tree(condition);
+		return NULL;
+	}
+	if (tok.kind != ')') {
+		derror(&tok, "expected closing bracket )\n");
+		delete_tree(condition);
+		return NULL;
+	}
+	return condition;
+}
+
+statement_tree *parse_statement(void)
+{
+	lex_token tok;
+	statement_tree *yield;
 	if (!lex_peek(&tok)) {
 		derror(&tok, "expected a statement\n");
-		return;
+		return NULL;
 	}
 
 	switch (tok.kind) {
 
 		case ';':
 			lex_fetch(&tok);
-			return;
+			return NULL;
+
+		case KEYWORD_USING:
+			using_declaration();
+			return NULL;
+
+		case KEYWORD_NAMESPACE: {
+			lex_token name;
+			if (s_module_clause(&name, "namespace")) {
+				derror(&name, "namespaces can only be declared at file scope\n");
+			}
+			return NULL;
+		}
 		
 		case '{': {
-			size_t to_allocate = 0;
+			statement_tree *child;
+			size_t max = 0;
 			lex_fetch(&tok);
+			yield = s_statement_tree(STATEMENT_BLOCK, &tok);
 			scope_enter();
 			parse_locals();
-			to_allocate = required_size_for_scope();
-			if (to_allocate) {
-				code("push rbp");
-				code("mov rbp, rsp");
-				code("sub rsp, %d", to_allocate);
-			}
+			yield->frame = required_size_for_scope();
 			while (lex_peek(&tok) && tok.kind != '}') {
-				statement();
+				child = parse_statement();
+				if (!child) continue;
+				if (yield->childcount == max) {
+					max = max ? max * 2 : 8;
+					yield->children = MEM_REALLOC(MEM_PARSER, yield->children, sizeof(statement_tree *) * max);
+				}
+				yield->children[yield->childcount++] = child;
 			}
 			lex_fetch(&tok);
 			scope_leave();
-			if (to_allocate) {
-				code("pop rbp");
-			}
-			return;
+			return yield;
 		}
 
 		case KEYWORD_IF: {
 			expression *condition;
-			int condition_reg;
-			uint64_t condition_label, then_label, lead_label, else_label = 0;
 			lex_fetch(&tok);
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			if (tok.kind != '(') {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			condition = parse_expression();
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected closing bracket )\n");
-				return;
+			condition = s_condition();
+			if (!condition) {
+				return NULL;
 			}
-			if (tok.kind != ')') {
-				derror(&tok, "expected closing bracket )\n");
-				return;
-			}
-			condition_label = label();
-			then_label = label();
-			lead_label = label();
-			goto_label("jmp", condition_label);
-			here_label(then_label);
-			statement();
-			goto_label("jmp", lead_label);
+			yield = s_statement_tree(STATEMENT_IF, &tok);
+			yield->condition = condition;
+			yield->body = parse_statement();
 			if (lex_peek(&tok) && tok.kind == KEYWORD_ELSE) {
 				lex_fetch(&tok);
-				else_label = label();
-				here_label(else_label);
-				statement();
-				goto_label("jmp", lead_label);
+				yield->otherwise = parse_statement();
+				yield->has_else = TRUE;
 			}
-			here_label(condition_label);
-			condition_reg = g_expression(condition);
-			rfree(condition_reg);
-			code("test %s, %s", rget(condition_reg, 1), rget(condition_reg, 1));
-			goto_label("jne", then_label);
-			/* The else label must be non-null at this point, as we generate at least three labels before. */
-			if (else_label) goto_label("jmp", else_label);
-			here_label(lead_label);
-			return;
+			return yield;
 		}
 
 		case KEYWORD_WHILE: {
 			expression *condition;
-			int condition_reg;
-			uint64_t condition_label, lead_label;
 			lex_fetch(&tok);
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			if (tok.kind != '(') {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			condition = parse_expression();
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected closing bracket )\n");
-				return;
-			}
-			if (tok.kind != ')') {
-				derror(&tok, "expected closing bracket )\n");
-				return;
+			condition = s_condition();
+			if (!condition) {
+				return NULL;
 			}
-			condition_label = label();
-			lead_label = label();
-			here_label(condition_label);
-			condition_reg = g_expression(condition);
-			rfree(condition_reg); /* TODO: should this be done? */
-			code("test %s, %s", rget(condition_reg, 1), rget(condition_reg, 1));
-			goto_label("je", lead_label);
-			statement();
-			goto_label("jmp", condition_label);
-			here_label(lead_label);
-			return;
+			yield = s_statement_tree(STATEMENT_WHILE, &tok);
+			yield->condition = condition;
+			yield->body = parse_statement();
+			return yield;
 		}
 
 		case KEYWORD_DO: {
-			uint64_t do_label;
+			statement_tree *body;
 			expression *condition;
-			int condition_reg;
+			lex_token site = tok;
 			lex_fetch(&tok);
-			do_label = label();
-			here_label(do_label);
-			statement();
+			body = parse_statement();
 			if (!lex_fetch(&tok)) {
 				derror(&tok, "expected while keyword\n");
-				return;
+				delete_statement(body);
+				return NULL;
 			}
 			if (tok.kind != KEYWORD_WHILE) {
 				derror(&tok, "expected closing bracket )\n");
-				return;
-			}
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			if (tok.kind != '(') {
-				derror(&tok, "expected open bracket (\n");
-				return;
-			}
-			condition = parse_expression();
-			if (!lex_fetch(&tok)) {
-				derror(&tok, "expected closing bracket )\n");
-				return;
+				delete_statement(body);
+				return NULL;
 			}
-			if (tok.kind != ')') {
-				derror(&tok, "expected closing bracket )\n");
-				return;
+			condition = s_condition();
+			if (!condition) {
+				delete_statement(body);
+				return NULL;
 			}
-			if (!lex_fetch(&tok)) {
+			if (!lex_fetch(&tok) || tok.kind != ';') {
 				derror(&tok, "expected semicolon ;\n");
-				return;
+				delete_statement(body);
+				delete_tree(condition);
+				return NULL;
 			}
-			if (tok.kind != ';') {
-				derror(&tok, "expected semicolon ;\n");
-				return;
-			}
-			condition_reg = g_expression(condition);
-			code("test %s, %s", rget(condition_reg, 1), rget(condition_reg, 1));
-			goto_label("jne", do_label);
-			return;
+			yield = s_statement_tree(STATEMENT_DO, &site);
+			yield->condition = condition;
+			yield->body = body;
+			return yield;
 		}
 
 		default: {
+			lex_token site = tok;
 			expression *tree;
 			tree = parse_expression();
 			if (!lex_fetch(&tok)) {
 				derror(&tok, "expected a semicolon\n");
-				return;
+				delete_tree(tree);
+				return NULL;
 			}
 			if (tok.kind != ';') {
 				derror(&tok, "expected a semicolon\n");
-				return;
+				delete_tree(tree);
+				return NULL;
 			}
-			rfree(g_expression(tree));
-			delete_tree(tree);
+			yield = s_statement_tree(STATEMENT_EXPRESSION, &site);
+			yield->condition = tree;
+			return yield;
 		}
 	}
 }
+
+void delete_statement(statement_tree *tree)
+{
+	size_t i;
+	if (!tree) return;
+	if (tree->condition) delete_tree(tree->condition);
+	delete_statement(tree->body);
+	delete_statement(tree->otherwise);
+	for (i = 0; i < tree->childcount; i++) {
+		delete_statement(tree->children[i]);
+	}
+	MEM_FREE(MEM_PARSER, tree->children);
+	MEM_FREE(MEM_PARSER, tree);
+}
+
+void statement(void)
+{
+	statement_tree *tree = parse_statement();
+	if (tree) {
+		g_statement(tree);
+		delete_statement(tree);
+	}
+}
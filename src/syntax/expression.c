@@ -12,7 +12,7 @@
 /* A constructor for a literal expression. */
 static expression *s_literal_expression(uint32_t kind, lex_token *token, foodtype *type)
 {
-	expression *yield = malloc(sizeof(expression));
+	expression *yield = MEM_MALLOC(MEM_PARSER, sizeof(expression));
 	memset(yield, 0, sizeof(expression));
 	yield->kind = kind;
 	yield->token = *token;
@@ -23,7 +23,7 @@ static expression *s_literal_expression(uint32_t kind, lex_token *token, foodtyp
 /* A constructor for an unary expression.*/
 static expression *s_unary_expression(uint32_t kind, lex_token *token, foodtype *type, expression *child)
 {
-	expression *yield = malloc(sizeof(expression));
+	expression *yield = MEM_MALLOC(MEM_PARSER, sizeof(expression));
 	memset(yield, 0, sizeof(expression));
 	yield->kind = kind;
 	yield->token = *token;
@@ -35,7 +35,7 @@ static expression *s_unary_expression(uint32_t kind, lex_token *token, foodtype
 /* A constructor for a binary expression. */
 static expression *s_binary_expression(uint32_t kind, lex_token *token, foodtype *type, expression *left, expression *right)
 {
-	expression *yield = malloc(sizeof(expression));
+	expression *yield = MEM_MALLOC(MEM_PARSER, sizeof(expression));
 	memset(yield, 0, sizeof(expression));
 	yield->kind = kind;
 	yield->token = *token;
@@ -48,7 +48,7 @@ static expression *s_binary_expression(uint32_t kind, lex_token *token, foodtype
 /* A constructor for a ternary expression. */
 static expression *s_ternary_expression(uint32_t kind, lex_token *token, foodtype *type, expression *extra, expression *left, expression *right)
 {
-	expression *yield = malloc(sizeof(expression));
+	expression *yield = MEM_MALLOC(MEM_PARSER, sizeof(expression));
 	memset(yield, 0, sizeof(expression));
 	yield->kind = kind;
 	yield->token = *token;
@@ -68,8 +68,12 @@ static expression *parse_literal(void)
 	foodtype literalType;
 	expression *yield = NULL;
 	if (!lex_fetch(&s_currentToken)) {
-		fprintf(stderr, "no input is present\n");
-		abort();
+		if (!diag_stopped()) {
+			dfatal("no input is present");
+		}
+		/* Past the error limit, the expression is read as a zero so the parser unwinds. */
+		memset(&s_currentToken, 0, sizeof(s_currentToken));
+		s_currentToken.kind = '0';
 	}
 
 	if (s_currentToken.kind == '0') {
@@ -116,8 +120,8 @@ static expression *parse_literal(void)
 		}
 		return yield;
 	}
-	fprintf(stderr, "invalid expression\n");
-	abort();
+	dfatal("invalid expression");
+	return NULL;
 }
 
 /* Parses all postfix unary operators and also the member access operators. */
@@ -469,7 +473,9 @@ static expression *conditional(void)
 
 expression *parse_expression(void)
 {
-	expression *yield = conditional();
-	esimple(&yield);
+	expression *yield;
+	if (time_enabled) time_enter(PHASE_PARSE, 0);
+	yield = conditional();
+	if (time_enabled) time_leave(PHASE_PARSE);
 	return yield;
 }
@@ -126,8 +126,7 @@ void type_expression(foodtype *dest, foodtype *expected, foodtype *left, foodtyp
 			return;
 		}
 
-		printf("type expected is not compatible with expression\n");
-		abort();
+		dfatal("type expected is not compatible with expression");
 	}
 
 	/*
@@ -172,8 +171,7 @@ void type_expression(foodtype *dest, foodtype *expected, foodtype *left, foodtyp
 		}
 	}
 
-	printf("left and right parts of the expression are not compatible, %d != %d\n", left->kind, right->kind);
-	abort();
+	dfatal("left and right parts of the expression are not compatible, %d != %d", left->kind, right->kind);
 }
 
 uint32_t kind_unary(uint64_t operator)
@@ -288,80 +286,117 @@ void expression_print(expression *expr, int indent)
 	}
 }
 
-uint64_t eval(expression *tree, bool_t *failed)
+/* Truncates a value to size bytes, then extends it back to 64 bits. */
+static uint64_t s_extend(uint64_t value, size_t size, bool_t is_signed)
 {
-	*failed = FALSE;
+	uint64_t mask;
+	if (!size || size >= 8) return value;
+	mask = ((uint64_t)1 << (size * 8)) - 1;
+	value &= mask;
+	if (is_signed && (value >> (size * 8 - 1)) & 1) value |= ~mask;
+	return value;
+}
+
+static uint64_t s_eval(expression *tree, bool_t *failed);
+
+/*
+	Computes a tree like the generated code: at the size of its type,
+	signed but for >> of an unsigned type, its operands extended from
+	their own type. Only sets *failed when a part cannot be computed.
+*/
+static uint64_t s_compute(expression *tree, bool_t *failed)
+{
+	size_t size = rsizeof(&tree->type);
+	uint64_t l, r;
+	int64_t sl, sr;
 	switch (tree->kind)
 	{
 		case EXPRESSION_INTEGER_LITERAL:
 			return tree->token.value.u64;
 		
-		case EXPRESSION_ADDITION:
-			return eval(tree->left, failed) + eval(tree->right, failed);
-		
-		case EXPRESSION_SUBTRACTION:
-			return eval(tree->left, failed) - eval(tree->right, failed);
-		
-		case EXPRESSION_MULTIPLY:
-			return eval(tree->left, failed) * eval(tree->right, failed);
-		
-		case EXPRESSION_DIVISION:
-			return eval(tree->left, failed) / eval(tree->right, failed);
-		
-		case EXPRESSION_MODULO:
-			return eval(tree->left, failed) % eval(tree->right, failed);
-		
-		case EXPRESSION_BITWISE_AND:
-			return eval(tree->left, failed) & eval(tree->right, failed);
-		
-		case EXPRESSION_BITWISE_OR:
-			return eval(tree->left, failed) | eval(tree->right, failed);
-		
-		case EXPRESSION_BITWISE_XOR:
-			return eval(tree->left, failed) ^ eval(tree->right, failed);
+		case EXPRESSION_BOOLEAN_LITERAL:
+			if (tree->token.kind == KEYWORD_TRUE) return TRUE;
+			else return FALSE;
+
+		case EXPRESSION_POSTFIX_UNARY_PLUS:
+			return s_eval(tree->left, failed);
+
+		case EXPRESSION_POSTFIX_UNARY_MINUS:
+			return 0 - s_eval(tree->left, failed);
 
-		case EXPRESSION_LSHIFT:
-			/* % 64 is to prevent overflow */
-			return eval(tree->left, failed) << eval(tree->right, failed) % 64;
-		
-		case EXPRESSION_RSHIFT:
-			return eval(tree->left, failed) >> eval(tree->right, failed) % 64;
-		
-		case EXPRESSION_LOWER:
-			return eval(tree->left, failed) < eval(tree->right, failed);
-		
-		case EXPRESSION_LOWER_OR_EQUAL:
-			return eval(tree->left, failed) <= eval(tree->right, failed);
-		
-		case EXPRESSION_GREATER:
-			return eval(tree->left, failed) > eval(tree->right, failed);
-		
-		case EXPRESSION_GREATER_OR_EQUAL:
-			return eval(tree->left, failed) >= eval(tree->right, failed);
-		
 		case EXPRESSION_POSTFIX_BITWISE_NOT:
-			return ~eval(tree->left, failed);
+			return ~s_eval(tree->left, failed);
 		
 		case EXPRESSION_POSTFIX_LOGICAL_NOT:
-			return !eval(tree->left, failed);
+			return !s_eval(tree->left, failed);
 		
 		case EXPRESSION_LOGICAL_AND:
-			return eval(tree->left, failed) && eval(tree->right, failed);
+			return s_eval(tree->left, failed) && s_eval(tree->right, failed);
 
 		case EXPRESSION_LOGICAL_OR:
-			return eval(tree->left, failed) || eval(tree->right, failed);
+			return s_eval(tree->left, failed) || s_eval(tree->right, failed);
 		
 		case EXPRESSION_TERNARY_CONDITIONAL:
-			return eval(tree->extra, failed) ? eval(tree->left, failed) : eval(tree->right, failed);
-		
-		case EXPRESSION_BOOLEAN_LITERAL:
-			if (tree->token.kind == KEYWORD_TRUE) return TRUE;
-			else return FALSE;
+			return s_eval(tree->extra, failed) ? s_eval(tree->left, failed) : s_eval(tree->right, failed);
 
 		default:
-			*failed = TRUE;
-			return 0;
+			break;
+	}
+
+	if (!is_binary(tree)) {
+		*failed = TRUE;
+		return 0;
+	}
+	l = s_eval(tree->left, failed);
+	r = s_eval(tree->right, failed);
+	sl = (int64_t)s_extend(l, size, TRUE);
+	sr = (int64_t)s_extend(r, size, TRUE);
+	switch (tree->kind)
+	{
+		case EXPRESSION_ADDITION: return l + r;
+		case EXPRESSION_SUBTRACTION: return l - r;
+		case EXPRESSION_MULTIPLY: return l * r;
+		case EXPRESSION_BITWISE_AND: return l & r;
+		case EXPRESSION_BITWISE_OR: return l | r;
+		case EXPRESSION_BITWISE_XOR: return l ^ r;
+
+		case EXPRESSION_DIVISION:
+		case EXPRESSION_MODULO:
+			/* A division by zero, or of the lowest value by -1, is left to the code, which traps. */
+			if (!sr || (sr == -1 && sl && s_extend(0 - l, size, TRUE) == (uint64_t)sl)) break;
+			return tree->kind == EXPRESSION_DIVISION ? (uint64_t)(sl / sr) : (uint64_t)(sl % sr);
+
+		/* The processor only keeps the low bits of the count. */
+		case EXPRESSION_LSHIFT:
+			return l << (r & (size == 8 ? 63 : 31));
+		case EXPRESSION_RSHIFT:
+			if (is_unsigned(&tree->type)) return s_extend(l, size, FALSE) >> (r & (size == 8 ? 63 : 31));
+			return (uint64_t)(sl >> (r & (size == 8 ? 63 : 31)));
+
+		case EXPRESSION_LOWER: return sl < sr;
+		case EXPRESSION_LOWER_OR_EQUAL: return sl <= sr;
+		case EXPRESSION_GREATER: return sl > sr;
+		case EXPRESSION_GREATER_OR_EQUAL: return sl >= sr;
+		case EXPRESSION_EQUAL: return sl == sr;
+		case EXPRESSION_NOT_EQUAL: return sl != sr;
+
+		default:
+			break;
 	}
+	*failed = TRUE;
+	return 0;
+}
+
+/* Computes a tree, truncated to its type then extended to 64 bits. */
+static uint64_t s_eval(expression *tree, bool_t *failed)
+{
+	return s_extend(s_compute(tree, failed), rsizeof(&tree->type), !is_unsigned(&tree->type));
+}
+
+uint64_t eval(expression *tree, bool_t *failed)
+{
+	*failed = FALSE;
+	return s_eval(tree, failed);
 }
 
 static void simplify_node(expression **node, uint64_t v)
@@ -369,7 +404,7 @@ static void simplify_node(expression **node, uint64_t v)
 	expression *discard;
 	expression *new;
 	
-	new = calloc(1, sizeof(expression));
+	new = MEM_CALLOC(MEM_PARSER, 1, sizeof(expression));
 	memcpy(&new->type, &(*node)->type, sizeof(foodtype));
 	new->kind = EXPRESSION_INTEGER_LITERAL;
 	new->token.pos = (*node)->token.pos;
@@ -381,7 +416,7 @@ static void simplify_node(expression **node, uint64_t v)
 	delete_tree(discard);
 }
 
-void esimple(expression **tree)
+static void s_simplify(expression **tree)
 {
 	bool_t fail_status = FALSE;
 	uint64_t simplified;
@@ -427,6 +462,17 @@ void esimple(expression **tree)
 	}
 }
 
+void esimple(expression **tree)
+{
+	if (!time_enabled) {
+		s_simplify(tree);
+		return;
+	}
+	time_enter(PHASE_FOLD, 0);
+	s_simplify(tree);
+	time_leave(PHASE_FOLD);
+}
+
 bool_t is_unsigned(foodtype *t)
 {
 	if (t->kind == TYPE_BOOL
@@ -8,6 +8,9 @@
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#ifdef ECK_THREADS
+	#include <unistd.h>
+#endif
 
 /*
 	Used to tell the lexer to redo the lexing,
@@ -96,6 +99,7 @@ static lex_keyword_table_entry s_keywords[] =
 
 static FILE *s_fstream; /* Input file stream */
 static uint64_t s_fstreamPos; /* The current position in the stream */
+static ECK_TLS const lex_hooks *s_hooks; /* Where this thread takes its tokens from, if not from the stream */
 
 /* Returns current character. */
 static char s_getc(void)
@@ -223,8 +227,7 @@ zero:
 			while (isdigit(c)) {
 				uint64_t resultVal = raiseTo + (c - '0') * expScale;
 				if (resultVal > UINT8_MAX) {
-					fprintf(stderr, "lex number parser: TODO error handling, exponent out of bounds\n");
-					abort();
+					dfatal("lex number parser: TODO error handling, exponent out of bounds");
 				}
 				raiseTo = resultVal;
 				expScale *= 10;
@@ -343,8 +346,7 @@ static char s_parse_escape_sequence(char c)
 					c = resultC > UINT8_MAX ? UINT8_MAX : resultC;
 					break;
 				} else {
-					fprintf(stderr, "lexer, escape sequence parser: unknown escape sequence \\%c\n", c);
-					abort();
+					dfatal("lexer, escape sequence parser: unknown escape sequence \\%c", c);
 				}
 			}
 		}
@@ -377,8 +379,7 @@ static void s_parse_character_literal(lex_value *yield)
 		space too.
 	*/
 	if (c == EOF || c != '\'') {
-		fprintf(stderr, "lexer, character literal parser: character literal does not end\n");
-		abort();
+		dfatal("lexer, character literal parser: character literal does not end");
 	}
 	(void)s_advance();
 	yield->u64 = result;
@@ -426,7 +427,7 @@ static keyword s_parse_keyword_ident(char c, lex_value *yield)
 		important to free up the previous memory, we
 		don't want any memory leaks.
 	*/
-	yield->str = malloc(strBuilder.length + 1);
+	yield->str = MEM_MALLOC(MEM_LEXER, strBuilder.length + 1);
 	strcpy(yield->str, strBuilder.storage);
 	strbuilder_free(&strBuilder);
 	return 'I';
@@ -569,6 +570,12 @@ void lex_setup(FILE *stream)
 
 	s_fstream = stream;
 	s_fstreamPos = 0;
+	s_hooks = NULL;
+}
+
+void lex_redirect(const lex_hooks *hooks)
+{
+	s_hooks = hooks;
 }
 
 /*
@@ -576,6 +583,7 @@ void lex_setup(FILE *stream)
 */
 size_t lex_pos(void)
 {
+	if (s_hooks) return s_hooks->pos();
 	return s_fstreamPos;
 }
 
@@ -584,11 +592,30 @@ size_t lex_pos(void)
 */
 void lex_move(size_t position)
 {
+	if (s_hooks) {
+		s_hooks->move(position);
+		return;
+	}
 	fseek(s_fstream, position, SEEK_SET);
 	s_fstreamPos = position;
 }
 
 bool_t lex_fetch(lex_token *tokenBuffer)
+{
+	bool_t yield;
+	/* Past the error limit, the source ends right away. */
+	if (diag_stopped()) return FALSE;
+	if (!time_enabled) {
+		if (s_hooks) return s_hooks->fetch(tokenBuffer);
+		return lex_scan(tokenBuffer);
+	}
+	time_enter(PHASE_LEX, 0);
+	yield = s_hooks ? s_hooks->fetch(tokenBuffer) : lex_scan(tokenBuffer);
+	time_leave(PHASE_LEX);
+	return yield;
+}
+
+bool_t lex_scan(lex_token *tokenBuffer)
 {
 	char c;
 	lex_token tokenInstance;
@@ -629,7 +656,7 @@ bool_t lex_fetch(lex_token *tokenBuffer)
 		recursive.
 	*/
 	if (tokenInstance.kind == REDO_LEXING)
-		return lex_fetch(tokenBuffer);
+		return lex_scan(tokenBuffer);
 	if (tokenInstance.kind) *tokenBuffer = tokenInstance; 
 
 	return tokenInstance.kind;
@@ -658,19 +685,25 @@ void lex_site(lex_token *site, size_t *line, size_t *col)
 	*line = 1;
 	*col = 1;
 
-	/* 2. Moving to the base */
-	base = lex_pos();
-	lex_move(0);
-	
-	/* 3. Getting the contents of the file up to the current token */
+	/* 2. Getting the contents of the file up to the current token */
 	contents = malloc(site->pos + 1);
 	memset(contents, 0, site->pos + 1);
-	DISCARD(fread(contents, 1, site->pos, s_fstream));
-
-	/* 4. Restauring the actual position */
-	lex_move(base);
+#ifdef ECK_THREADS
+	if (s_hooks) {
+		/* The stream belongs to the lexer thread, it is read without moving. */
+		DISCARD(pread(fileno(s_fstream), contents, site->pos, 0));
+	} else
+#endif
+	{
+		base = s_fstreamPos;
+		fseek(s_fstream, 0, SEEK_SET);
+		DISCARD(fread(contents, 1, site->pos, s_fstream));
+
+		/* 3. Restauring the actual position */
+		fseek(s_fstream, base, SEEK_SET);
+	}
 
-	/* 5. Counting */
+	/* 4. Counting */
 	begin = contents;
 	end = begin + site->pos;
 	for (; begin <= end; begin++) {
@@ -704,3 +737,34 @@ void lex_site(lex_token *site, size_t *line, size_t *col)
 	}
 	free(contents);
 }
+
+void lex_sites(const uint64_t *positions, size_t count, size_t *lines, size_t *cols)
+{
+	size_t base = s_fstreamPos, i, line = 1, col = 1;
+	uint64_t at = 0;
+	int c = 0;
+
+	fseek(s_fstream, 0, SEEK_SET);
+	for (i = 0; i < count; i++) {
+		/* Counted the same way as lex_site. */
+		for (; at < positions[i]; at++) {
+			if (c != EOF) c = fgetc(s_fstream);
+			if (c == '\n') {
+				line++;
+				col = 0;
+			} else if (c == '\r') {
+				col = 0;
+			} else if (c == '\f') {
+				line++;
+			} else if (c == '\t') {
+				col += 4;
+			} else {
+				col++;
+			}
+		}
+		/* The token itself */
+		lines[i] = line;
+		cols[i] = col + 1;
+	}
+	fseek(s_fstream, base, SEEK_SET);
+}
@@ -0,0 +1,278 @@
+/*
+	Compilation timers for ECK (-ftime-report, -ftime-trace)
+
+	The timed functions check time_enabled and only then call
+	time_enter and time_leave, so the timers cost a test when
+	disabled. Each thread keeps a stack of the phases it is in: a
+	phase gets its self time (without the phases it called), and
+	its inclusive time counted from the outermost call only, so
+	recursive phases are not counted twice.
+
+	-ftime-report prints the phases after each source, along with
+	the peak memory of the process so far and the slowest top-level
+	statements. -ftime-trace=FILE writes the
+	compilations, the top-level statements and the output flushes
+	as Chrome trace events (chrome://tracing, Perfetto) at exit.
+*/
+#include "common/def.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+bool_t time_enabled = FALSE;
+bool_t time_report = FALSE;
+const char *time_trace = NULL;
+
+/* The deepest nesting timed. Deeper phases are counted as part of their parent. */
+#define TIME_DEPTH 256
+
+/* The number of statements listed by -ftime-report. */
+#define TIME_SLOWEST 10
+
+static const char *const s_names[PHASE_COUNT] = { "compile", "lex", "parse", "fold", "statement", "generate", "flush" };
+
+/* A phase being timed. */
+typedef struct time_frame
+{
+	uint64_t start;    /* When it was entered, in nanoseconds. */
+	uint64_t children; /* The time spent in the phases it called. */
+	size_t event;      /* Its trace event plus one, 0 if none. */
+	uint8_t phase;
+} time_frame;
+
+/* A compilation, a top-level statement or a flush, as traced. */
+typedef struct time_event
+{
+	uint8_t phase;
+	const char *file; /* The source. */
+	uint64_t pos;     /* The offset of a statement. */
+	size_t line, col; /* Computed once the source is done. */
+	uint64_t start;   /* In nanoseconds. */
+	uint64_t duration;
+} time_event;
+
+static ECK_TLS time_frame s_stack[TIME_DEPTH];
+static ECK_TLS size_t s_depth = 0;
+static ECK_TLS size_t s_overflow = 0; /* The number of phases entered past TIME_DEPTH. */
+static ECK_TLS uint32_t s_active[PHASE_COUNT];
+
+/* Updated by every thread. */
+static uint64_t s_inclusive[PHASE_COUNT];
+static uint64_t s_self[PHASE_COUNT];
+static uint64_t s_calls[PHASE_COUNT];
+
+/* Only recorded by the main thread: the phases below are never entered by the others. */
+static time_event *s_events = NULL;
+static size_t s_event_count = 0, s_event_max = 0;
+static size_t s_source_first = 0; /* The first event of the source being compiled. */
+static uint64_t s_origin = 0;     /* The time of the first event. */
+
+static uint64_t s_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+#else
+	return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+static void s_add(uint64_t *to, uint64_t value)
+{
+#ifdef ECK_THREADS
+	__atomic_fetch_add(to, value, __ATOMIC_RELAXED);
+#else
+	*to += value;
+#endif
+}
+
+static bool_t s_traced(time_phase phase)
+{
+	return phase == PHASE_COMPILE || phase == PHASE_STATEMENT || phase == PHASE_FLUSH;
+}
+
+void time_enter(time_phase phase, uint64_t pos)
+{
+	time_frame *frame;
+	if (s_depth == TIME_DEPTH) {
+		s_overflow++;
+		return;
+	}
+	frame = &s_stack[s_depth++];
+	frame->phase = (uint8_t)phase;
+	frame->children = 0;
+	frame->event = 0;
+	s_active[phase]++;
+
+	if (s_traced(phase)) {
+		if (s_event_count == s_event_max) {
+			s_event_max = s_event_max ? s_event_max * 2 : 1024;
+			s_events = realloc(s_events, sizeof(time_event) * s_event_max);
+		}
+		memset(&s_events[s_event_count], 0, sizeof(time_event));
+		s_events[s_event_count].phase = (uint8_t)phase;
+		s_events[s_event_count].pos = pos;
+		frame->event = ++s_event_count;
+	}
+	/* Last, so that the bookkeeping is not timed. */
+	frame->start = s_now();
+	if (!s_origin) s_origin = frame->start;
+}
+
+void time_leave(time_phase phase)
+{
+	uint64_t now = s_now(), elapsed;
+	time_frame *frame;
+	if (s_overflow) {
+		s_overflow--;
+		return;
+	}
+	frame = &s_stack[--s_depth];
+	elapsed = now - frame->start;
+	if (s_depth) s_stack[s_depth - 1].children += elapsed;
+
+	s_add(&s_self[phase], elapsed - frame->children);
+	s_add(&s_calls[phase], 1);
+	if (--s_active[phase] == 0) s_add(&s_inclusive[phase], elapsed);
+
+	if (frame->event) {
+		time_event *event = &s_events[frame->event - 1];
+		event->start = frame->start;
+		event->duration = elapsed;
+		event->file = diag_source;
+	}
+}
+
+void time_locate(void)
+{
+	uint64_t *positions;
+	size_t *lines, *cols, *events, count = 0, i;
+
+	positions = malloc(sizeof(uint64_t) * (s_event_count - s_source_first + 1));
+	events = malloc(sizeof(size_t) * (s_event_count - s_source_first + 1));
+	for (i = s_source_first; i < s_event_count; i++) {
+		if (s_events[i].phase != PHASE_STATEMENT) continue;
+		/* The statements come in the order of the source. */
+		positions[count] = s_events[i].pos;
+		events[count++] = i;
+	}
+	lines = malloc(sizeof(size_t) * (count + 1));
+	cols = malloc(sizeof(size_t) * (count + 1));
+	lex_sites(positions, count, lines, cols);
+	for (i = 0; i < count; i++) {
+		s_events[events[i]].line = lines[i];
+		s_events[events[i]].col = cols[i];
+	}
+	free(positions);
+	free(events);
+	free(lines);
+	free(cols);
+}
+
+static int s_by_duration(const void *a, const void *b)
+{
+	const time_event *l = *(time_event * const *)a, *r = *(time_event * const *)b;
+	if (l->duration != r->duration) return l->duration > r->duration ? -1 : 1;
+	return l < r ? -1 : (l > r);
+}
+
+/*
+	Gets the most memory the process has had resident, in kilobytes.
+	The one of getrusage includes the process it was started from on
+	Linux, so the one of the current image is read from /proc.
+*/
+static unsigned long s_peak_rss(void)
+{
+	unsigned long yield = 0;
+	char line[256];
+	FILE *status = fopen("/proc/self/status", "r");
+	if (!status) return 0;
+	while (fgets(line, sizeof(line), status)) {
+		if (sscanf(line, "VmHWM: %lu kB", &yield) == 1) break;
+	}
+	fclose(status);
+	return yield;
+}
+
+void time_source_done(const char *source)
+{
+	time_event **statements;
+	char site[256];
+	size_t count = 0, i;
+	int phase;
+
+	if (time_report) {
+		fprintf(stderr, "time report for %s:\n", source);
+		fprintf(stderr, "  %-10s %12s %12s %10s\n", "phase", "total ms", "self ms", "calls");
+		for (phase = 0; phase < PHASE_COUNT; phase++) {
+			if (!s_calls[phase]) continue;
+			fprintf(stderr, "  %-10s %12.3f %12.3f %10lu\n", s_names[phase],
+				s_inclusive[phase] * 1e-6, s_self[phase] * 1e-6, (unsigned long)s_calls[phase]);
+		}
+		if (s_peak_rss()) fprintf(stderr, "  peak RSS %lu KB\n", s_peak_rss());
+
+		statements = malloc(sizeof(time_event *) * (s_event_count - s_source_first + 1));
+		for (i = s_source_first; i < s_event_count; i++) {
+			if (s_events[i].phase == PHASE_STATEMENT) statements[count++] = &s_events[i];
+		}
+		qsort(statements, count, sizeof(time_event *), s_by_duration);
+		if (count) fprintf(stderr, "  slowest top-level statements:\n");
+		for (i = 0; i < count && i < TIME_SLOWEST; i++) {
+			sprintf(site, "%.200s:%lu:%lu", source, (unsigned long)statements[i]->line, (unsigned long)statements[i]->col);
+			fprintf(stderr, "    %-32s %10.3f ms\n", site, statements[i]->duration * 1e-6);
+		}
+		free(statements);
+	}
+
+	memset(s_inclusive, 0, sizeof(s_inclusive));
+	memset(s_self, 0, sizeof(s_self));
+	memset(s_calls, 0, sizeof(s_calls));
+	/* The events are only kept for the trace. */
+	if (!time_trace) s_event_count = 0;
+	s_source_first = s_event_count;
+}
+
+/* Writes a string as JSON. */
+static void s_json(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fputc('\\', out);
+		if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", (unsigned char)*s);
+		else fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+bool_t time_trace_write(const char *path)
+{
+	time_event *event;
+	FILE *out;
+	size_t i;
+
+	out = fopen(path, "w");
+	if (!out) return FALSE;
+	fprintf(out, "{\"traceEvents\":[\n");
+	for (i = 0; i < s_event_count; i++) {
+		event = &s_events[i];
+		fprintf(out, "%s{\"name\":", i ? ",\n" : "");
+		if (event->phase == PHASE_STATEMENT) {
+			char name[64];
+			sprintf(name, "statement %lu:%lu", (unsigned long)event->line, (unsigned long)event->col);
+			s_json(out, name);
+		} else {
+			s_json(out, s_names[event->phase]);
+		}
+		fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1,\"args\":{\"file\":",
+			s_names[event->phase], (event->start - s_origin) * 1e-3, event->duration * 1e-3);
+		s_json(out, event->file ? event->file : "");
+		if (event->phase == PHASE_STATEMENT) {
+			fprintf(out, ",\"line\":%lu,\"column\":%lu", (unsigned long)event->line, (unsigned long)event->col);
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	return fclose(out) == 0;
+}
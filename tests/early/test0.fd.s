@@ -5,7 +5,7 @@
 	mov ebx, 4 ; primary(size = 4)
 	.L0003:
 	xor ebx, ebx ; zero(size = 4)
-	test bl, bl
+	test ebx, ebx
 	je .L0004
 	mov ebx, 33 ; primary(size = 4)
 	mov ebx, 11 ; primary(size = 4)
@@ -17,13 +17,13 @@
 	jmp .L0002
 	.L0000:
 	mov ebx, 7 ; primary(size = 4)
-	test bl, bl
+	test ebx, ebx
 	jne .L0001
 	jmp .L0005
 	.L0002:
 	.L0006:
 	mov ebx, 1 ; primary(size = 4)
-	test bl, bl
+	test ebx, ebx
 	je .L0007
 	mov ebx, 6 ; primary(size = 4)
 	.L0008:
@@ -39,15 +39,15 @@
 	jmp .L000B
 	.L0009:
 	mov ebx, 3 ; primary(size = 4)
-	test bl, bl
+	test ebx, ebx
 	jne .L000A
 	jmp .L000C
 	.L000B:
 	mov ebx, 2160 ; primary(size = 4)
-	test bl, bl
+	test ebx, ebx
 	jne .L0008
 	mov ecx, 4 ; primary(size = 4)
 	jmp .L0006
 	.L0007:
-	mov ecx, 9 ; primary(size = 4)
-	mov ecx, 234 ; primary(size = 4)
+	mov ebx, 9 ; primary(size = 4)
+	mov ebx, 234 ; primary(size = 4)
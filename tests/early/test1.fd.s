@@ -0,0 +1,11 @@
+	push rbp
+	mov rbp, rsp
+	sub rsp, 32
+	mov ebx, 7 ; primary(size = 4)
+	push rbp
+	mov rbp, rsp
+	sub rsp, 16
+	mov rsp, rbp
+	pop rbp
+	mov rsp, rbp
+	pop rbp
@@ -0,0 +1,13 @@
+	jmp .L0000
+	.L0001:
+	mov rbx, 2047 ; primary(size = 8)
+	jmp .L0002
+	.L0003:
+	xor ebx, ebx ; zero(size = 4)
+	jmp .L0002
+	.L0000:
+	mov ebx, 256 ; primary(size = 4)
+	test ebx, ebx
+	jne .L0001
+	jmp .L0003
+	.L0002: